@@ -72,6 +72,13 @@ class SmolVLMManager(private val context: Context) {
                 llamaAndroid.loadMmproj(mmprojPath!!)
                 isMmprojLoaded = true
                 Log.i(tag, "Mmproj loaded successfully - Vision support enabled")
+
+                // Pay kernel compilation and buffer allocation now rather than on the first frame
+                try {
+                    llamaAndroid.warmup()
+                } catch (e: IllegalStateException) {
+                    Log.w(tag, "Warmup failed, first frame will be slower", e)
+                }
             }
         } catch (e: Exception) {
             Log.e(tag, "Failed to initialize model", e)
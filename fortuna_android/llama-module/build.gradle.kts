@@ -75,6 +75,8 @@ android {
                 arguments += "-DGGML_OPENCL=ON"
                 arguments += "-DGGML_OPENCL_USE_ADRENO_KERNELS=ON"
                 arguments += "-DGGML_OPENCL_EMBED_KERNELS=ON"
+                // Profiling build with ATrace sections and counters: ./gradlew -PllamaTrace=ON
+                arguments += "-DLLAMA_ANDROID_TRACE=${project.findProperty("llamaTrace") ?: "OFF"}"
 
                 // Set OpenCL library path for Android cross-compilation
                 val openclLib = "${project.rootDir}/app/src/main/jniLibs/${android.defaultConfig.ndk.abiFilters.first()}/libOpenCL.so"
@@ -0,0 +1,4 @@
+# Fields of LlamaParams are read from native code by name
+-keepclassmembers class android.llama.cpp.LlamaParams { <fields>; }
+# Constructed from native code
+-keep class android.llama.cpp.CameraFrameResult { <init>(...); }
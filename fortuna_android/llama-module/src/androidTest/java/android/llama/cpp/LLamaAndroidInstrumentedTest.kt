@@ -1,14 +1,19 @@
 package android.llama.cpp
 
+import android.content.ComponentCallbacks2
 import android.graphics.Bitmap
+import android.graphics.Rect
 import androidx.test.ext.junit.runners.AndroidJUnit4
 import androidx.test.platform.app.InstrumentationRegistry
 import kotlinx.coroutines.flow.toList
+import kotlinx.coroutines.runBlocking
 import kotlinx.coroutines.test.runTest
 import org.junit.Assert.*
+import org.junit.Assume.assumeTrue
 import org.junit.Before
 import org.junit.Test
 import org.junit.runner.RunWith
+import java.io.File
 
 /**
  * Instrumented test for LLamaAndroid
@@ -51,6 +56,17 @@ class LLamaAndroidInstrumentedTest {
         }
     }
 
+    @Test
+    fun testBenchMultimodal_ThrowsWhenNoModelLoaded() = runTest {
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+        try {
+            llama.benchMultimodal("test", bitmap)
+            fail("Should throw IllegalStateException when no model loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("No model loaded", e.message)
+        }
+    }
+
     @Test
     fun testBench_WithDefaultNr() = runTest {
         try {
@@ -105,6 +121,103 @@ class LLamaAndroidInstrumentedTest {
         assertTrue(true)
     }
 
+    @Test
+    fun testLoad_WithCustomParamsThrowsWhenModelFileInvalid() = runTest {
+        val params = LlamaParams(nCtx = 512, typeK = LlamaParams.GGML_TYPE_F16, nThreads = 2, nGpuLayers = 0)
+        try {
+            llama.load("/invalid/path/to/model.gguf", params)
+            fail("Should throw IllegalStateException for invalid model")
+        } catch (e: IllegalStateException) {
+            assertTrue(e.message?.contains("failed") == true)
+        }
+    }
+
+    @Test
+    fun testLoadAll_ThrowsWhenFilesInvalid() = runTest {
+        try {
+            llama.loadAll("/invalid/path/to/model.gguf", "/invalid/path/to/mmproj.gguf")
+            fail("Should throw IllegalStateException for invalid files")
+        } catch (e: IllegalStateException) {
+            assertTrue(e.message?.contains("failed") == true)
+        }
+    }
+
+    @Test
+    fun testAutotune_ThrowsWhenNoModelLoaded() = runTest {
+        val cacheFile = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "autotune.properties")
+        try {
+            llama.autotune(cacheFile)
+            fail("Should throw IllegalStateException when no model loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("No model loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testWarmup_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.warmup()
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testStartCameraSession_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.startCameraSession("test")
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testSubmitFrame_ReturnsFalseWithoutSession() {
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+
+        assertFalse(llama.submitFrame(bitmap, 0L))
+    }
+
+    @Test
+    fun testPushAudio_ReturnsFalseWithoutStream() {
+        assertFalse(llama.pushAudio(FloatArray(1600)))
+    }
+
+    @Test
+    fun testStartAudioStream_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.startAudioStream()
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testCameraResults_ThrowsWithoutSession() = runTest {
+        try {
+            llama.cameraResults().toList()
+            fail("Should throw IllegalStateException without a camera session")
+        } catch (e: IllegalStateException) {
+            assertEquals("Camera session not started", e.message)
+        }
+    }
+
+    @Test
+    fun testStopCameraSession_NoOpWithoutSession() = runTest {
+        llama.stopCameraSession()
+        assertTrue(true)
+    }
+
+    @Test
+    fun testCancelGeneration_NoOpWhenIdle() {
+        // Should not throw when nothing is being generated
+        llama.cancelGeneration()
+        assertTrue(true)
+    }
+
     @Test
     fun testLoadMmproj_ThrowsWhenNoModelLoaded() = runTest {
         try {
@@ -305,6 +418,175 @@ class LLamaAndroidInstrumentedTest {
         }
     }
 
+    @Test
+    fun testSendWithImages_ThrowsWhenNoModelLoaded() = runTest {
+        val bitmaps = List(3) { Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888) }
+
+        try {
+            val flow = llama.sendWithImages("test", bitmaps)
+            flow.toList()
+            fail("Should throw when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testSendWithImage_WithStopCondition_ThrowsWhenNoModelLoaded() = runTest {
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+        val stop = StopCondition(strings = listOf("\n"), regex = "(fire|water)", jsonObject = true)
+
+        try {
+            llama.sendWithImage("test", bitmap, stop).toList()
+            fail("Should throw when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testSendConcurrent_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.sendConcurrent("test").toList()
+            fail("Should throw when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testClassifyRegions_ThrowsWhenNoModelLoaded() = runTest {
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+        val regions = listOf(Rect(0, 0, 32, 32), Rect(32, 32, 64, 64))
+
+        try {
+            llama.classifyRegions("test", bitmap, regions, listOf("fire", "water"))
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testSaveSession_ThrowsWhenNoModelLoaded() = runTest {
+        val file = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "session.bin")
+        try {
+            llama.saveSession(file)
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testRestoreSession_ThrowsWhenNoModelLoaded() = runTest {
+        val file = File(InstrumentationRegistry.getInstrumentation().targetContext.cacheDir, "session.bin")
+        try {
+            llama.restoreSession(file)
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testClassifyImage_ThrowsWhenNoModelLoaded() = runTest {
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+
+        try {
+            llama.classifyImage("test", bitmap, listOf("fire", "water"))
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testTraceCounters_NullOrNonNegative() {
+        // null in the default build, a snapshot of counters in a tracing build
+        val counters = llama.traceCounters() ?: return
+        assertTrue(counters.frames >= 0)
+        assertTrue(counters.generatedTokens >= 0)
+        assertTrue(counters.bytesAllocated >= 0)
+
+        llama.traceReset()
+        assertNotNull(llama.traceOpStats())
+    }
+
+    @Test
+    fun testThermalAdaptation_WorksWithoutModel() {
+        val context = InstrumentationRegistry.getInstrumentation().targetContext
+
+        // enabling twice keeps a single listener, both calls must not throw without a model
+        llama.enableThermalAdaptation(context)
+        llama.enableThermalAdaptation(context)
+        llama.disableThermalAdaptation(context)
+
+        // no camera session: frames are still rejected
+        val bitmap = Bitmap.createBitmap(64, 64, Bitmap.Config.ARGB_8888)
+        assertFalse(llama.submitFrame(bitmap, 0L))
+    }
+
+    @Test
+    fun testMemoryUsage_ThrowsWhenNoModelLoaded() = runTest {
+        // without a model, trimming is remembered for the next load and must not throw
+        llama.trimMemory(ComponentCallbacks2.TRIM_MEMORY_COMPLETE)
+        llama.trimMemory(0)
+
+        try {
+            llama.memoryUsage()
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testSetSampler_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.setSampler(SamplerParams(temperature = 0.8f, topK = 40, topP = 0.95f))
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    @Test
+    fun testCheckSampler_ThrowsWhenNoModelLoaded() = runTest {
+        try {
+            llama.checkSampler(SamplerParams(), 8)
+            fail("Should throw IllegalStateException when model not loaded")
+        } catch (e: IllegalStateException) {
+            assertEquals("Model not loaded", e.message)
+        }
+    }
+
+    // Needs a text model on the device, e.g.
+    // ./gradlew connectedAndroidTest -Pandroid.testInstrumentationRunnerArguments.modelPath=/data/local/tmp/model.gguf
+    @Test
+    fun testCheckSampler_CandidatesMatchFullVocabulary() = runBlocking {
+        val modelPath = InstrumentationRegistry.getArguments().getString("modelPath")
+        assumeTrue("No modelPath argument", modelPath != null && File(modelPath).exists())
+
+        val steps = 64
+        val chains = listOf(
+            SamplerParams(),
+            SamplerParams(repeatPenalty = 1.3f, repeatLastN = 16),
+            SamplerParams(temperature = 0.8f, topK = 40, topP = 0.95f, minP = 0.05f, seed = 42),
+            SamplerParams(temperature = 0.8f, topK = 20, repeatPenalty = 1.2f, repeatLastN = 32, seed = 7),
+            SamplerParams(repeatPenalty = 1.3f, repeatLastN = 16, grammar = "root ::= [a-z ]+"),
+            SamplerParams(temperature = 0.8f, topK = 40, repeatPenalty = 1.2f, grammar = "root ::= [a-z ]+", seed = 3),
+        )
+        llama.load(modelPath!!)
+        try {
+            for (params in chains) {
+                assertEquals("First differing step for $params", steps, llama.checkSampler(params, steps))
+            }
+        } finally {
+            llama.unload()
+        }
+    }
+
     @Test
     fun testInstance_ThreadSafety() {
         val instances = mutableListOf<LLamaAndroid>()
@@ -1,18 +1,106 @@
 #include <android/log.h>
 #include <android/bitmap.h>
 #include <jni.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <chrono>
+#include <sys/stat.h>
 #include "llama.h"
 #include "common.h"
+#include "llama-android.h"
 #include "mtmd/mtmd.h"
 #include "mtmd/mtmd-helper.h"
+#include "mtmd/mtmd-trace.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define TAG "llama-android-vlm.cpp"
 #define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 #define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
+// Performance cores for the vision encoder: the ones the text pool leaves free when there are
+// at least two, so a pipelined encode does not wait for a decode, otherwise all of them
+static void vision_cores(int n_text, int & first, int & n_cores) {
+    const int n_perf = cpu_topology_get().n_perf;
+    if (n_perf - n_text >= 2) {
+        first = n_text;
+        n_cores = n_perf - n_text;
+    } else {
+        first = 0;
+        n_cores = n_perf;
+    }
+}
+
+// Threadpool of the vision encoder of g_vision_ctx, and its thread count before thermal scaling.
+// Guarded by g_vision_mutex, set_thermal_scale is called from the thermal listener thread
+static std::mutex g_vision_mutex;
+static mtmd_context * g_vision_ctx = nullptr;
+static ggml_threadpool * g_vision_pool = nullptr;
+static int g_vision_threads = 0;
+
+static int vision_threads_scaled() {
+    return std::max(1, (int) lroundf(g_vision_threads * text_threads_thermal_scale()));
+}
+
+static void vision_threads_free(mtmd_context * ctx) {
+    std::lock_guard<std::mutex> lock(g_vision_mutex);
+    if (!ctx || g_vision_ctx != ctx) {
+        return;
+    }
+    mtmd_set_threadpool(ctx, nullptr);
+    ggml_threadpool_free(g_vision_pool);
+    g_vision_ctx = nullptr;
+    g_vision_pool = nullptr;
+}
+
+// Give the encoders of ctx a pool of n_threads on the cores picked by vision_cores()
+static void vision_threads_attach(mtmd_context * ctx, int n_threads, int n_text) {
+    int first = 0;
+    int n_cores = 0;
+    vision_cores(n_text, first, n_cores);
+    ggml_threadpool * pool = cpu_threadpool_new(n_threads, first, n_cores);
+    if (!pool) {
+        LOGe("vision_threads_attach: failed to create a threadpool of %d threads", n_threads);
+        return;
+    }
+    vision_threads_free(g_vision_ctx);
+    std::lock_guard<std::mutex> lock(g_vision_mutex);
+    mtmd_set_threadpool(ctx, pool);
+    g_vision_ctx = ctx;
+    g_vision_pool = pool;
+    g_vision_threads = n_threads;
+    mtmd_set_n_threads(ctx, vision_threads_scaled());
+    LOGi("Vision encoder: %d threads on performance cores %d..%d", n_threads, first, first + n_cores - 1);
+}
+
+// n_threads of 0 takes every core vision_cores() gives the encoder
+static mtmd_context_params mmproj_params(bool use_gpu, int n_threads, int n_text, int image_pool) {
+    struct mtmd_context_params params = mtmd_context_params_default();
+    params.use_gpu = use_gpu;
+    if (n_threads <= 0) {
+        int first = 0;
+        vision_cores(n_text, first, n_threads);
+    }
+    params.n_threads = n_threads;
+    params.verbosity = GGML_LOG_LEVEL_ERROR;
+    // Keep the embeddings of recent images so follow-up questions skip the vision encoder
+    params.embd_cache_size = 16 * 1024 * 1024;
+    // Average-pool image tokens after encoding, so prefill decodes image_pool^2 times fewer of them
+    params.image_pool = image_pool;
+    return params;
+}
+
 // Load mmproj (multimodal projector) model
 extern "C"
 JNIEXPORT jlong JNICALL
@@ -20,21 +108,21 @@ Java_android_llama_cpp_LLamaAndroid_load_1mmproj(
         JNIEnv *env,
         jobject,
         jstring mmproj_path,
-        jlong model_ptr) {
+        jlong model_ptr,
+        jboolean use_gpu,
+        jint n_threads,
+        jint image_pool) {
 
     const char *path = env->GetStringUTFChars(mmproj_path, nullptr);
     auto *text_model = reinterpret_cast<llama_model *>(model_ptr);
 
     LOGi("Loading mmproj from %s", path);
 
-    struct mtmd_context_params params = mtmd_context_params_default();
-    params.use_gpu = true;
-    // Vision encoder: 4 threads (balanced for performance)
-    params.n_threads = 4;
-    params.verbosity = GGML_LOG_LEVEL_ERROR;
+    const int n_text = text_threads_n_cores();
+    struct mtmd_context_params params = mmproj_params(use_gpu == JNI_TRUE, n_threads, n_text, image_pool);
 
     int total_cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
-    LOGi("🚀 Vision encoder: use_gpu=%d, cores_available=%d, threads=%d (balanced)", params.use_gpu, total_cores, params.n_threads);
+    LOGi("🚀 Vision encoder: use_gpu=%d, cores_available=%d, threads=%d", params.use_gpu, total_cores, params.n_threads);
     LOGi("📱 Device will use best available backend (GPU -> CPU fallback)");
 
     mtmd_context *ctx = mtmd_init_from_file(path, text_model, params);
@@ -46,6 +134,7 @@ Java_android_llama_cpp_LLamaAndroid_load_1mmproj(
         env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Failed to load mmproj");
         return 0;
     }
+    vision_threads_attach(ctx, params.n_threads, n_text);
 
     // Log successful initialization with backend info
     LOGi("✅ Mmproj (Q8) loaded successfully");
@@ -55,16 +144,381 @@ Java_android_llama_cpp_LLamaAndroid_load_1mmproj(
     return reinterpret_cast<jlong>(ctx);
 }
 
+static size_t file_size(const std::string & path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (size_t) st.st_size : 0;
+}
+
+// Load the text model and the mmproj on two threads, then create the context.
+// Progress (0..1, weighted by file size) is reported to listener.onProgress(float) from the
+// calling thread. Returns [model, context, mmproj], or null with an exception pending.
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_load_1all(
+        JNIEnv *env,
+        jobject,
+        jstring model_path,
+        jstring mmproj_path,
+        jobject params,
+        jobject listener) {
+
+    const char *model_chars = env->GetStringUTFChars(model_path, nullptr);
+    const char *mmproj_chars = env->GetStringUTFChars(mmproj_path, nullptr);
+    const std::string model_file = model_chars;
+    const std::string mmproj_file = mmproj_chars;
+    env->ReleaseStringUTFChars(model_path, model_chars);
+    env->ReleaseStringUTFChars(mmproj_path, mmproj_chars);
+
+    // JNI objects are only touched on this thread
+    llama_model_params model_params = model_params_from_java(env, params);
+    llama_context_params ctx_params = context_params_from_java(env, params);
+    // the text pool is created with the context, after the loads
+    const int n_text = std::min(std::max(ctx_params.n_threads, ctx_params.n_threads_batch),
+                                (int) cpu_topology_get().cores.size());
+    mtmd_context_params mtmd_params = mmproj_params(params_get_bool(env, params, "mmprojUseGpu"),
+                                                    params_get_int(env, params, "mmprojThreads"),
+                                                    n_text,
+                                                    params_get_int(env, params, "imagePool"));
+
+    jmethodID on_progress = nullptr;
+    if (listener) {
+        on_progress = env->GetMethodID(env->GetObjectClass(listener), "onProgress", "(F)V");
+    }
+
+    std::atomic<float> model_progress{0.0f};
+    std::atomic<bool> model_done{false};
+    std::atomic<bool> mmproj_done{false};
+
+    model_params.progress_callback = [](float progress, void *user_data) {
+        static_cast<std::atomic<float> *>(user_data)->store(progress);
+        return true;
+    };
+    model_params.progress_callback_user_data = &model_progress;
+
+    LOGi("load_all: loading %s and %s in parallel", model_file.c_str(), mmproj_file.c_str());
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    llama_model *model = nullptr;
+    mtmd_context *mtmd_ctx = nullptr;
+    std::thread model_thread([&] {
+        model = llama_model_load_from_file(model_file.c_str(), model_params);
+        model_done = true;
+    });
+    std::thread mmproj_thread([&] {
+        mtmd_ctx = mtmd_init_from_file_deferred(mmproj_file.c_str(), mtmd_params);
+        mmproj_done = true;
+    });
+
+    const double size_model = (double) file_size(model_file);
+    const double size_mmproj = (double) file_size(mmproj_file);
+    const double size_total = std::max(1.0, size_model + size_mmproj);
+    auto report = [&](float progress) {
+        if (on_progress) {
+            env->CallVoidMethod(listener, on_progress, progress);
+            if (env->ExceptionCheck()) {
+                // a failing listener must not abort the load
+                LOGe("load_all: progress listener threw, ignoring it");
+                env->ExceptionClear();
+                on_progress = nullptr;
+            }
+        }
+    };
+
+    // the text context is created after both loads, keep some room for it
+    while (!(model_done && mmproj_done)) {
+        double loaded = model_progress.load() * size_model + (mmproj_done ? size_mmproj : 0.0);
+        report((float) (0.95 * loaded / size_total));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    model_thread.join();
+    mmproj_thread.join();
+
+    const char *error = nullptr;
+    llama_context *context = nullptr;
+    if (!model) {
+        error = "load_model() failed";
+    } else if (!mtmd_ctx) {
+        error = "Failed to load mmproj";
+    } else if (mtmd_set_text_model(mtmd_ctx, model) != 0) {
+        error = "mmproj does not match the text model";
+    } else {
+        context = llama_new_context_with_model(model, ctx_params);
+        if (!context) {
+            error = "llama_new_context_with_model() returned null";
+        }
+    }
+
+    if (error) {
+        LOGe("load_all: %s", error);
+        if (mtmd_ctx) mtmd_free(mtmd_ctx);
+        if (model) llama_model_free(model);
+        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), error);
+        return nullptr;
+    }
+
+    text_threads_set(context, ctx_params.n_threads, ctx_params.n_threads_batch);
+    vision_threads_attach(mtmd_ctx, mtmd_params.n_threads, text_threads_n_cores());
+
+    report(1.0f);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start_time);
+    LOGi("✅ load_all completed in %lld ms", duration.count());
+
+    jlong handles[3] = {
+        reinterpret_cast<jlong>(model),
+        reinterpret_cast<jlong>(context),
+        reinterpret_cast<jlong>(mtmd_ctx),
+    };
+    jlongArray result = env->NewLongArray(3);
+    env->SetLongArrayRegion(result, 0, 3, handles);
+    return result;
+}
+
 // Free mmproj context
 extern "C"
 JNIEXPORT void JNICALL
 Java_android_llama_cpp_LLamaAndroid_free_1mmproj(JNIEnv *, jobject, jlong ctx_ptr) {
     auto *ctx = reinterpret_cast<mtmd_context *>(ctx_ptr);
     if (ctx) {
+        vision_threads_free(ctx);
         mtmd_free(ctx);
     }
 }
 
+// Run fewer text and vision encoder threads while the device is hot: counts are scaled by
+// scale (0..1, 1 = as configured), for contexts created later too. The encoder takes the
+// new count now; the text context at its next generation step or prompt eval on the run loop
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1thermal_1scale(JNIEnv *, jobject, jfloat scale) {
+    text_threads_set_thermal_scale(scale);
+    // the encoder thread count is atomic, a running encode picks it up with its next graph
+    std::lock_guard<std::mutex> lock(g_vision_mutex);
+    if (g_vision_ctx) {
+        mtmd_set_n_threads(g_vision_ctx, vision_threads_scaled());
+    }
+    LOGi("Thermal scale %.2f: vision threads %d", text_threads_thermal_scale(),
+         g_vision_ctx ? vision_threads_scaled() : 0);
+}
+
+// Resident set size of the process from /proc/self/status, 0 if unreadable
+static long process_rss_bytes() {
+    FILE * f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[128];
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+// Native memory in bytes: text model, KV cache, vision model, vision compute, embedding cache,
+// embedding buffers, process RSS. The KV cache is sized from the model shape, as allocated at load
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_memory_1usage(
+        JNIEnv *env, jobject, jlong model_ptr, jlong context_ptr, jlong mtmd_ctx_ptr, jobject params) {
+    auto * model = reinterpret_cast<llama_model *>(model_ptr);
+    auto * llama_ctx = reinterpret_cast<llama_context *>(context_ptr);
+    auto * mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+
+    jlong values[7] = {};
+    if (model) {
+        values[0] = (jlong) llama_model_size(model);
+    }
+    if (model && llama_ctx) {
+        const int n_head = llama_model_n_head(model);
+        const int64_t n_embd_kv = n_head > 0
+                ? (int64_t) llama_model_n_embd(model) / n_head * llama_model_n_head_kv(model) : 0;
+        const auto type_k = (ggml_type) params_get_int(env, params, "typeK");
+        const auto type_v = (ggml_type) params_get_int(env, params, "typeV");
+        values[1] = (jlong) ((ggml_row_size(type_k, n_embd_kv) + ggml_row_size(type_v, n_embd_kv))
+                * llama_n_ctx(llama_ctx) * llama_model_n_layer(model));
+    }
+    if (mtmd_ctx) {
+        const mtmd_memory_usage usage = mtmd_get_memory_usage(mtmd_ctx);
+        values[2] = (jlong) usage.model;
+        values[3] = (jlong) usage.compute;
+        values[4] = (jlong) usage.embd_cache;
+        values[5] = (jlong) usage.embd;
+    }
+    values[6] = process_rss_bytes();
+
+    jlongArray result = env->NewLongArray(7);
+    env->SetLongArrayRegion(result, 0, 7, values);
+    return result;
+}
+
+// Byte budget of the image embedding cache, evicting entries to fit; 0 disables it
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_embd_1cache_1set_1budget(JNIEnv *, jobject, jlong mtmd_ctx_ptr, jlong n_bytes) {
+    auto * mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (mtmd_ctx) {
+        mtmd_embd_cache_set_budget(mtmd_ctx, (size_t) std::max<jlong>(0, n_bytes));
+    }
+}
+
+// Free the vision encoder compute buffers until the next image
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_release_1vision_1compute(JNIEnv *, jobject, jlong mtmd_ctx_ptr) {
+    auto * mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (mtmd_ctx) {
+        mtmd_release_compute(mtmd_ctx);
+        LOGi("Released vision compute buffers");
+    }
+}
+
+// Free the vision encoder compute buffers after every image instead of keeping them between frames
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1low_1memory(JNIEnv *, jobject, jlong mtmd_ctx_ptr, jboolean low_memory) {
+    auto * mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (mtmd_ctx) {
+        mtmd_set_low_memory(mtmd_ctx, low_memory);
+    }
+}
+
+// RGBA_8888 is stored as R, G, B, A bytes in memory regardless of endianness
+static void rgba8888_row_to_rgb(const uint8_t * src, uint8_t * dst, uint32_t width) {
+    uint32_t x = 0;
+#if defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t rgba = vld4q_u8(src + x * 4);
+        uint8x16x3_t rgb;
+        rgb.val[0] = rgba.val[0];
+        rgb.val[1] = rgba.val[1];
+        rgb.val[2] = rgba.val[2];
+        vst3q_u8(dst + x * 3, rgb);
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x * 3 + 0] = src[x * 4 + 0];
+        dst[x * 3 + 1] = src[x * 4 + 1];
+        dst[x * 3 + 2] = src[x * 4 + 2];
+    }
+}
+
+static void rgb565_row_to_rgb(const uint16_t * src, uint8_t * dst, uint32_t width) {
+    for (uint32_t x = 0; x < width; x++) {
+        uint16_t p = src[x];
+        uint8_t r = (p >> 11) & 0x1F;
+        uint8_t g = (p >> 5) & 0x3F;
+        uint8_t b = p & 0x1F;
+        // replicate the high bits so that 0x1F maps to 0xFF
+        dst[x * 3 + 0] = (r << 3) | (r >> 2);
+        dst[x * 3 + 1] = (g << 2) | (g >> 4);
+        dst[x * 3 + 2] = (b << 3) | (b >> 2);
+    }
+}
+
+// Convert locked Android pixels straight into the storage of a new mtmd_bitmap
+static mtmd_bitmap * bitmap_from_pixels(const AndroidBitmapInfo & info, const void * pixels) {
+    MTMD_TRACE_SCOPE("bitmap_convert");
+    if (info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 && info.format != ANDROID_BITMAP_FORMAT_RGB_565) {
+        LOGe("Unsupported bitmap format %d (expected RGBA_8888 or RGB_565)", info.format);
+        return nullptr;
+    }
+
+    mtmd_bitmap *mtmd_bmp = mtmd_bitmap_init(info.width, info.height, nullptr);
+    if (!mtmd_bmp) {
+        return nullptr;
+    }
+
+    uint8_t *dst = mtmd_bitmap_get_data_mut(mtmd_bmp);
+    const auto *src = static_cast<const uint8_t *>(pixels);
+    for (uint32_t y = 0; y < info.height; y++) {
+        const uint8_t *row = src + (size_t) y * info.stride;
+        uint8_t *out = dst + (size_t) y * info.width * 3;
+        if (info.format == ANDROID_BITMAP_FORMAT_RGBA_8888) {
+            rgba8888_row_to_rgb(row, out, info.width);
+        } else {
+            rgb565_row_to_rgb(reinterpret_cast<const uint16_t *>(row), out, info.width);
+        }
+    }
+
+    return mtmd_bmp;
+}
+
+// Averages factor x factor blocks of the locked pixels into dst (width / factor x height / factor RGB),
+// so a full-resolution frame never exists in RGB form. Trailing rows/columns that do not fill a
+// whole block are dropped. row_rgb and acc are scratch buffers, kept by callers that convert
+// many frames.
+static void box_downscale_rgb(const AndroidBitmapInfo & info, const void * pixels, uint32_t factor, uint8_t * dst,
+                              std::vector<uint8_t> & row_rgb, std::vector<uint32_t> & acc) {
+    const uint32_t nx = info.width / factor;
+    const uint32_t ny = info.height / factor;
+    const auto *src = static_cast<const uint8_t *>(pixels);
+    const uint32_t area = factor * factor;
+    row_rgb.resize((size_t) nx * factor * 3);
+    acc.resize((size_t) nx * 3);
+
+    for (uint32_t oy = 0; oy < ny; oy++) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (uint32_t dy = 0; dy < factor; dy++) {
+            const uint8_t *row = src + (size_t) (oy * factor + dy) * info.stride;
+            if (info.format == ANDROID_BITMAP_FORMAT_RGBA_8888) {
+                rgba8888_row_to_rgb(row, row_rgb.data(), nx * factor);
+            } else {
+                rgb565_row_to_rgb(reinterpret_cast<const uint16_t *>(row), row_rgb.data(), nx * factor);
+            }
+            const uint8_t *p = row_rgb.data();
+            for (uint32_t ox = 0; ox < nx; ox++) {
+                uint32_t r = 0, g = 0, b = 0;
+                for (uint32_t dx = 0; dx < factor; dx++, p += 3) {
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                }
+                acc[ox * 3 + 0] += r;
+                acc[ox * 3 + 1] += g;
+                acc[ox * 3 + 2] += b;
+            }
+        }
+        uint8_t *out = dst + (size_t) oy * nx * 3;
+        for (uint32_t i = 0; i < nx * 3; i++) {
+            out[i] = (uint8_t) ((acc[i] + area / 2) / area);
+        }
+    }
+}
+
+// Same as bitmap_from_pixels(), but decimated with box_downscale_rgb()
+static mtmd_bitmap * bitmap_from_pixels_box(const AndroidBitmapInfo & info, const void * pixels, uint32_t factor) {
+    if (factor <= 1) {
+        return bitmap_from_pixels(info, pixels);
+    }
+    MTMD_TRACE_SCOPE("bitmap_convert");
+    if (info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 && info.format != ANDROID_BITMAP_FORMAT_RGB_565) {
+        LOGe("Unsupported bitmap format %d (expected RGBA_8888 or RGB_565)", info.format);
+        return nullptr;
+    }
+
+    mtmd_bitmap *mtmd_bmp = mtmd_bitmap_init(info.width / factor, info.height / factor, nullptr);
+    if (!mtmd_bmp) {
+        return nullptr;
+    }
+
+    std::vector<uint8_t> row_rgb;
+    std::vector<uint32_t> acc;
+    box_downscale_rgb(info, pixels, factor, mtmd_bitmap_get_data_mut(mtmd_bmp), row_rgb, acc);
+    return mtmd_bmp;
+}
+
+// Decimation factor that keeps the longer side at or above the encoder image size
+static uint32_t downscale_factor(const AndroidBitmapInfo & info, int image_size) {
+    const uint32_t longer_side = std::max(info.width, info.height);
+    uint32_t factor = image_size > 0 ? std::max(1u, longer_side / (uint32_t) image_size) : 1u;
+    return std::max(1u, std::min(factor, std::min(info.width, info.height)));
+}
+
 // Create bitmap from Android Bitmap
 extern "C"
 JNIEXPORT jlong JNICALL
@@ -87,33 +541,61 @@ Java_android_llama_cpp_LLamaAndroid_bitmap_1from_1android(
         return 0;
     }
 
-    // Convert RGBA to RGB
-    uint32_t width = info.width;
-    uint32_t height = info.height;
-    std::vector<uint8_t> rgb_data(width * height * 3);
+    // Convert RGBA (or RGB565) to RGB directly into the mtmd bitmap
+    mtmd_bitmap *mtmd_bmp = bitmap_from_pixels(info, pixels);
 
-    uint32_t *rgba_pixels = static_cast<uint32_t *>(pixels);
-    for (uint32_t y = 0; y < height; y++) {
-        for (uint32_t x = 0; x < width; x++) {
-            uint32_t idx = y * width + x;
-            uint32_t rgba = rgba_pixels[idx];
+    AndroidBitmap_unlockPixels(env, bitmap);
 
-            rgb_data[idx * 3 + 0] = (rgba >> 16) & 0xFF; // R
-            rgb_data[idx * 3 + 1] = (rgba >> 8) & 0xFF;  // G
-            rgb_data[idx * 3 + 2] = rgba & 0xFF;         // B
-        }
+    if (!mtmd_bmp) {
+        LOGe("Failed to create mtmd bitmap");
+        return 0;
+    }
+
+    LOGi("Bitmap created: %dx%d", info.width, info.height);
+    return reinterpret_cast<jlong>(mtmd_bmp);
+}
+
+// Create bitmap from Android Bitmap, decimated towards the vision encoder input size
+// The longer side is kept at or above the encoder image size, clip_image_preprocess does the final resize.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_bitmap_1from_1android_1scaled(
+        JNIEnv *env,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jobject bitmap) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (!mtmd_ctx) {
+        LOGe("bitmap_from_android_scaled: Invalid mtmd context");
+        return 0;
+    }
+
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) < 0) {
+        LOGe("Failed to get bitmap info");
+        return 0;
+    }
+
+    const uint32_t factor = downscale_factor(info, mtmd_get_image_size(mtmd_ctx));
+
+    void *pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) < 0) {
+        LOGe("Failed to lock bitmap pixels");
+        return 0;
     }
 
+    mtmd_bitmap *mtmd_bmp = bitmap_from_pixels_box(info, pixels, factor);
+
     AndroidBitmap_unlockPixels(env, bitmap);
 
-    // Create mtmd bitmap
-    mtmd_bitmap *mtmd_bmp = mtmd_bitmap_init(width, height, rgb_data.data());
     if (!mtmd_bmp) {
         LOGe("Failed to create mtmd bitmap");
         return 0;
     }
 
-    LOGi("Bitmap created: %dx%d", width, height);
+    LOGi("Bitmap created: %dx%d -> %ux%u (1/%u)", info.width, info.height,
+         mtmd_bitmap_get_nx(mtmd_bmp), mtmd_bitmap_get_ny(mtmd_bmp), factor);
     return reinterpret_cast<jlong>(mtmd_bmp);
 }
 
@@ -127,47 +609,135 @@ Java_android_llama_cpp_LLamaAndroid_bitmap_1free(JNIEnv *, jobject, jlong bitmap
     }
 }
 
-// Tokenize text + image
+// Start streaming audio input; 0 if the mmproj has no audio encoder
 extern "C"
 JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_tokenize_1with_1image(
+Java_android_llama_cpp_LLamaAndroid_audio_1stream_1init(JNIEnv *, jobject, jlong mtmd_ctx_ptr) {
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (!mtmd_ctx) {
+        LOGe("Invalid mtmd context");
+        return 0;
+    }
+    if (!mtmd_support_audio(mtmd_ctx)) {
+        LOGe("Mmproj does not support audio input");
+        return 0;
+    }
+    mtmd_audio_stream *stream = mtmd_audio_stream_init(mtmd_ctx);
+    LOGi("Audio stream started, %d Hz", mtmd_get_audio_bitrate(mtmd_ctx));
+    return reinterpret_cast<jlong>(stream);
+}
+
+// Append recorded PCM samples; completed 30 s chunks are encoded in the background
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_audio_1stream_1push(
         JNIEnv *env,
         jobject,
-        jlong mtmd_ctx_ptr,
-        jstring prompt,
-        jlong bitmap_ptr) {
+        jlong stream_ptr,
+        jfloatArray samples,
+        jint n_samples) {
 
-    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
-    auto *bitmap = reinterpret_cast<mtmd_bitmap *>(bitmap_ptr);
+    auto *stream = reinterpret_cast<mtmd_audio_stream *>(stream_ptr);
+    if (!stream || n_samples < 0 || n_samples > env->GetArrayLength(samples)) {
+        LOGe("Invalid audio stream or sample count");
+        return -1;
+    }
+
+    float *data = static_cast<float *>(env->GetPrimitiveArrayCritical(samples, nullptr));
+    if (!data) {
+        return -1;
+    }
+    std::vector<float> pcm(data, data + n_samples);
+    env->ReleasePrimitiveArrayCritical(samples, data, JNI_ABORT);
 
-    if (!mtmd_ctx || !bitmap) {
-        LOGe("Invalid mtmd context or bitmap");
+    return mtmd_audio_stream_push(stream, pcm.data(), pcm.size());
+}
+
+// Encode the rest of the audio; returns a bitmap for tokenize_prompt(), 0 on failure
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_audio_1stream_1finish(JNIEnv *, jobject, jlong stream_ptr) {
+    auto *stream = reinterpret_cast<mtmd_audio_stream *>(stream_ptr);
+    if (!stream) {
+        LOGe("Invalid audio stream");
         return 0;
     }
+    const int64_t t_start = ggml_time_us();
+    mtmd_bitmap *bitmap = mtmd_audio_stream_finish(stream);
+    if (!bitmap) {
+        LOGe("mtmd_audio_stream_finish failed");
+        return 0;
+    }
+    LOGi("Audio stream finished: %zu samples, waited %.1f ms for the encoder",
+         mtmd_bitmap_get_n_bytes(bitmap) / sizeof(float), (ggml_time_us() - t_start) / 1000.0);
+    return reinterpret_cast<jlong>(bitmap);
+}
 
-    const char *prompt_str = env->GetStringUTFChars(prompt, nullptr);
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_audio_1stream_1free(JNIEnv *, jobject, jlong stream_ptr) {
+    mtmd_audio_stream_free(reinterpret_cast<mtmd_audio_stream *>(stream_ptr));
+}
+
+// Compile a prompt template once for tokenize_prompt()
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_prompt_1init(JNIEnv *env, jobject, jlong mtmd_ctx_ptr, jstring prompt) {
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    if (!mtmd_ctx) {
+        LOGe("Invalid mtmd context");
+        return 0;
+    }
 
+    const char *prompt_str = env->GetStringUTFChars(prompt, nullptr);
     mtmd_input_text input_text;
     input_text.text = prompt_str;
     input_text.add_special = true;
     input_text.parse_special = true;
+    mtmd_prompt *compiled = mtmd_prompt_init(mtmd_ctx, &input_text);
+    env->ReleaseStringUTFChars(prompt, prompt_str);
 
-    mtmd_input_chunks *chunks = mtmd_input_chunks_init();
-    const mtmd_bitmap *bitmaps[] = {bitmap};
+    if (mtmd_prompt_n_markers(compiled) != 1) {
+        LOGe("prompt_init: the prompt needs exactly one media marker, found %zu", mtmd_prompt_n_markers(compiled));
+        mtmd_prompt_free(compiled);
+        return 0;
+    }
+    return reinterpret_cast<jlong>(compiled);
+}
 
-    int32_t ret = mtmd_tokenize(mtmd_ctx, chunks, &input_text, bitmaps, 1);
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_prompt_1free(JNIEnv *, jobject, jlong prompt_ptr) {
+    mtmd_prompt_free(reinterpret_cast<mtmd_prompt *>(prompt_ptr));
+}
 
-    env->ReleaseStringUTFChars(prompt, prompt_str);
+// Tokenize a compiled prompt + image
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_tokenize_1prompt(
+        JNIEnv *,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong prompt_ptr,
+        jlong bitmap_ptr) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *compiled = reinterpret_cast<mtmd_prompt *>(prompt_ptr);
+    auto *bitmap = reinterpret_cast<mtmd_bitmap *>(bitmap_ptr);
+
+    if (!mtmd_ctx || !compiled || !bitmap) {
+        LOGe("Invalid mtmd context, prompt or bitmap");
+        return 0;
+    }
 
+    mtmd_input_chunks *chunks = mtmd_input_chunks_init();
+    const mtmd_bitmap *bitmaps[] = {bitmap};
+    int32_t ret = mtmd_tokenize_prompt(mtmd_ctx, chunks, compiled, bitmaps, 1);
     if (ret != 0) {
-        LOGe("mtmd_tokenize failed with code %d", ret);
+        LOGe("mtmd_tokenize_prompt failed with code %d", ret);
         mtmd_input_chunks_free(chunks);
         return 0;
     }
-
-    size_t n_chunks = mtmd_input_chunks_size(chunks);
-    LOGi("Tokenized into %zu chunks", n_chunks);
-
     return reinterpret_cast<jlong>(chunks);
 }
 
@@ -202,12 +772,14 @@ Java_android_llama_cpp_LLamaAndroid_eval_1chunks(
         LOGe("eval_chunks: Invalid pointers");
         return -1;
     }
+    text_threads_apply_thermal_scale(llama_ctx);
 
     // Log detailed eval_chunks parameters
     size_t n_chunks = mtmd_input_chunks_size(chunks);
     LOGi("⚡ eval_chunks starting: n_batch=%d, n_chunks=%zu, n_past=%d", n_batch, n_chunks, n_past);
 
     // Measure eval time
+    MTMD_TRACE_SCOPE("eval_chunks");
     auto start_time = std::chrono::high_resolution_clock::now();
 
     llama_pos new_n_past = 0;
@@ -237,3 +809,1549 @@ Java_android_llama_cpp_LLamaAndroid_eval_1chunks(
          duration.count() > 0 ? (new_n_past * 1000.0 / duration.count()) : 0.0);
     return static_cast<jlong>(new_n_past);
 }
+
+// Prompt-prefix KV cache
+// Camera frames are classified with the same instruction text in front of the image marker.
+// We keep the KV cells of the leading text chunk in sequence 0 between calls, so only the
+// image chunk and the text after it have to be decoded for the next frame.
+struct prefix_cache {
+    llama_context * lctx = nullptr;
+    std::vector<llama_token> tokens; // tokens stored in KV positions [0, tokens.size()) of seq 0
+};
+
+static prefix_cache g_prefix_cache;
+
+static void prefix_cache_reset(llama_context * lctx) {
+    // other sequences may hold concurrent text requests
+    llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+    g_prefix_cache.lctx = lctx;
+    g_prefix_cache.tokens.clear();
+}
+
+static int32_t decode_text_tokens(llama_context * lctx,
+                                  const llama_token * tokens,
+                                  size_t n_tokens,
+                                  llama_pos n_past,
+                                  int32_t n_batch,
+                                  bool logits_last) {
+    MTMD_TRACE_SCOPE("decode_text");
+    MTMD_TRACE_ADD(MTMD_TRACE_PROMPT_TOKENS, n_tokens);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    size_t i = 0;
+    while (i < n_tokens) {
+        common_batch_clear(batch);
+        for (; i < n_tokens && batch.n_tokens < n_batch; i++) {
+            common_batch_add(batch, tokens[i], n_past++, { 0 }, false);
+        }
+        if (logits_last && i == n_tokens) {
+            batch.logits[batch.n_tokens - 1] = true;
+        }
+        int32_t ret = llama_decode(lctx, batch);
+        if (ret != 0) {
+            llama_batch_free(batch);
+            return ret;
+        }
+    }
+    llama_batch_free(batch);
+    return 0;
+}
+
+// Evaluate chunks in sequence 0, reusing the KV state of the longest shared text prefix.
+// When pipeline is set, the chunks must have been submitted to it and media chunks use the
+// embeddings computed by its worker.
+// Returns the new n_past, or -1 on failure (the cache is dropped in that case).
+static jlong eval_chunks_with_prefix(mtmd_context * mtmd_ctx,
+                                     llama_context * llama_ctx,
+                                     mtmd_helper_pipeline * pipeline,
+                                     const mtmd_input_chunks * chunks,
+                                     int32_t n_batch) {
+
+    const size_t n_chunks = mtmd_input_chunks_size(chunks);
+    if (n_chunks == 0) {
+        LOGe("eval_chunks_cached: no chunks");
+        return -1;
+    }
+    text_threads_apply_thermal_scale(llama_ctx);
+    MTMD_TRACE_SCOPE("eval_chunks_cached");
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    llama_memory_t mem = llama_get_memory(llama_ctx);
+    if (g_prefix_cache.lctx != llama_ctx) {
+        prefix_cache_reset(llama_ctx);
+    }
+
+    // the KV cache may have been cleared behind our back (kv_cache_clear, bench, ...)
+    const size_t n_kv = (size_t) (llama_memory_seq_pos_max(mem, 0) + 1);
+    if (n_kv < g_prefix_cache.tokens.size()) {
+        g_prefix_cache.tokens.resize(n_kv);
+    }
+
+    const mtmd_input_chunk * first = mtmd_input_chunks_get(chunks, 0);
+    const llama_token * first_tokens = nullptr;
+    size_t n_first = 0;
+    if (mtmd_input_chunk_get_type(first) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+        first_tokens = mtmd_input_chunk_get_tokens_text(first, &n_first);
+    }
+
+    size_t n_reuse = 0;
+    while (n_reuse < n_first && n_reuse < g_prefix_cache.tokens.size()
+            && g_prefix_cache.tokens[n_reuse] == first_tokens[n_reuse]) {
+        n_reuse++;
+    }
+    if (n_chunks == 1 && n_reuse == n_first && n_reuse > 0) {
+        // a text-only prompt still needs logits for its last token
+        n_reuse--;
+    }
+
+    if (!llama_memory_seq_rm(mem, 0, (llama_pos) n_reuse, -1)) {
+        // partial removal is not supported by every memory type
+        prefix_cache_reset(llama_ctx);
+        n_reuse = 0;
+    }
+    g_prefix_cache.tokens.resize(n_reuse);
+    MTMD_TRACE_ADD(MTMD_TRACE_PREFIX_CACHE_TOKENS, n_reuse);
+
+    llama_pos n_past = (llama_pos) n_reuse;
+    size_t i_chunk = 0;
+    if (first_tokens) {
+        int32_t ret = decode_text_tokens(llama_ctx, first_tokens + n_reuse, n_first - n_reuse,
+                                         n_past, n_batch, n_chunks == 1);
+        if (ret != 0) {
+            LOGe("eval_chunks_cached: failed to decode prompt prefix (%d)", ret);
+            prefix_cache_reset(llama_ctx);
+            return -1;
+        }
+        n_past = (llama_pos) n_first;
+        g_prefix_cache.tokens.assign(first_tokens, first_tokens + n_first);
+        i_chunk = 1;
+    }
+
+    for (; i_chunk < n_chunks; i_chunk++) {
+        const mtmd_input_chunk * chunk = mtmd_input_chunks_get(chunks, i_chunk);
+        bool logits_last = (i_chunk == n_chunks - 1);
+        int32_t ret;
+        if (pipeline && mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            float * embd = mtmd_helper_pipeline_get_embd(pipeline, chunks, i_chunk);
+            ret = embd ? mtmd_helper_decode_image_chunk(mtmd_ctx, llama_ctx, chunk, embd, n_past, 0, n_batch, &n_past) : 1;
+        } else {
+            ret = mtmd_helper_eval_chunk_single(mtmd_ctx, llama_ctx, chunk, n_past, 0, n_batch, logits_last, &n_past);
+        }
+        if (ret != 0) {
+            LOGe("eval_chunks_cached: failed to eval chunk %zu (%d)", i_chunk, ret);
+            prefix_cache_reset(llama_ctx);
+            return -1;
+        }
+    }
+
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+
+    LOGi("✅ eval_chunks_cached completed: reused=%zu/%zu prefix tokens, new_n_past=%d, duration=%lld ms",
+         n_reuse, n_first, (int) n_past, duration.count());
+    return static_cast<jlong>(n_past);
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_eval_1chunks_1cached(
+        JNIEnv *,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jlong chunks_ptr,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    auto *chunks = reinterpret_cast<mtmd_input_chunks *>(chunks_ptr);
+
+    if (!mtmd_ctx || !llama_ctx || !chunks) {
+        LOGe("eval_chunks_cached: Invalid pointers");
+        return -1;
+    }
+
+    return eval_chunks_with_prefix(mtmd_ctx, llama_ctx, nullptr, chunks, n_batch);
+}
+
+// Encode pipeline
+// Frame N+1 is submitted before frame N is generated, so its vision encoding runs on the
+// pipeline worker while the text model decodes on the calling thread.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_pipeline_1init(JNIEnv *, jobject, jlong mtmd_ctx_ptr, jlong model_ptr, jint max_pending) {
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *model = reinterpret_cast<llama_model *>(model_ptr);
+    if (!mtmd_ctx || !model) {
+        LOGe("pipeline_init: Invalid pointers");
+        return 0;
+    }
+    return reinterpret_cast<jlong>(mtmd_helper_pipeline_init(mtmd_ctx, model, max_pending));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_pipeline_1free(JNIEnv *, jobject, jlong pipeline_ptr) {
+    mtmd_helper_pipeline_free(reinterpret_cast<mtmd_helper_pipeline *>(pipeline_ptr));
+}
+
+// Returns 0 on success, 1 if the pipeline queue is full
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_pipeline_1submit(JNIEnv *, jobject, jlong pipeline_ptr, jlong chunks_ptr) {
+    auto *pipeline = reinterpret_cast<mtmd_helper_pipeline *>(pipeline_ptr);
+    auto *chunks = reinterpret_cast<mtmd_input_chunks *>(chunks_ptr);
+    if (!pipeline || !chunks) {
+        LOGe("pipeline_submit: Invalid pointers");
+        return -1;
+    }
+    return mtmd_helper_pipeline_submit(pipeline, chunks);
+}
+
+// Same as eval_chunks_cached, with media embeddings taken from the pipeline.
+// The chunks are released from the pipeline whether or not evaluation succeeds.
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_eval_1chunks_1pipelined(
+        JNIEnv *,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jlong pipeline_ptr,
+        jlong chunks_ptr,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    auto *pipeline = reinterpret_cast<mtmd_helper_pipeline *>(pipeline_ptr);
+    auto *chunks = reinterpret_cast<mtmd_input_chunks *>(chunks_ptr);
+
+    if (!mtmd_ctx || !llama_ctx || !pipeline || !chunks) {
+        LOGe("eval_chunks_pipelined: Invalid pointers");
+        return -1;
+    }
+
+    jlong n_past = eval_chunks_with_prefix(mtmd_ctx, llama_ctx, pipeline, chunks, n_batch);
+    mtmd_helper_pipeline_release(pipeline, chunks);
+    return n_past;
+}
+
+// Drop everything after the cached prefix (image, suffix and generated tokens) from seq 0,
+// leaving the shared prefix in place for the next eval_chunks_cached call.
+static void prefix_cache_trim(llama_context * llama_ctx) {
+    if (g_prefix_cache.lctx != llama_ctx) {
+        prefix_cache_reset(llama_ctx);
+        return;
+    }
+    llama_memory_t mem = llama_get_memory(llama_ctx);
+    if (!llama_memory_seq_rm(mem, 0, (llama_pos) g_prefix_cache.tokens.size(), -1)) {
+        prefix_cache_reset(llama_ctx);
+    }
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_prefix_1cache_1trim(JNIEnv *, jobject, jlong llama_ctx_ptr) {
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    if (!llama_ctx) {
+        return;
+    }
+    prefix_cache_trim(llama_ctx);
+}
+
+// Saved prompt state
+// The cached prefix of seq 0 is written as a header, the prefix tokens and the
+// llama_state_seq_get_data() blob. model_hash ties the file to the model file it was made
+// with; the sampler is reset for every answer, so it has no state to save.
+static const uint32_t SESSION_MAGIC   = 0x5345534c; // "LSES"
+static const uint32_t SESSION_VERSION = 1;
+
+struct session_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_hash;
+    uint64_t n_tokens;
+    uint64_t state_size;
+};
+
+// FNV-1a over the file size and its first and last MiB; reading the whole model would
+// take longer than the prefill the file saves
+static uint64_t model_file_hash(const char * path) {
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](const uint8_t * data, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+    };
+
+    const uint64_t size = file_size(path);
+    add(reinterpret_cast<const uint8_t *>(&size), sizeof(size));
+
+    const size_t n_sample = 1 << 20;
+    std::vector<uint8_t> buf(n_sample);
+    size_t n_read = fread(buf.data(), 1, n_sample, f);
+    add(buf.data(), n_read);
+    if (size > 2 * n_sample && fseek(f, -(long) n_sample, SEEK_END) == 0) {
+        n_read = fread(buf.data(), 1, n_sample, f);
+        add(buf.data(), n_read);
+    }
+    fclose(f);
+    return hash;
+}
+
+// Write the KV state of the cached prompt prefix to session_path. Returns false on failure.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1save(
+        JNIEnv *env,
+        jobject,
+        jlong llama_ctx_ptr,
+        jstring model_path,
+        jstring session_path) {
+
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    if (!llama_ctx) {
+        LOGe("session_save: Invalid pointers");
+        return JNI_FALSE;
+    }
+
+    // only the prefix is worth keeping, the rest belongs to the last frame
+    prefix_cache_trim(llama_ctx);
+
+    const char *model_chars = env->GetStringUTFChars(model_path, nullptr);
+    const uint64_t model_hash = model_file_hash(model_chars);
+    env->ReleaseStringUTFChars(model_path, model_chars);
+
+    const auto & tokens = g_prefix_cache.tokens;
+    std::vector<uint8_t> state(llama_state_seq_get_size(llama_ctx, 0));
+    const size_t state_size = llama_state_seq_get_data(llama_ctx, state.data(), state.size(), 0);
+
+    session_file_header header = {};
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    header.model_hash = model_hash;
+    header.n_tokens = tokens.size();
+    header.state_size = state_size;
+
+    const char *path = env->GetStringUTFChars(session_path, nullptr);
+    // write to a temporary file, so a crash never leaves a truncated session behind
+    const std::string tmp_path = std::string(path) + ".tmp";
+    FILE * f = fopen(tmp_path.c_str(), "wb");
+    bool ok = f != nullptr && model_hash != 0 && state_size > 0;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1
+            && fwrite(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size()
+            && fwrite(state.data(), 1, state_size, f) == state_size;
+    }
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    }
+    ok = ok && rename(tmp_path.c_str(), path) == 0;
+    if (!ok) {
+        LOGe("session_save: failed to write %s", path);
+        remove(tmp_path.c_str());
+    } else {
+        LOGi("✅ session_save: %zu prefix tokens, %zu bytes of state", tokens.size(), state_size);
+    }
+    env->ReleaseStringUTFChars(session_path, path);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// Restore a prompt prefix written by session_save into seq 0, so the next
+// eval_chunks_cached call reuses it. Returns the number of prefix tokens restored,
+// or -1 if the file is missing, stale or made with another model.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1restore(
+        JNIEnv *env,
+        jobject,
+        jlong llama_ctx_ptr,
+        jstring model_path,
+        jstring session_path) {
+
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    if (!llama_ctx) {
+        LOGe("session_restore: Invalid pointers");
+        return -1;
+    }
+
+    const char *path = env->GetStringUTFChars(session_path, nullptr);
+    FILE * f = fopen(path, "rb");
+    const uint64_t size = file_size(path);
+    env->ReleaseStringUTFChars(session_path, path);
+    if (!f) {
+        return -1;
+    }
+
+    session_file_header header = {};
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+        && header.magic == SESSION_MAGIC
+        && header.version == SESSION_VERSION
+        && header.n_tokens <= llama_n_ctx(llama_ctx)
+        && sizeof(header) + header.n_tokens * sizeof(llama_token) + header.state_size == size;
+    if (ok) {
+        const char *model_chars = env->GetStringUTFChars(model_path, nullptr);
+        ok = model_file_hash(model_chars) == header.model_hash;
+        env->ReleaseStringUTFChars(model_path, model_chars);
+        if (!ok) {
+            LOGi("session_restore: session was saved with another model");
+        }
+    }
+
+    std::vector<llama_token> tokens(ok ? header.n_tokens : 0);
+    std::vector<uint8_t> state(ok ? header.state_size : 0);
+    ok = ok
+        && fread(tokens.data(), sizeof(llama_token), tokens.size(), f) == tokens.size()
+        && fread(state.data(), 1, state.size(), f) == state.size();
+    fclose(f);
+    if (!ok) {
+        return -1;
+    }
+
+    prefix_cache_reset(llama_ctx);
+    if (llama_state_seq_set_data(llama_ctx, state.data(), state.size(), 0) == 0) {
+        LOGe("session_restore: state does not match the context");
+        prefix_cache_reset(llama_ctx);
+        return -1;
+    }
+    g_prefix_cache.tokens = std::move(tokens);
+    LOGi("✅ session_restore: %zu prefix tokens", g_prefix_cache.tokens.size());
+    return (jint) g_prefix_cache.tokens.size();
+}
+
+// Run a blank image of the encoder input size through the vision encoder, its embeddings
+// through the text context, and one generation step, so kernels are compiled and compute
+// buffers are allocated before the first real frame. Leaves the KV cache and the embedding
+// cache empty. Returns 0 on success.
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_warmup(
+        JNIEnv *,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+
+    if (!mtmd_ctx || !llama_ctx) {
+        LOGe("warmup: Invalid pointers");
+        return -1;
+    }
+
+    const int image_size = mtmd_get_image_size(mtmd_ctx);
+    if (image_size <= 0) {
+        LOGe("warmup: mmproj has no vision encoder");
+        return -1;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    mtmd_bitmap *bitmap = mtmd_bitmap_init(image_size, image_size, nullptr);
+    uint8_t *data = mtmd_bitmap_get_data_mut(bitmap);
+    std::fill(data, data + (size_t) image_size * image_size * 3, 128);
+
+    mtmd_input_text input_text;
+    input_text.text = mtmd_default_marker();
+    input_text.add_special = true;
+    input_text.parse_special = true;
+
+    mtmd_input_chunks *chunks = mtmd_input_chunks_init();
+    const mtmd_bitmap *bitmaps[] = {bitmap};
+    int32_t ret = mtmd_tokenize(mtmd_ctx, chunks, &input_text, bitmaps, 1);
+
+    llama_pos n_past = 0;
+    if (ret == 0) {
+        prefix_cache_reset(llama_ctx);
+        ret = mtmd_helper_eval_chunks(mtmd_ctx, llama_ctx, chunks, 0, 0, n_batch, true, &n_past);
+    }
+    if (ret == 0) {
+        // single-token decode, as used by generation
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        common_batch_add(batch, 0, n_past, { 0 }, true);
+        ret = llama_decode(llama_ctx, batch);
+        llama_batch_free(batch);
+    }
+
+    mtmd_input_chunks_free(chunks);
+    mtmd_bitmap_free(bitmap);
+    mtmd_embd_cache_clear(mtmd_ctx);
+    prefix_cache_reset(llama_ctx);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start_time);
+    if (ret != 0) {
+        LOGe("warmup failed with code %d after %lld ms", ret, duration.count());
+        return ret;
+    }
+    LOGi("✅ warmup completed in %lld ms (image %dx%d)", duration.count(), image_size, image_size);
+    return 0;
+}
+
+// End-to-end benchmark of one image prompt, timing each stage separately:
+// bitmap conversion, mtmd_tokenize (clip_image_preprocess of the image), vision encode,
+// image-token decode, prompt prefill (text chunks) and each generated token.
+// n_warmup untimed runs come first; the embedding and prefix caches are cleared before every
+// run so each one pays the full cost. Returns a JSON object, with "error" set on failure.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1multimodal(
+        JNIEnv *env,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jobject jbitmap,
+        jstring prompt,
+        jint n_gen,
+        jint n_warmup,
+        jint n_reps,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    if (!mtmd_ctx || !llama_ctx) {
+        LOGe("bench_multimodal: Invalid pointers");
+        return env->NewStringUTF("{\"error\":\"invalid pointers\"}");
+    }
+
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, jbitmap, &info) < 0) {
+        return env->NewStringUTF("{\"error\":\"failed to get bitmap info\"}");
+    }
+    const uint32_t factor = downscale_factor(info, mtmd_get_image_size(mtmd_ctx));
+
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    const std::string prompt_str = prompt_chars;
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+
+    const llama_model *model = llama_get_model(llama_ctx);
+
+    // greedy whatever the configured sampler is, so runs with the same prompt stay comparable
+    token_sampler *sampler = token_sampler_init(model, sampler_params());
+
+    std::vector<double> t_bitmap, t_preprocess, t_encode, t_image_decode, t_prefill, t_token;
+    size_t n_prompt_tokens = 0;
+    size_t n_image_tokens = 0;
+    uint32_t nx = 0, ny = 0;
+    std::string error;
+
+    mtmd_input_chunks *chunks = mtmd_input_chunks_init();
+    for (int r = 0; r < n_warmup + n_reps && error.empty(); r++) {
+        const bool timed = r >= n_warmup;
+        mtmd_embd_cache_clear(mtmd_ctx);
+        prefix_cache_reset(llama_ctx);
+
+        // bitmap conversion
+        auto t_start = std::chrono::steady_clock::now();
+        void *pixels = nullptr;
+        if (AndroidBitmap_lockPixels(env, jbitmap, &pixels) < 0) {
+            error = "failed to lock bitmap pixels";
+            break;
+        }
+        mtmd_bitmap *bitmap = bitmap_from_pixels_box(info, pixels, factor);
+        AndroidBitmap_unlockPixels(env, jbitmap);
+        if (!bitmap) {
+            error = "failed to convert bitmap";
+            break;
+        }
+        const double ms_bitmap = bench_ms_since(t_start);
+        nx = mtmd_bitmap_get_nx(bitmap);
+        ny = mtmd_bitmap_get_ny(bitmap);
+
+        // tokenize + preprocess
+        mtmd_input_text input_text;
+        input_text.text = prompt_str.c_str();
+        input_text.add_special = true;
+        input_text.parse_special = true;
+        const mtmd_bitmap *bitmaps[] = {bitmap};
+        t_start = std::chrono::steady_clock::now();
+        int32_t ret = mtmd_tokenize(mtmd_ctx, chunks, &input_text, bitmaps, 1);
+        const double ms_preprocess = bench_ms_since(t_start);
+        mtmd_bitmap_free(bitmap);
+        if (ret != 0) {
+            error = "mtmd_tokenize() failed, does the prompt contain the image marker?";
+            break;
+        }
+
+        double ms_encode = 0.0, ms_image_decode = 0.0, ms_prefill = 0.0;
+        llama_pos n_past = 0;
+        const size_t n_chunks = mtmd_input_chunks_size(chunks);
+        n_prompt_tokens = 0;
+        n_image_tokens = 0;
+        for (size_t i = 0; i < n_chunks && error.empty(); i++) {
+            const mtmd_input_chunk *chunk = mtmd_input_chunks_get(chunks, i);
+            const bool last = i == n_chunks - 1;
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                size_t n_tokens = 0;
+                const llama_token *tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+                t_start = std::chrono::steady_clock::now();
+                if (decode_text_tokens(llama_ctx, tokens, n_tokens, n_past, n_batch, last) != 0) {
+                    error = "llama_decode() failed during prompt prefill";
+                }
+                ms_prefill += bench_ms_since(t_start);
+                n_past += (llama_pos) n_tokens;
+                n_prompt_tokens += n_tokens;
+            } else {
+                t_start = std::chrono::steady_clock::now();
+                if (mtmd_encode_chunk(mtmd_ctx, chunk) != 0) {
+                    error = "mtmd_encode_chunk() failed";
+                    break;
+                }
+                ms_encode += bench_ms_since(t_start);
+
+                t_start = std::chrono::steady_clock::now();
+                if (mtmd_helper_decode_image_chunk(mtmd_ctx, llama_ctx, chunk, mtmd_get_output_embd(mtmd_ctx),
+                                                   n_past, 0, n_batch, &n_past) != 0) {
+                    error = "mtmd_helper_decode_image_chunk() failed";
+                }
+                ms_image_decode += bench_ms_since(t_start);
+                n_image_tokens += mtmd_input_chunk_get_n_tokens(chunk);
+            }
+        }
+        if (!error.empty()) {
+            break;
+        }
+
+        // generation: every token is sampled and decoded, end of generation is ignored
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        std::vector<double> ms_tokens;
+        for (int i = 0; i < n_gen && n_past < (llama_pos) llama_n_ctx(llama_ctx); i++) {
+            t_start = std::chrono::steady_clock::now();
+            const llama_token token = token_sampler_sample(sampler, llama_ctx, -1);
+            common_batch_clear(batch);
+            common_batch_add(batch, token, n_past++, { 0 }, true);
+            if (llama_decode(llama_ctx, batch) != 0) {
+                error = "llama_decode() failed during generation";
+                break;
+            }
+            ms_tokens.push_back(bench_ms_since(t_start));
+        }
+        llama_batch_free(batch);
+
+        if (timed && error.empty()) {
+            t_bitmap.push_back(ms_bitmap);
+            t_preprocess.push_back(ms_preprocess);
+            t_encode.push_back(ms_encode);
+            t_image_decode.push_back(ms_image_decode);
+            t_prefill.push_back(ms_prefill);
+            t_token.insert(t_token.end(), ms_tokens.begin(), ms_tokens.end());
+        }
+    }
+    mtmd_input_chunks_free(chunks);
+    token_sampler_free(sampler);
+    mtmd_embd_cache_clear(mtmd_ctx);
+    prefix_cache_reset(llama_ctx);
+
+    if (!error.empty()) {
+        LOGe("bench_multimodal: %s", error.c_str());
+    }
+
+    double tg_speed = 0.0;
+    if (!t_token.empty()) {
+        double sum = 0.0;
+        for (double ms : t_token) {
+            sum += ms;
+        }
+        tg_speed = 1000.0 * (double) t_token.size() / sum;
+    }
+
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+
+    std::ostringstream result;
+    result << "{\"model\":" << json_escape(model_desc)
+           << ",\"devices\":" << bench_devices_json()
+           << ",\"n_threads\":" << llama_n_threads(llama_ctx)
+           << ",\"image\":{\"width\":" << info.width << ",\"height\":" << info.height
+           << ",\"nx\":" << nx << ",\"ny\":" << ny << ",\"n_tokens\":" << n_image_tokens << "}"
+           << ",\"n_prompt_tokens\":" << n_prompt_tokens
+           << ",\"n_warmup\":" << n_warmup << ",\"n_reps\":" << n_reps;
+    if (!error.empty()) {
+        result << ",\"error\":" << json_escape(error);
+    }
+    result << ",\"stages_ms\":{"
+           << "\"bitmap\":" << bench_stats_json(t_bitmap)
+           << ",\"preprocess\":" << bench_stats_json(t_preprocess)
+           << ",\"encode\":" << bench_stats_json(t_encode)
+           << ",\"image_decode\":" << bench_stats_json(t_image_decode)
+           << ",\"prefill\":" << bench_stats_json(t_prefill)
+           << ",\"token\":" << bench_stats_json(t_token) << "}"
+           << ",\"tg_tokens_per_s\":" << tg_speed
+           << ",\"peak_rss_kb\":" << bench_peak_rss_kb() << "}";
+    return env->NewStringUTF(result.str().c_str());
+}
+
+// log-softmax of token in a row of logits
+static float token_logprob(const float * logits, int n_vocab, llama_token token) {
+    float max_logit = logits[0];
+    for (int i = 1; i < n_vocab; i++) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; i++) {
+        sum += std::exp((double) (logits[i] - max_logit));
+    }
+    return (float) (logits[token] - max_logit - std::log(sum));
+}
+
+// Tokenize the labels of a classify call; returns false if one of them has no tokens.
+// An answer follows the prompt as a new word, so labels get a leading space unless they have one:
+// "cat" alone would be scored by its word-piece tokens, which the model rarely predicts there
+static bool tokenize_labels(JNIEnv *env, llama_context * lctx, jobjectArray labels,
+                            std::vector<std::vector<llama_token>> & label_tokens) {
+    const int n_labels = env->GetArrayLength(labels);
+    label_tokens.resize(n_labels);
+    for (int i = 0; i < n_labels; i++) {
+        auto jlabel = (jstring) env->GetObjectArrayElement(labels, i);
+        const char *label = env->GetStringUTFChars(jlabel, nullptr);
+        const std::string text = std::isspace((unsigned char) label[0]) ? label : std::string(" ") + label;
+        label_tokens[i] = common_tokenize(lctx, text, false, false);
+        env->ReleaseStringUTFChars(jlabel, label);
+        env->DeleteLocalRef(jlabel);
+        if (label_tokens[i].empty()) {
+            LOGe("classify: label %d is empty", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// In-place softmax of log-likelihoods
+static void softmax(float * scores, size_t n) {
+    const float max_score = *std::max_element(scores, scores + n);
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        scores[i] = std::exp(scores[i] - max_score);
+        sum += scores[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        scores[i] = (float) (scores[i] / sum);
+    }
+}
+
+// Decode a batch in views of at most n_batch tokens. on_logits(i, logits) is called for every
+// token i of the batch that requests logits, before the next view overwrites them.
+template <typename F>
+static bool decode_batch_split(llama_context * lctx, const llama_batch & batch, int32_t n_batch, int n_embd,
+                               F && on_logits) {
+    n_batch = std::max<int32_t>(1, std::min<int32_t>(n_batch, (int32_t) llama_n_batch(lctx)));
+    for (int32_t i0 = 0; i0 < batch.n_tokens; i0 += n_batch) {
+        const int32_t n = std::min(n_batch, batch.n_tokens - i0);
+        llama_batch view = {
+            n,
+            batch.token ? batch.token + i0 : nullptr,
+            batch.embd ? batch.embd + (size_t) i0 * n_embd : nullptr,
+            batch.pos + i0,
+            batch.n_seq_id + i0,
+            batch.seq_id + i0,
+            batch.logits + i0,
+        };
+        if (llama_decode(lctx, view) != 0) {
+            return false;
+        }
+        for (int32_t i = 0; i < n; i++) {
+            if (batch.logits[i0 + i]) {
+                on_logits(i0 + i, llama_get_logits_ith(lctx, i));
+            }
+        }
+    }
+    return true;
+}
+
+// Score each label as a continuation of the evaluated prompt instead of generating text.
+// The first label token is read from the prompt logits; the remaining tokens of up to
+// n_seq_max - 1 labels are decoded together, each label in its own copy of sequence 0 on a
+// sequence that is not taken by a concurrent request.
+// Returns the label probabilities (softmax over the label log-likelihoods), or null on failure.
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_classify_1chunks(
+        JNIEnv *env,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jlong chunks_ptr,
+        jobjectArray labels,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    auto *chunks = reinterpret_cast<mtmd_input_chunks *>(chunks_ptr);
+    if (!mtmd_ctx || !llama_ctx || !chunks) {
+        LOGe("classify_chunks: Invalid pointers");
+        return nullptr;
+    }
+
+    std::vector<std::vector<llama_token>> label_tokens;
+    if (!tokenize_labels(env, llama_ctx, labels, label_tokens)) {
+        return nullptr;
+    }
+    const int n_labels = (int) label_tokens.size();
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    jlong n_past_j = eval_chunks_with_prefix(mtmd_ctx, llama_ctx, nullptr, chunks, n_batch);
+    if (n_past_j < 0) {
+        return nullptr;
+    }
+    const llama_pos n_past = (llama_pos) n_past_j;
+
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(llama_ctx));
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const float *prompt_logits = llama_get_logits_ith(llama_ctx, -1);
+    if (!prompt_logits) {
+        LOGe("classify_chunks: prompt has no logits");
+        prefix_cache_trim(llama_ctx);
+        return nullptr;
+    }
+
+    std::vector<float> scores(n_labels);
+    for (int i = 0; i < n_labels; i++) {
+        scores[i] = token_logprob(prompt_logits, n_vocab, label_tokens[i][0]);
+    }
+
+    // labels of a single token are fully scored by now
+    std::vector<int> pending;
+    for (int i = 0; i < n_labels; i++) {
+        if (label_tokens[i].size() > 1) {
+            pending.push_back(i);
+        }
+    }
+
+    llama_memory_t mem = llama_get_memory(llama_ctx);
+    std::vector<llama_seq_id> seqs;
+    while (seqs.size() < pending.size()) {
+        const llama_seq_id seq = seq_acquire(llama_ctx);
+        if (seq < 0) {
+            break;
+        }
+        seqs.push_back(seq);
+    }
+    // without a free sequence, labels are decoded one at a time on seq 0 and rolled back
+    const size_t n_group = std::max<size_t>(1, seqs.size());
+    auto label_seq = [&](size_t i_group) { return seqs.empty() ? 0 : seqs[i_group]; };
+    bool ok = true;
+
+    for (size_t g = 0; ok && g < pending.size(); g += n_group) {
+        const size_t g_end = std::min(pending.size(), g + n_group);
+
+        int n_tokens = 0;
+        for (size_t k = g; k < g_end; k++) {
+            n_tokens += (int) label_tokens[pending[k]].size() - 1;
+        }
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+        for (size_t k = g; k < g_end; k++) {
+            const llama_seq_id seq = label_seq(k - g);
+            if (seq != 0) {
+                llama_memory_seq_cp(mem, 0, seq, -1, -1);
+            }
+            const auto &tokens = label_tokens[pending[k]];
+            for (size_t t = 0; t + 1 < tokens.size(); t++) {
+                common_batch_add(batch, tokens[t], n_past + (llama_pos) t, { seq }, true);
+            }
+        }
+
+        ok = llama_decode(llama_ctx, batch) == 0;
+        if (ok) {
+            int i_out = 0;
+            for (size_t k = g; k < g_end; k++) {
+                const auto &tokens = label_tokens[pending[k]];
+                for (size_t t = 1; t < tokens.size(); t++) {
+                    scores[pending[k]] += token_logprob(llama_get_logits_ith(llama_ctx, i_out++), n_vocab, tokens[t]);
+                }
+            }
+        } else {
+            LOGe("classify_chunks: llama_decode() failed");
+        }
+        llama_batch_free(batch);
+
+        for (size_t k = g; k < g_end; k++) {
+            const llama_seq_id seq = label_seq(k - g);
+            if (seq != 0) {
+                llama_memory_seq_rm(mem, seq, -1, -1);
+            } else {
+                llama_memory_seq_rm(mem, 0, n_past, -1);
+            }
+        }
+    }
+
+    for (const llama_seq_id seq : seqs) {
+        seq_release(llama_ctx, seq);
+    }
+
+    prefix_cache_trim(llama_ctx);
+    if (!ok) {
+        return nullptr;
+    }
+
+    softmax(scores.data(), scores.size());
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start_time);
+    LOGi("✅ classify_chunks: %d labels scored in %lld ms", n_labels, duration.count());
+
+    jfloatArray result = env->NewFloatArray(n_labels);
+    env->SetFloatArrayRegion(result, 0, n_labels, scores.data());
+    return result;
+}
+
+// Classify several regions of one frame against the same labels.
+// The bitmap is locked once; each rect (left, top, right, bottom) is cropped and box-downscaled
+// straight from the locked pixels, and all crops go through the vision encoder in one
+// mtmd_encode_chunks() pass. The text before the image is decoded once in seq 0; every region
+// continues it on a sequence of its own, and the image tokens (all slices of a tiled crop), the
+// text after the image and the label tokens of all regions in a group share their decode batches.
+// Returns n_regions x n_labels probabilities, row by row, or null on failure.
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_classify_1regions(
+        JNIEnv *env,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jobject jbitmap,
+        jintArray jrects,
+        jstring prompt,
+        jobjectArray labels,
+        jint n_batch) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    if (!mtmd_ctx || !llama_ctx) {
+        LOGe("classify_regions: Invalid pointers");
+        return nullptr;
+    }
+    text_threads_apply_thermal_scale(llama_ctx);
+
+    std::vector<std::vector<llama_token>> label_tokens;
+    if (!tokenize_labels(env, llama_ctx, labels, label_tokens)) {
+        return nullptr;
+    }
+    const size_t n_labels = label_tokens.size();
+
+    const size_t n_regions = (size_t) env->GetArrayLength(jrects) / 4;
+    if (n_regions == 0) {
+        return env->NewFloatArray(0);
+    }
+    std::vector<jint> rects(n_regions * 4);
+    env->GetIntArrayRegion(jrects, 0, (jsize) rects.size(), rects.data());
+
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, jbitmap, &info) < 0) {
+        LOGe("Failed to get bitmap info");
+        return nullptr;
+    }
+    if (info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 && info.format != ANDROID_BITMAP_FORMAT_RGB_565) {
+        LOGe("Unsupported bitmap format %d (expected RGBA_8888 or RGB_565)", info.format);
+        return nullptr;
+    }
+    const uint32_t bpp = info.format == ANDROID_BITMAP_FORMAT_RGBA_8888 ? 4 : 2;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // crops, converted while the pixels are locked
+    std::vector<mtmd_bitmap *> bitmaps(n_regions, nullptr);
+    void *pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, jbitmap, &pixels) < 0) {
+        LOGe("Failed to lock bitmap pixels");
+        return nullptr;
+    }
+    const int image_size = mtmd_get_image_size(mtmd_ctx);
+    bool ok = true;
+    for (size_t r = 0; r < n_regions && ok; r++) {
+        const uint32_t left   = (uint32_t) std::clamp<jint>(rects[r * 4 + 0], 0, (jint) info.width);
+        const uint32_t top    = (uint32_t) std::clamp<jint>(rects[r * 4 + 1], 0, (jint) info.height);
+        const uint32_t right  = (uint32_t) std::clamp<jint>(rects[r * 4 + 2], 0, (jint) info.width);
+        const uint32_t bottom = (uint32_t) std::clamp<jint>(rects[r * 4 + 3], 0, (jint) info.height);
+        if (right <= left || bottom <= top) {
+            LOGe("classify_regions: region %zu is empty", r);
+            ok = false;
+            break;
+        }
+        // a view of the rect inside the locked pixels, rows keep the bitmap stride
+        AndroidBitmapInfo crop = info;
+        crop.width = right - left;
+        crop.height = bottom - top;
+        const auto *origin = static_cast<const uint8_t *>(pixels) + (size_t) top * info.stride + (size_t) left * bpp;
+        bitmaps[r] = bitmap_from_pixels_box(crop, origin, downscale_factor(crop, image_size));
+        ok = bitmaps[r] != nullptr;
+    }
+    AndroidBitmap_unlockPixels(env, jbitmap);
+
+    // the prompt is compiled once for all crops
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    mtmd_input_text input_text;
+    input_text.text = prompt_chars;
+    input_text.add_special = true;
+    input_text.parse_special = true;
+    mtmd_prompt *region_prompt = mtmd_prompt_init(mtmd_ctx, &input_text);
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+
+    // expected layout per region: [text] image (text image)* text. Tiling projectors
+    // (llava-uhd, idefics3) give several image chunks per crop with delimiter text between them;
+    // all of them are decoded on the region's sequence. The leading text must be the same for
+    // every region, it is decoded once
+    struct region_layout {
+        std::vector<const mtmd_input_chunk *> middle; // image and delimiter text chunks, in order
+        std::vector<size_t> offsets;                  // embeddings of the image chunks in middle
+        const llama_token *suffix = nullptr;
+        size_t n_suffix = 0;
+        size_t n_tokens = 0;                          // of middle and suffix
+    };
+    std::vector<mtmd_input_chunks *> region_chunks(n_regions, nullptr);
+    std::vector<region_layout> regions(n_regions);
+    std::vector<const mtmd_input_chunk *> image_chunks;
+    const llama_token *prefix = nullptr;
+    size_t n_prefix = 0;
+    for (size_t r = 0; r < n_regions && ok; r++) {
+        region_chunks[r] = mtmd_input_chunks_init();
+        const mtmd_bitmap *region_bitmap[] = {bitmaps[r]};
+        if (mtmd_tokenize_prompt(mtmd_ctx, region_chunks[r], region_prompt, region_bitmap, 1) != 0) {
+            LOGe("classify_regions: failed to tokenize region %zu", r);
+            ok = false;
+            break;
+        }
+
+        const size_t n_chunks = mtmd_input_chunks_size(region_chunks[r]);
+        auto chunk_at = [&](size_t i) { return mtmd_input_chunks_get(region_chunks[r], i); };
+        auto is_text = [&](size_t i) { return mtmd_input_chunk_get_type(chunk_at(i)) == MTMD_INPUT_CHUNK_TYPE_TEXT; };
+        if (n_chunks < 2 || !is_text(n_chunks - 1)) {
+            LOGe("classify_regions: the prompt needs text after the image marker");
+            ok = false;
+            break;
+        }
+        size_t i_first = 0;
+        const llama_token *region_prefix = nullptr;
+        size_t n_region_prefix = 0;
+        if (is_text(0)) {
+            region_prefix = mtmd_input_chunk_get_tokens_text(chunk_at(0), &n_region_prefix);
+            i_first = 1;
+        }
+        if (r == 0) {
+            prefix = region_prefix;
+            n_prefix = n_region_prefix;
+        } else if (n_region_prefix != n_prefix || !std::equal(prefix, prefix + n_prefix, region_prefix)) {
+            LOGe("classify_regions: the text before the image of region %zu differs from region 0", r);
+            ok = false;
+            break;
+        }
+
+        auto &region = regions[r];
+        size_t n_images = 0;
+        for (size_t i = i_first; i + 1 < n_chunks && ok; i++) {
+            const mtmd_input_chunk *chunk = chunk_at(i);
+            const auto type = mtmd_input_chunk_get_type(chunk);
+            if (type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                n_images++;
+                image_chunks.push_back(chunk);
+            } else if (type != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                LOGe("classify_regions: region %zu has a non-image media chunk", r);
+                ok = false;
+            }
+            region.middle.push_back(chunk);
+            region.n_tokens += mtmd_input_chunk_get_n_tokens(chunk);
+        }
+        if (ok && n_images == 0) {
+            LOGe("classify_regions: the prompt needs an image marker");
+            ok = false;
+        }
+        region.suffix = mtmd_input_chunk_get_tokens_text(chunk_at(n_chunks - 1), &region.n_suffix);
+        region.n_tokens += region.n_suffix;
+    }
+    mtmd_prompt_free(region_prompt);
+
+    std::vector<size_t> offsets(image_chunks.size());
+    if (ok && mtmd_encode_chunks(mtmd_ctx, image_chunks.data(), image_chunks.size(), offsets.data()) != 0) {
+        LOGe("classify_regions: mtmd_encode_chunks() failed");
+        ok = false;
+    }
+    size_t max_middle = 0;
+    for (size_t r = 0, i_image = 0; r < n_regions && ok; r++) {
+        for (const mtmd_input_chunk *chunk : regions[r].middle) {
+            regions[r].offsets.push_back(mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE ? offsets[i_image++] : 0);
+        }
+        max_middle = std::max(max_middle, regions[r].middle.size());
+    }
+
+    // shared prefix in seq 0, kept as the prompt prefix cache
+    if (ok) {
+        prefix_cache_reset(llama_ctx);
+        ok = decode_text_tokens(llama_ctx, prefix, n_prefix, 0, n_batch, false) == 0;
+        if (ok) {
+            g_prefix_cache.tokens.assign(prefix, prefix + n_prefix);
+        }
+    }
+
+    const llama_model *model = llama_get_model(llama_ctx);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int n_embd = llama_model_n_embd(model);
+    llama_memory_t mem = llama_get_memory(llama_ctx);
+    float *embd = mtmd_get_output_embd(mtmd_ctx);
+    // mtmd_helper_decode_image_chunk handles M-RoPE positions and non-causal attention
+    const bool batch_images = !mtmd_decode_use_mrope(mtmd_ctx) && !mtmd_decode_use_non_causal(mtmd_ctx);
+
+    std::vector<llama_seq_id> seqs;
+    while (ok && seqs.size() < n_regions) {
+        const llama_seq_id seq = seq_acquire(llama_ctx);
+        if (seq < 0) {
+            break;
+        }
+        seqs.push_back(seq);
+    }
+    // regions per group: at most one per free sequence (seq 0 alone if there is none), and as
+    // many as fit in llama_n_batch by their own image, delimiter and suffix tokens (at least one)
+    const size_t n_seq_group = std::max<size_t>(1, seqs.size());
+    auto group_end = [&](size_t g) {
+        size_t g_end = g, n_tokens = 0;
+        while (g_end < n_regions && g_end - g < n_seq_group) {
+            if (g_end > g && n_tokens + regions[g_end].n_tokens > llama_n_batch(llama_ctx)) {
+                break;
+            }
+            n_tokens += regions[g_end].n_tokens;
+            g_end++;
+        }
+        return g_end;
+    };
+
+    std::vector<float> scores(n_regions * n_labels, 0.0f);
+    for (size_t g = 0, g_end = 0; ok && g < n_regions; g = g_end) {
+        g_end = group_end(g);
+        auto region_seq = [&](size_t r) { return seqs.empty() ? 0 : seqs[r - g]; };
+        for (size_t r = g; r < g_end; r++) {
+            if (region_seq(r) != 0) {
+                llama_memory_seq_cp(mem, 0, region_seq(r), -1, -1);
+            }
+        }
+
+        // chunk k of every region in one step, so each sequence gets its chunks in prompt order
+        std::vector<llama_pos> n_past(n_regions, (llama_pos) n_prefix);
+        for (size_t k = 0; k < max_middle && ok; k++) {
+            size_t n_img_tokens = 0, n_text_tokens = 0;
+            for (size_t r = g; r < g_end; r++) {
+                if (k < regions[r].middle.size()) {
+                    const mtmd_input_chunk *chunk = regions[r].middle[k];
+                    (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE ? n_img_tokens : n_text_tokens) +=
+                            mtmd_input_chunk_get_n_tokens(chunk);
+                }
+            }
+
+            // image tokens
+            if (n_img_tokens > 0 && batch_images) {
+                llama_batch batch = llama_batch_init((int32_t) n_img_tokens, n_embd, 1);
+                for (size_t r = g; r < g_end; r++) {
+                    if (k >= regions[r].middle.size() ||
+                        mtmd_input_chunk_get_type(regions[r].middle[k]) != MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                        continue;
+                    }
+                    const size_t n_img = mtmd_input_chunk_get_n_tokens(regions[r].middle[k]);
+                    const float *src = embd + regions[r].offsets[k];
+                    std::copy(src, src + n_img * n_embd, batch.embd + (size_t) batch.n_tokens * n_embd);
+                    for (size_t i = 0; i < n_img; i++) {
+                        const int32_t j = batch.n_tokens++;
+                        batch.pos[j] = n_past[r]++;
+                        batch.n_seq_id[j] = 1;
+                        batch.seq_id[j][0] = region_seq(r);
+                        batch.logits[j] = false;
+                    }
+                }
+                ok = decode_batch_split(llama_ctx, batch, n_batch, n_embd, [](int32_t, const float *) {});
+                llama_batch_free(batch);
+            } else if (n_img_tokens > 0) {
+                for (size_t r = g; r < g_end && ok; r++) {
+                    if (k < regions[r].middle.size() &&
+                        mtmd_input_chunk_get_type(regions[r].middle[k]) == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                        ok = mtmd_helper_decode_image_chunk(mtmd_ctx, llama_ctx, regions[r].middle[k],
+                                                            embd + regions[r].offsets[k], n_past[r], region_seq(r),
+                                                            n_batch, &n_past[r]) == 0;
+                    }
+                }
+            }
+
+            // delimiter text between slices
+            if (n_text_tokens > 0 && ok) {
+                llama_batch batch = llama_batch_init((int32_t) n_text_tokens, 0, 1);
+                for (size_t r = g; r < g_end; r++) {
+                    if (k >= regions[r].middle.size() ||
+                        mtmd_input_chunk_get_type(regions[r].middle[k]) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                        continue;
+                    }
+                    size_t n_tokens = 0;
+                    const llama_token *tokens = mtmd_input_chunk_get_tokens_text(regions[r].middle[k], &n_tokens);
+                    for (size_t t = 0; t < n_tokens; t++) {
+                        common_batch_add(batch, tokens[t], n_past[r]++, { region_seq(r) }, false);
+                    }
+                }
+                ok = decode_batch_split(llama_ctx, batch, n_batch, 0, [](int32_t, const float *) {});
+                llama_batch_free(batch);
+            }
+        }
+
+        // text after the image, logits of its last token start the label scores
+        if (ok) {
+            size_t n_tokens = 0;
+            for (size_t r = g; r < g_end; r++) {
+                n_tokens += regions[r].n_suffix;
+            }
+            llama_batch batch = llama_batch_init((int32_t) n_tokens, 0, 1);
+            for (size_t r = g; r < g_end; r++) {
+                const auto &region = regions[r];
+                for (size_t t = 0; t < region.n_suffix; t++) {
+                    common_batch_add(batch, region.suffix[t], n_past[r]++, { region_seq(r) }, t + 1 == region.n_suffix);
+                }
+            }
+            // only the last suffix token of each region has logits, in region order
+            size_t r = g;
+            ok = decode_batch_split(llama_ctx, batch, n_batch, 0, [&](int32_t, const float *logits) {
+                for (size_t l = 0; l < n_labels; l++) {
+                    scores[r * n_labels + l] = token_logprob(logits, n_vocab, label_tokens[l][0]);
+                }
+                r++;
+            });
+            llama_batch_free(batch);
+        }
+
+        // remaining tokens of multi-token labels, one label at a time for all regions
+        for (size_t l = 0; l < n_labels && ok; l++) {
+            const auto &tokens = label_tokens[l];
+            if (tokens.size() < 2) {
+                continue;
+            }
+            llama_batch batch = llama_batch_init((int32_t) ((tokens.size() - 1) * (g_end - g)), 0, 1);
+            for (size_t r = g; r < g_end; r++) {
+                for (size_t t = 0; t + 1 < tokens.size(); t++) {
+                    common_batch_add(batch, tokens[t], n_past[r] + (llama_pos) t, { region_seq(r) }, true);
+                }
+            }
+            // token t of a region's label is predicted by the logits of its token t - 1
+            const size_t n_label = tokens.size() - 1;
+            ok = decode_batch_split(llama_ctx, batch, n_batch, 0, [&](int32_t i, const float *logits) {
+                const size_t r = g + (size_t) i / n_label;
+                scores[r * n_labels + l] += token_logprob(logits, n_vocab, tokens[(size_t) i % n_label + 1]);
+            });
+            for (size_t r = g; r < g_end; r++) {
+                llama_memory_seq_rm(mem, region_seq(r), n_past[r], -1);
+            }
+            llama_batch_free(batch);
+        }
+
+        for (size_t r = g; r < g_end; r++) {
+            if (region_seq(r) != 0) {
+                llama_memory_seq_rm(mem, region_seq(r), -1, -1);
+            } else {
+                llama_memory_seq_rm(mem, 0, (llama_pos) n_prefix, -1);
+            }
+        }
+    }
+
+    for (const llama_seq_id seq : seqs) {
+        seq_release(llama_ctx, seq);
+    }
+    for (size_t r = 0; r < n_regions; r++) {
+        if (region_chunks[r]) {
+            mtmd_input_chunks_free(region_chunks[r]);
+        }
+        if (bitmaps[r]) {
+            mtmd_bitmap_free(bitmaps[r]);
+        }
+    }
+    prefix_cache_trim(llama_ctx);
+
+    if (!ok) {
+        LOGe("classify_regions: failed");
+        return nullptr;
+    }
+    for (size_t r = 0; r < n_regions; r++) {
+        softmax(scores.data() + r * n_labels, n_labels);
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start_time);
+    LOGi("✅ classify_regions: %zu regions x %zu labels in %lld ms", n_regions, n_labels, duration.count());
+
+    jfloatArray result = env->NewFloatArray((jsize) scores.size());
+    env->SetFloatArrayRegion(result, 0, (jsize) scores.size(), scores.data());
+    return result;
+}
+
+// Camera session
+// Frames go into a single-slot mailbox: a frame that was not picked up before the next one
+// arrives is dropped, so results never lag behind the camera by more than one inference.
+// The prompt is tokenized once; the bitmap, chunks, batch and conversion buffers are kept across frames.
+struct camera_session {
+    mtmd_context * mtmd_ctx;
+    llama_context * lctx;
+    token_sampler * sampler;
+    mtmd_prompt * prompt = nullptr;
+    int32_t n_len;
+    int32_t n_batch;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<uint8_t> mailbox; // RGB, guarded by mutex
+    uint32_t mailbox_nx = 0;
+    uint32_t mailbox_ny = 0;
+    int64_t mailbox_ts = 0;
+    bool mailbox_full = false;
+    bool closed = false;
+    int64_t n_dropped = 0;
+
+    // submit side (single producer)
+    std::vector<uint8_t> staging;
+    std::vector<uint8_t> row_rgb;
+    std::vector<uint32_t> acc;
+
+    // inference side
+    mtmd_bitmap * bitmap = nullptr;
+    mtmd_input_chunks * chunks = nullptr;
+    llama_batch batch;
+    stop_matcher stop;
+    std::string pending_utf8;
+    std::string text;
+
+    jclass result_class = nullptr; // global ref to CameraFrameResult
+    jmethodID result_ctor = nullptr;
+};
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1init(
+        JNIEnv *env,
+        jobject,
+        jlong mtmd_ctx_ptr,
+        jlong llama_ctx_ptr,
+        jlong sampler_ptr,
+        jstring prompt,
+        jint n_len,
+        jint n_batch,
+        jobjectArray stop_strings,
+        jstring stop_regex,
+        jboolean stop_json_object) {
+
+    auto *mtmd_ctx = reinterpret_cast<mtmd_context *>(mtmd_ctx_ptr);
+    auto *llama_ctx = reinterpret_cast<llama_context *>(llama_ctx_ptr);
+    auto *sampler = reinterpret_cast<token_sampler *>(sampler_ptr);
+    if (!mtmd_ctx || !llama_ctx || !sampler) {
+        LOGe("session_init: Invalid pointers");
+        return 0;
+    }
+
+    jclass cls = env->FindClass("android/llama/cpp/CameraFrameResult");
+    if (!cls) {
+        return 0; // NoClassDefFoundError pending
+    }
+
+    auto *session = new camera_session();
+    if (!stop_matcher_init(env, session->stop, stop_strings, stop_regex, stop_json_object)) {
+        delete session;
+        return 0;
+    }
+
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    mtmd_input_text input_text;
+    input_text.text = prompt_chars;
+    input_text.add_special = true;
+    input_text.parse_special = true;
+
+    session->mtmd_ctx = mtmd_ctx;
+    session->lctx = llama_ctx;
+    session->sampler = sampler;
+    session->prompt = mtmd_prompt_init(mtmd_ctx, &input_text);
+    session->n_len = n_len;
+    session->n_batch = n_batch;
+    session->chunks = mtmd_input_chunks_init();
+    session->batch = llama_batch_init(1, 0, 1);
+    session->result_class = (jclass) env->NewGlobalRef(cls);
+    session->result_ctor = env->GetMethodID(cls, "<init>", "(JLjava/lang/String;J)V");
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+    return reinterpret_cast<jlong>(session);
+}
+
+// Convert a camera frame into the mailbox, replacing any frame that has not been picked up.
+// Must be called from a single thread. Returns true if a pending frame was dropped.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1submit(
+        JNIEnv *env,
+        jobject,
+        jlong session_ptr,
+        jobject bitmap,
+        jlong timestamp_ns) {
+
+    auto *session = reinterpret_cast<camera_session *>(session_ptr);
+
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) < 0) {
+        LOGe("Failed to get bitmap info");
+        return JNI_FALSE;
+    }
+    if (info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 && info.format != ANDROID_BITMAP_FORMAT_RGB_565) {
+        LOGe("Unsupported bitmap format %d (expected RGBA_8888 or RGB_565)", info.format);
+        return JNI_FALSE;
+    }
+
+    const uint32_t factor = downscale_factor(info, mtmd_get_image_size(session->mtmd_ctx));
+    const uint32_t nx = info.width / factor;
+    const uint32_t ny = info.height / factor;
+
+    void *pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) < 0) {
+        LOGe("Failed to lock bitmap pixels");
+        return JNI_FALSE;
+    }
+    // keeps its capacity, so this only allocates when the frame size grows
+    session->staging.resize((size_t) nx * ny * 3);
+    box_downscale_rgb(info, pixels, factor, session->staging.data(), session->row_rgb, session->acc);
+    AndroidBitmap_unlockPixels(env, bitmap);
+
+    bool dropped;
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        dropped = session->mailbox_full;
+        if (dropped) {
+            session->n_dropped++;
+        }
+        session->mailbox.swap(session->staging);
+        session->mailbox_nx = nx;
+        session->mailbox_ny = ny;
+        session->mailbox_ts = timestamp_ns;
+        session->mailbox_full = true;
+    }
+    session->cv.notify_one();
+    return dropped ? JNI_TRUE : JNI_FALSE;
+}
+
+// Wait up to timeout_ms for a frame without taking it; true once one is ready. Touches no
+// llama state, so it is called off the run loop and session_next only runs the frame.
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1wait(JNIEnv *, jobject, jlong session_ptr, jint timeout_ms) {
+    auto *session = reinterpret_cast<camera_session *>(session_ptr);
+    std::unique_lock<std::mutex> lock(session->mutex);
+    session->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                         [&] { return session->mailbox_full || session->closed; });
+    return session->mailbox_full && !session->closed ? JNI_TRUE : JNI_FALSE;
+}
+
+// Wait up to timeout_ms for a frame, run it and return a CameraFrameResult,
+// or null on timeout, after session_close, or on failure.
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1next(
+        JNIEnv *env,
+        jobject,
+        jlong session_ptr,
+        jint timeout_ms) {
+
+    auto *session = reinterpret_cast<camera_session *>(session_ptr);
+
+    int64_t timestamp_ns;
+    int64_t n_dropped;
+    {
+        std::unique_lock<std::mutex> lock(session->mutex);
+        if (!session->cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                                  [&] { return session->mailbox_full || session->closed; }) || session->closed) {
+            return nullptr;
+        }
+        const uint32_t nx = session->mailbox_nx;
+        const uint32_t ny = session->mailbox_ny;
+        if (!session->bitmap || mtmd_bitmap_get_nx(session->bitmap) != nx || mtmd_bitmap_get_ny(session->bitmap) != ny) {
+            if (session->bitmap) {
+                mtmd_bitmap_free(session->bitmap);
+            }
+            session->bitmap = mtmd_bitmap_init(nx, ny, nullptr);
+        }
+        memcpy(mtmd_bitmap_get_data_mut(session->bitmap), session->mailbox.data(), (size_t) nx * ny * 3);
+        timestamp_ns = session->mailbox_ts;
+        n_dropped = session->n_dropped;
+        session->mailbox_full = false;
+    }
+
+    MTMD_TRACE_SCOPE("camera_frame");
+    // only the image chunk is new, the text chunks of the last frame are refilled in place
+    const mtmd_bitmap *bitmaps[] = {session->bitmap};
+    int32_t ret = mtmd_tokenize_prompt(session->mtmd_ctx, session->chunks, session->prompt, bitmaps, 1);
+    if (ret != 0) {
+        LOGe("session_next: mtmd_tokenize_prompt failed with code %d", ret);
+        return nullptr;
+    }
+
+    jlong n_past = eval_chunks_with_prefix(session->mtmd_ctx, session->lctx, nullptr, session->chunks, session->n_batch);
+    if (n_past < 0) {
+        return nullptr;
+    }
+
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(session->lctx));
+    session->text.clear();
+    session->pending_utf8.clear();
+    session->stop.reset();
+    token_sampler_reset(session->sampler);
+    bool stopped = false;
+    for (int32_t i = 0; i < session->n_len; i++) {
+        const llama_token token = token_sampler_sample(session->sampler, session->lctx, -1);
+        if (llama_vocab_is_eog(vocab, token)) {
+            break;
+        }
+        MTMD_TRACE_ADD(MTMD_TRACE_GENERATED_TOKENS, 1);
+        session->pending_utf8 += common_token_to_piece(session->lctx, token, false);
+        if (is_valid_utf8(session->pending_utf8.c_str())) {
+            stopped = session->stop.feed(session->pending_utf8, session->text);
+            session->pending_utf8.clear();
+            if (stopped) {
+                break;
+            }
+        }
+        common_batch_clear(session->batch);
+        common_batch_add(session->batch, token, (llama_pos) n_past++, { 0 }, true);
+        if (llama_decode(session->lctx, session->batch) != 0) {
+            LOGe("session_next: llama_decode() failed");
+            break;
+        }
+    }
+
+    prefix_cache_trim(session->lctx);
+
+    // a UTF-8 sequence cut short by n_len comes out as U+FFFD
+    if (!stopped) {
+        session->stop.flush(session->pending_utf8, session->text);
+    }
+
+    jstring text = env->NewStringUTF(session->text.c_str());
+    jobject result = env->NewObject(session->result_class, session->result_ctor, (jlong) timestamp_ns, text, (jlong) n_dropped);
+    env->DeleteLocalRef(text);
+    return result;
+}
+
+// Wake up session_next and make it return null from now on; may be called from any thread
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1close(JNIEnv *, jobject, jlong session_ptr) {
+    auto *session = reinterpret_cast<camera_session *>(session_ptr);
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->closed = true;
+    }
+    session->cv.notify_all();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_session_1free(JNIEnv *env, jobject, jlong session_ptr) {
+    auto *session = reinterpret_cast<camera_session *>(session_ptr);
+    if (!session) {
+        return;
+    }
+    if (session->bitmap) {
+        mtmd_bitmap_free(session->bitmap);
+    }
+    mtmd_input_chunks_free(session->chunks);
+    mtmd_prompt_free(session->prompt);
+    llama_batch_free(session->batch);
+    env->DeleteGlobalRef(session->result_class);
+    delete session;
+}
@@ -1,14 +1,28 @@
 #include <android/log.h>
 #include <android/bitmap.h>
 #include <jni.h>
+#include <atomic>
+#include <chrono>
 #include <iomanip>
 #include <math.h>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <string>
 #include <unistd.h>
 #include <vector>
 #include "llama.h"
 #include "common.h"
+#include "llama-android.h"
 #include "mtmd/mtmd.h"
+#include "mtmd/mtmd-trace.h"
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 // Write C++ code here.
 //
@@ -32,12 +46,6 @@
 #define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
 #define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 
-jclass la_int_var;
-jmethodID la_int_var_value;
-jmethodID la_int_var_inc;
-
-std::string cached_token_chars;
-
 bool is_valid_utf8(const char * string) {
     if (!string) {
         return true;
@@ -75,6 +83,42 @@ bool is_valid_utf8(const char * string) {
     return true;
 }
 
+std::string utf8_replace_invalid(const std::string & str) {
+    const auto * bytes = (const unsigned char *) str.data();
+    const size_t n = str.size();
+    std::string out;
+    out.reserve(n);
+    size_t i = 0;
+    while (i < n) {
+        size_t num;
+        if ((bytes[i] & 0x80) == 0x00) {
+            num = 1;
+        } else if ((bytes[i] & 0xE0) == 0xC0) {
+            num = 2;
+        } else if ((bytes[i] & 0xF0) == 0xE0) {
+            num = 3;
+        } else if ((bytes[i] & 0xF8) == 0xF0) {
+            num = 4;
+        } else {
+            out += "\xEF\xBF\xBD";
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < n && j < i + num && (bytes[j] & 0xC0) == 0x80) {
+            j++;
+        }
+        if (j == i + num) {
+            out.append(str, i, num);
+        } else {
+            // one U+FFFD for the lead byte and the continuation bytes that came with it
+            out += "\xEF\xBF\xBD";
+        }
+        i = j;
+    }
+    return out;
+}
+
 static void log_callback(ggml_log_level level, const char * fmt, void * data) {
     if (level == GGML_LOG_LEVEL_ERROR)     __android_log_print(ANDROID_LOG_ERROR, TAG, fmt, data);
     else if (level == GGML_LOG_LEVEL_INFO) __android_log_print(ANDROID_LOG_INFO, TAG, fmt, data);
@@ -82,10 +126,301 @@ static void log_callback(ggml_log_level level, const char * fmt, void * data) {
     else __android_log_print(ANDROID_LOG_DEFAULT, TAG, fmt, data);
 }
 
+jint params_get_int(JNIEnv *env, jobject params, const char *name) {
+    jclass cls = env->GetObjectClass(params);
+    return env->GetIntField(params, env->GetFieldID(cls, name, "I"));
+}
+
+bool params_get_bool(JNIEnv *env, jobject params, const char *name) {
+    jclass cls = env->GetObjectClass(params);
+    return env->GetBooleanField(params, env->GetFieldID(cls, name, "Z")) == JNI_TRUE;
+}
+
+float params_get_float(JNIEnv *env, jobject params, const char *name) {
+    jclass cls = env->GetObjectClass(params);
+    return env->GetFloatField(params, env->GetFieldID(cls, name, "F"));
+}
+
+std::string params_get_string(JNIEnv *env, jobject params, const char *name) {
+    jclass cls = env->GetObjectClass(params);
+    auto jstr = (jstring) env->GetObjectField(params, env->GetFieldID(cls, name, "Ljava/lang/String;"));
+    if (!jstr) {
+        return {};
+    }
+    const char *chars = env->GetStringUTFChars(jstr, nullptr);
+    std::string str = chars;
+    env->ReleaseStringUTFChars(jstr, chars);
+    env->DeleteLocalRef(jstr);
+    return str;
+}
+
+static long read_sysfs_long(const std::string & path, long fallback) {
+    FILE * f = fopen(path.c_str(), "r");
+    if (!f) {
+        return fallback;
+    }
+    long value = fallback;
+    if (fscanf(f, "%ld", &value) != 1) {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+
+static cpu_topology cpu_topology_probe() {
+    struct core { long capacity; long max_freq; int id; };
+    std::vector<core> cores;
+    const int n_cpus = std::min((int) sysconf(_SC_NPROCESSORS_CONF), GGML_MAX_N_THREADS);
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        // cpu0 usually has no online file and cannot go offline
+        if (read_sysfs_long(dir + "/online", 1) == 0) {
+            continue;
+        }
+        cores.push_back({
+            read_sysfs_long(dir + "/cpu_capacity", 0),
+            read_sysfs_long(dir + "/cpufreq/cpuinfo_max_freq", 0),
+            cpu,
+        });
+    }
+    std::sort(cores.begin(), cores.end(), [](const core & a, const core & b) {
+        if (a.capacity != b.capacity) return a.capacity > b.capacity;
+        if (a.max_freq != b.max_freq) return a.max_freq > b.max_freq;
+        return a.id < b.id;
+    });
+
+    cpu_topology topo;
+    for (const auto & c : cores) {
+        topo.cores.push_back(c.id);
+        if (c.capacity != cores.back().capacity || c.max_freq != cores.back().max_freq) {
+            topo.n_perf++;
+        }
+    }
+    if (topo.n_perf == 0) {
+        topo.n_perf = (int) topo.cores.size();
+    }
+    return topo;
+}
+
+const cpu_topology & cpu_topology_get() {
+    static const cpu_topology topo = [] {
+        cpu_topology t = cpu_topology_probe();
+        std::stringstream order;
+        for (int id : t.cores) {
+            order << " " << id;
+        }
+        LOGi("CPU topology: %zu cores, %d performance, fastest first:%s", t.cores.size(), t.n_perf, order.str().c_str());
+        return t;
+    }();
+    return topo;
+}
+
+// The performance cores (2..6), used when LlamaParams leaves threads at 0
+// Efficiency cores only slow down the barrier between ops
+static int default_n_threads() {
+    return std::max(2, std::min(6, cpu_topology_get().n_perf));
+}
+
+ggml_threadpool * cpu_threadpool_new(int n_threads, int first, int n_cores) {
+    const cpu_topology & topo = cpu_topology_get();
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    const int end = std::min(first + std::max(n_cores, 1), (int) topo.cores.size());
+    for (int i = std::max(first, 0); i < end; i++) {
+        params.cpumask[topo.cores[i]] = true;
+    }
+    // threads may move between the allowed cores, only the other clusters are off limits
+    params.strict_cpu = false;
+    return ggml_threadpool_new(&params);
+}
+
+// Threadpool of the text context, and the counts it was asked for before thermal scaling.
+// Guarded by g_text_pool_mutex. The thermal scale is set from the thermal listener thread and
+// only applied to the context on the run loop, between decodes; g_thermal_scale_applied is
+// the scale its counts were last set with, run loop only
+static std::mutex g_text_pool_mutex;
+static llama_context * g_text_pool_ctx = nullptr;
+static ggml_threadpool * g_text_pool = nullptr;
+static int g_text_pool_size = 0;
+static int g_text_threads = 0;
+static int g_text_threads_batch = 0;
+static std::atomic<float> g_thermal_scale{1.0f};
+static float g_thermal_scale_applied = 1.0f;
+
+static int thermal_scaled(int n_threads, float scale) {
+    return std::max(1, (int) lroundf(n_threads * scale));
+}
+
+static void text_threads_free_locked(llama_context * ctx);
+
+void text_threads_set(llama_context * ctx, int n_threads, int n_threads_batch) {
+    std::lock_guard<std::mutex> lock(g_text_pool_mutex);
+    const int n_pool = std::max(n_threads, n_threads_batch);
+    if (g_text_pool_ctx != ctx || n_pool > g_text_pool_size) {
+        text_threads_free_locked(g_text_pool_ctx);
+        ggml_threadpool * pool = cpu_threadpool_new(n_pool, 0, n_pool);
+        if (pool) {
+            llama_attach_threadpool(ctx, pool, pool);
+            g_text_pool_ctx = ctx;
+            g_text_pool = pool;
+            g_text_pool_size = n_pool;
+        } else {
+            LOGe("text_threads_set: failed to create a threadpool of %d threads", n_pool);
+        }
+    }
+    g_text_threads = n_threads;
+    g_text_threads_batch = n_threads_batch;
+    g_thermal_scale_applied = g_thermal_scale;
+    llama_set_n_threads(ctx, thermal_scaled(n_threads, g_thermal_scale_applied),
+                        thermal_scaled(n_threads_batch, g_thermal_scale_applied));
+}
+
+void text_threads_free(llama_context * ctx) {
+    std::lock_guard<std::mutex> lock(g_text_pool_mutex);
+    text_threads_free_locked(ctx);
+}
+
+static void text_threads_free_locked(llama_context * ctx) {
+    if (!ctx || g_text_pool_ctx != ctx) {
+        return;
+    }
+    llama_detach_threadpool(ctx);
+    ggml_threadpool_free(g_text_pool);
+    g_text_pool_ctx = nullptr;
+    g_text_pool = nullptr;
+    g_text_pool_size = 0;
+}
+
+int text_threads_n_cores() {
+    std::lock_guard<std::mutex> lock(g_text_pool_mutex);
+    return g_text_pool ? std::min(g_text_pool_size, (int) cpu_topology_get().cores.size()) : 0;
+}
+
+void text_threads_set_thermal_scale(float scale) {
+    g_thermal_scale = std::max(0.0f, std::min(1.0f, scale));
+}
+
+void text_threads_apply_thermal_scale(llama_context * ctx) {
+    const float scale = g_thermal_scale;
+    if (scale == g_thermal_scale_applied) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_text_pool_mutex);
+    if (!ctx || g_text_pool_ctx != ctx) {
+        return;
+    }
+    g_thermal_scale_applied = scale;
+    llama_set_n_threads(ctx, thermal_scaled(g_text_threads, scale), thermal_scaled(g_text_threads_batch, scale));
+}
+
+float text_threads_thermal_scale() {
+    return g_thermal_scale;
+}
+
+llama_model_params model_params_from_java(JNIEnv *env, jobject params) {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = params_get_int(env, params, "nGpuLayers");
+    return model_params;
+}
+
+// Sequences handed out by seq_acquire, for the context in g_seq_ctx
+static llama_context * g_seq_ctx = nullptr;
+static std::vector<bool> g_seq_used;
+
+llama_seq_id seq_acquire(llama_context * ctx) {
+    if (g_seq_ctx != ctx) {
+        g_seq_ctx = ctx;
+        g_seq_used.assign(llama_n_seq_max(ctx), false);
+    }
+    for (size_t seq = 1; seq < g_seq_used.size(); seq++) {
+        if (!g_seq_used[seq]) {
+            g_seq_used[seq] = true;
+            return (llama_seq_id) seq;
+        }
+    }
+    return -1;
+}
+
+bool seq_any_acquired(llama_context * ctx) {
+    return g_seq_ctx == ctx && std::find(g_seq_used.begin(), g_seq_used.end(), true) != g_seq_used.end();
+}
+
+void seq_release(llama_context * ctx, llama_seq_id seq) {
+    llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+    if (g_seq_ctx == ctx && seq > 0 && (size_t) seq < g_seq_used.size()) {
+        g_seq_used[seq] = false;
+    }
+}
+
+#ifdef MTMD_TRACE
+// Time per ggml op of the text model, from the scheduler eval callback (LlamaParams.traceOps).
+// Observing every node makes the scheduler compute one node at a time, so the totals show
+// which ops dominate rather than the speed of an untraced decode.
+static std::atomic<int64_t> g_trace_op_us[GGML_OP_COUNT];
+static std::atomic<int64_t> g_trace_op_count[GGML_OP_COUNT];
+static thread_local int64_t g_trace_op_start = 0;
+
+static bool trace_op_callback(struct ggml_tensor * t, bool ask, void *) {
+    if (ask) {
+        ATrace_beginSection(ggml_op_desc(t));
+        g_trace_op_start = ggml_time_us();
+        return true;
+    }
+    g_trace_op_us[t->op].fetch_add(ggml_time_us() - g_trace_op_start, std::memory_order_relaxed);
+    g_trace_op_count[t->op].fetch_add(1, std::memory_order_relaxed);
+    ATrace_endSection();
+    return true;
+}
+#endif
+
+llama_context_params context_params_from_java(JNIEnv *env, jobject params) {
+    int n_threads       = params_get_int(env, params, "nThreads");
+    int n_threads_batch = params_get_int(env, params, "nThreadsBatch");
+    if (n_threads <= 0)       n_threads       = default_n_threads();
+    if (n_threads_batch <= 0) n_threads_batch = default_n_threads();
+
+    llama_context_params ctx_params = llama_context_default_params();
+
+    ctx_params.n_ctx           = params_get_int(env, params, "nCtx");
+    ctx_params.n_batch         = params_get_int(env, params, "nBatch");
+    ctx_params.n_ubatch        = params_get_int(env, params, "nUbatch");
+    ctx_params.n_threads       = n_threads;
+    ctx_params.n_threads_batch = n_threads_batch;
+
+    // Extra sequences are copies of the prompt (label scoring), a unified KV cache lets them
+    // share its cells instead of splitting n_ctx between them
+    ctx_params.n_seq_max       = std::max(1, (int) params_get_int(env, params, "nSeqMax"));
+    ctx_params.kv_unified      = params_get_bool(env, params, "kvUnified");
+
+    // KV Cache quantization (Q4_0 by default): reduces memory by 60% and speeds up eval
+    ctx_params.type_k          = (ggml_type) params_get_int(env, params, "typeK");
+    ctx_params.type_v          = (ggml_type) params_get_int(env, params, "typeV");
+
+    // Flash Attention: optimizes attention computation for mobile
+    ctx_params.flash_attn_type = params_get_bool(env, params, "flashAttention")
+                                 ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+
+    LOGi("Context params: n_ctx=%d, n_batch=%d, n_ubatch=%d, n_seq_max=%d%s, threads=%d/%d, KV=%s/%s, flash_attn=%s",
+         ctx_params.n_ctx, ctx_params.n_batch, ctx_params.n_ubatch,
+         ctx_params.n_seq_max, ctx_params.kv_unified ? " (unified)" : "", n_threads, n_threads_batch,
+         ggml_type_name(ctx_params.type_k), ggml_type_name(ctx_params.type_v),
+         (ctx_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "enabled" : "disabled"));
+
+#ifdef MTMD_TRACE
+    if (params_get_bool(env, params, "traceOps")) {
+        LOGi("Context params: per-op tracing enabled");
+        ctx_params.cb_eval = trace_op_callback;
+        ctx_params.cb_eval_user_data = nullptr;
+    }
+#endif
+
+    return ctx_params;
+}
+
 extern "C"
 JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename) {
+Java_android_llama_cpp_LLamaAndroid_load_1model(JNIEnv *env, jobject, jstring filename, jint n_gpu_layers) {
     llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = n_gpu_layers;
 
     auto path_to_model = env->GetStringUTFChars(filename, 0);
     LOGi("Loading model from %s", path_to_model);
@@ -111,7 +446,7 @@ Java_android_llama_cpp_LLamaAndroid_free_1model(JNIEnv *, jobject, jlong model)
 
 extern "C"
 JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel) {
+Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmodel, jobject params) {
     auto model = reinterpret_cast<llama_model *>(jmodel);
 
     if (!model) {
@@ -120,30 +455,7 @@ Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmo
         return 0;
     }
 
-    // Optimize thread count for mobile: use half of available cores (P-cores only on big.LITTLE)
-    // This avoids E-cores which can slow down inference
-    int total_cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
-    int n_threads = std::max(2, std::min(6, total_cores / 2));
-    LOGi("Total cores: %d, Using %d threads (optimized for P-cores)", total_cores, n_threads);
-
-    llama_context_params ctx_params = llama_context_default_params();
-
-    ctx_params.n_ctx           = 1024;  // Reduced for VLM (don't need long context)
-    ctx_params.n_threads       = n_threads;
-    ctx_params.n_threads_batch = n_threads;
-
-    // KV Cache quantization: reduces memory by 60% and speeds up eval
-    ctx_params.type_k          = GGML_TYPE_Q4_0;
-    ctx_params.type_v          = GGML_TYPE_Q4_0;
-
-    // Flash Attention: optimizes attention computation for mobile
-    ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
-
-    LOGi("Context params: n_ctx=%d, threads=%d, KV_Q4=%s, flash_attn=%s",
-         ctx_params.n_ctx, n_threads,
-         (ctx_params.type_k == GGML_TYPE_Q4_0 ? "enabled" : "disabled"),
-         (ctx_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "enabled" : "disabled"));
-
+    llama_context_params ctx_params = context_params_from_java(env, params);
     llama_context * context = llama_new_context_with_model(model, ctx_params);
 
     if (!context) {
@@ -152,14 +464,82 @@ Java_android_llama_cpp_LLamaAndroid_new_1context(JNIEnv *env, jobject, jlong jmo
                       "llama_new_context_with_model() returned null)");
         return 0;
     }
+    text_threads_set(context, ctx_params.n_threads, ctx_params.n_threads_batch);
 
     return reinterpret_cast<jlong>(context);
 }
 
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_set_1n_1threads(JNIEnv *, jobject, jlong context, jint n_threads, jint n_threads_batch) {
+    text_threads_set(reinterpret_cast<llama_context *>(context), n_threads, n_threads_batch);
+}
+
+// Measure prompt processing and generation speed (tokens/s) with the given thread counts.
+// Used to auto-tune threads on first launch; clears the KV cache.
+extern "C"
+JNIEXPORT jdoubleArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_bench_1threads(
+        JNIEnv *env,
+        jobject,
+        jlong context_pointer,
+        jlong batch_pointer,
+        jint n_threads,
+        jint n_threads_batch,
+        jint pp,
+        jint tg) {
+    const auto context = reinterpret_cast<llama_context *>(context_pointer);
+    const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    llama_memory_t mem = llama_get_memory(context);
+
+    text_threads_set(context, n_threads, n_threads_batch);
+
+    common_batch_clear(*batch);
+    for (int i = 0; i < pp; i++) {
+        common_batch_add(*batch, 0, i, { 0 }, false);
+    }
+    batch->logits[batch->n_tokens - 1] = true;
+
+    // seq 0 only, concurrent requests keep their sequences
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    const auto t_pp_start = ggml_time_us();
+    bool ok = llama_decode(context, *batch) == 0;
+    const auto t_pp_end = ggml_time_us();
+
+    const auto t_tg_start = ggml_time_us();
+    for (int i = 0; ok && i < tg; i++) {
+        common_batch_clear(*batch);
+        common_batch_add(*batch, 0, pp + i, { 0 }, true);
+        ok = llama_decode(context, *batch) == 0;
+    }
+    const auto t_tg_end = ggml_time_us();
+
+    llama_memory_seq_rm(mem, 0, -1, -1);
+
+    double speed[2] = { 0.0, 0.0 };
+    if (ok) {
+        speed[0] = pp * 1e6 / double(std::max<int64_t>(1, t_pp_end - t_pp_start));
+        speed[1] = tg * 1e6 / double(std::max<int64_t>(1, t_tg_end - t_tg_start));
+    } else {
+        LOGe("bench_threads: llama_decode() failed");
+    }
+    LOGi("bench_threads: threads=%d/%d, pp %.2f t/s, tg %.2f t/s", n_threads, n_threads_batch, speed[0], speed[1]);
+
+    jdoubleArray result = env->NewDoubleArray(2);
+    env->SetDoubleArrayRegion(result, 0, 2, speed);
+    return result;
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_android_llama_cpp_LLamaAndroid_free_1context(JNIEnv *, jobject, jlong context) {
-    llama_free(reinterpret_cast<llama_context *>(context));
+    auto *ctx = reinterpret_cast<llama_context *>(context);
+    if (g_seq_ctx == ctx) {
+        g_seq_ctx = nullptr;
+        g_seq_used.clear();
+    }
+    text_threads_free(ctx);
+    llama_free(ctx);
 }
 
 extern "C"
@@ -172,6 +552,16 @@ Java_android_llama_cpp_LLamaAndroid_kv_1cache_1clear(JNIEnv *, jobject, jlong co
     }
 }
 
+// Clear one sequence, leaving the others (e.g. concurrent requests) in place
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_kv_1cache_1seq_1rm(JNIEnv *, jobject, jlong context_ptr, jint seq_id) {
+    auto *context = reinterpret_cast<llama_context *>(context_ptr);
+    if (context) {
+        llama_memory_seq_rm(llama_get_memory(context), seq_id, -1, -1);
+    }
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_android_llama_cpp_LLamaAndroid_backend_1free(JNIEnv *, jobject) {
@@ -184,6 +574,96 @@ Java_android_llama_cpp_LLamaAndroid_log_1to_1android(JNIEnv *, jobject) {
     llama_log_set(log_callback, NULL);
 }
 
+std::string json_escape(const std::string & str) {
+    std::string out;
+    out.reserve(str.size() + 2);
+    out += '"';
+    for (const char c : str) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+    return out;
+}
+
+std::string bench_devices_json() {
+    std::string out = "[";
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        const char * type = "cpu";
+        switch (ggml_backend_dev_type(dev)) {
+            case GGML_BACKEND_DEVICE_TYPE_GPU:   type = "gpu";   break;
+            case GGML_BACKEND_DEVICE_TYPE_ACCEL: type = "accel"; break;
+            default: break;
+        }
+        if (i > 0) {
+            out += ",";
+        }
+        out += "{\"name\":" + json_escape(ggml_backend_dev_name(dev))
+            + ",\"description\":" + json_escape(ggml_backend_dev_description(dev))
+            + ",\"type\":\"" + type + "\"}";
+    }
+    return out + "]";
+}
+
+std::string bench_stats_json(std::vector<double> samples) {
+    if (samples.empty()) {
+        return "{\"n\":0}";
+    }
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    double mean = 0.0;
+    for (double v : samples) {
+        mean += v;
+    }
+    mean /= (double) n;
+    double var = 0.0;
+    for (double v : samples) {
+        var += (v - mean) * (v - mean);
+    }
+    const double stdev = n > 1 ? sqrt(var / (double) (n - 1)) : 0.0;
+    // nearest-rank percentiles
+    auto pct = [&](double p) { return samples[std::min(n - 1, (size_t) ceil(p / 100.0 * (double) n) - 1)]; };
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"n\":" << n << ",\"mean\":" << mean << ",\"std\":" << stdev
+        << ",\"min\":" << samples.front() << ",\"max\":" << samples.back()
+        << ",\"p50\":" << pct(50) << ",\"p95\":" << pct(95) << ",\"p99\":" << pct(99) << "}";
+    return out.str();
+}
+
+long bench_peak_rss_kb() {
+    FILE * f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Text-only benchmark: pp prompt tokens in one batch, then tg decode steps of pl sequences,
+// nr times after one untimed warm-up run. Random tokens avoid best-case cache behaviour of a
+// repeated token. Returns a markdown table, or JSON when json is set.
 extern "C"
 JNIEXPORT jstring JNICALL
 Java_android_llama_cpp_LLamaAndroid_bench_1model(
@@ -191,102 +671,129 @@ Java_android_llama_cpp_LLamaAndroid_bench_1model(
         jobject,
         jlong context_pointer,
         jlong model_pointer,
-        jlong batch_pointer,
         jint pp,
         jint tg,
         jint pl,
-        jint nr
+        jint nr,
+        jboolean json
         ) {
-    auto pp_avg = 0.0;
-    auto tg_avg = 0.0;
-    auto pp_std = 0.0;
-    auto tg_std = 0.0;
-
     const auto context = reinterpret_cast<llama_context *>(context_pointer);
     const auto model = reinterpret_cast<llama_model *>(model_pointer);
-    const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
-
-    const int n_ctx = llama_n_ctx(context);
-
-    LOGi("n_ctx = %d", n_ctx);
-
-    int i, j;
-    int nri;
-    for (nri = 0; nri < nr; nri++) {
-        LOGi("Benchmark prompt processing (pp)");
-
-        common_batch_clear(*batch);
-
-        const int n_tokens = pp;
-        for (i = 0; i < n_tokens; i++) {
-            common_batch_add(*batch, 0, i, { 0 }, false);
-        }
-
-        batch->logits[batch->n_tokens - 1] = true;
-        llama_memory_clear(llama_get_memory(context), false);
-
-        const auto t_pp_start = ggml_time_us();
-        if (llama_decode(context, *batch) != 0) {
-            LOGi("llama_decode() failed during prompt processing");
-        }
-        const auto t_pp_end = ggml_time_us();
-
-        // bench text generation
-
-        LOGi("Benchmark text generation (tg)");
+    llama_memory_t mem = llama_get_memory(context);
+
+    const int n_ctx = (int) llama_n_ctx(context);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::string error;
+    if (pp < 1 || tg < 1 || pl < 1 || nr < 1) {
+        error = "pp, tg, pl and nr must be positive";
+    } else if (pp > n_ctx || tg * pl > n_ctx) {
+        error = "pp and tg * pl must fit in n_ctx = " + std::to_string(n_ctx);
+    } else if (pl > (int) llama_n_seq_max(context)) {
+        error = "pl must not exceed n_seq_max = " + std::to_string(llama_n_seq_max(context));
+    } else if (seq_any_acquired(context)) {
+        // the benchmark runs on sequences 0..pl-1 and clears the cache
+        error = "concurrent requests are running";
+    }
 
-        llama_memory_clear(llama_get_memory(context), false);
-        const auto t_tg_start = ggml_time_us();
-        for (i = 0; i < tg; i++) {
+    std::vector<double> pp_speed;
+    std::vector<double> tg_speed;
+    if (error.empty()) {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<llama_token> dist(0, n_vocab - 1);
+        llama_batch batch = llama_batch_init(std::max<int>(pp, pl), 0, 1);
+
+        for (int r = -1; r < nr && error.empty(); r++) {
+            common_batch_clear(batch);
+            for (int i = 0; i < pp; i++) {
+                common_batch_add(batch, dist(rng), i, { 0 }, false);
+            }
+            batch.logits[batch.n_tokens - 1] = true;
+            llama_memory_clear(mem, false);
 
-            common_batch_clear(*batch);
-            for (j = 0; j < pl; j++) {
-                common_batch_add(*batch, 0, i, { j }, true);
+            auto t_start = std::chrono::steady_clock::now();
+            if (llama_decode(context, batch) != 0) {
+                error = "llama_decode() failed during prompt processing";
+                break;
+            }
+            const double t_pp = bench_ms_since(t_start);
+
+            llama_memory_clear(mem, false);
+            t_start = std::chrono::steady_clock::now();
+            for (int i = 0; i < tg; i++) {
+                common_batch_clear(batch);
+                for (int j = 0; j < pl; j++) {
+                    common_batch_add(batch, dist(rng), i, { j }, true);
+                }
+                if (llama_decode(context, batch) != 0) {
+                    error = "llama_decode() failed during text generation";
+                    break;
+                }
             }
+            const double t_tg = bench_ms_since(t_start);
 
-            LOGi("llama_decode() text generation: %d", i);
-            if (llama_decode(context, *batch) != 0) {
-                LOGi("llama_decode() failed during text generation");
+            // r == -1 is the warm-up run
+            if (error.empty() && r >= 0) {
+                pp_speed.push_back(1000.0 * pp / t_pp);
+                tg_speed.push_back(1000.0 * pl * tg / t_tg);
+                LOGi("pp %f t/s, tg %f t/s", pp_speed.back(), tg_speed.back());
             }
         }
 
-        const auto t_tg_end = ggml_time_us();
-
-        llama_memory_clear(llama_get_memory(context), false);
-
-        const auto t_pp = double(t_pp_end - t_pp_start) / 1000000.0;
-        const auto t_tg = double(t_tg_end - t_tg_start) / 1000000.0;
-
-        const auto speed_pp = double(pp) / t_pp;
-        const auto speed_tg = double(pl * tg) / t_tg;
-
-        pp_avg += speed_pp;
-        tg_avg += speed_tg;
+        llama_batch_free(batch);
+        llama_memory_clear(mem, false);
+    }
 
-        pp_std += speed_pp * speed_pp;
-        tg_std += speed_tg * speed_tg;
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
 
-        LOGi("pp %f t/s, tg %f t/s", speed_pp, speed_tg);
+    if (json) {
+        std::ostringstream result;
+        result << "{\"model\":" << json_escape(model_desc)
+               << ",\"model_size\":" << llama_model_size(model)
+               << ",\"n_params\":" << llama_model_n_params(model)
+               << ",\"devices\":" << bench_devices_json()
+               << ",\"n_threads\":" << llama_n_threads(context)
+               << ",\"n_threads_batch\":" << llama_n_threads_batch(context);
+        if (!error.empty()) {
+            result << ",\"error\":" << json_escape(error);
+        }
+        result << ",\"pp\":{\"n_tokens\":" << pp << ",\"tokens_per_s\":" << bench_stats_json(pp_speed) << "}"
+               << ",\"tg\":{\"n_tokens\":" << tg << ",\"n_parallel\":" << pl
+               << ",\"tokens_per_s\":" << bench_stats_json(tg_speed) << "}"
+               << ",\"peak_rss_kb\":" << bench_peak_rss_kb() << "}";
+        return env->NewStringUTF(result.str().c_str());
     }
 
-    pp_avg /= double(nr);
-    tg_avg /= double(nr);
-
-    if (nr > 1) {
-        pp_std = sqrt(pp_std / double(nr - 1) - pp_avg * pp_avg * double(nr) / double(nr - 1));
-        tg_std = sqrt(tg_std / double(nr - 1) - tg_avg * tg_avg * double(nr) / double(nr - 1));
-    } else {
-        pp_std = 0;
-        tg_std = 0;
+    if (!error.empty()) {
+        LOGe("bench_model: %s", error.c_str());
+        return env->NewStringUTF(("error: " + error).c_str());
     }
 
-    char model_desc[128];
-    llama_model_desc(model, model_desc, sizeof(model_desc));
+    auto mean_std = [](const std::vector<double> & v, double & mean, double & stdev) {
+        mean = 0.0;
+        for (double x : v) mean += x;
+        mean /= (double) v.size();
+        double var = 0.0;
+        for (double x : v) var += (x - mean) * (x - mean);
+        stdev = v.size() > 1 ? sqrt(var / (double) (v.size() - 1)) : 0.0;
+    };
+    double pp_avg, pp_std, tg_avg, tg_std;
+    mean_std(pp_speed, pp_avg, pp_std);
+    mean_std(tg_speed, tg_avg, tg_std);
 
     const auto model_size     = double(llama_model_size(model)) / 1024.0 / 1024.0 / 1024.0;
     const auto model_n_params = double(llama_model_n_params(model)) / 1e9;
 
-    const auto backend    = "(Android)"; // TODO: What should this be?
+    // devices other than the CPU that the model could run on
+    std::string backend;
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+            backend += (backend.empty() ? "" : ",") + std::string(ggml_backend_dev_name(dev));
+        }
+    }
+    backend = backend.empty() ? "CPU" : backend + "+CPU";
 
     std::stringstream result;
     result << std::setprecision(2);
@@ -339,21 +846,264 @@ Java_android_llama_cpp_LLamaAndroid_free_1batch(JNIEnv *, jobject, jlong batch_p
     delete batch;
 }
 
+struct token_sampler {
+    llama_sampler * chain;             // runs on the candidates
+    llama_sampler * grammar = nullptr; // applied before the chain, so it sees every candidate
+    int32_t n_vocab;
+    int32_t n_select;                  // candidates taken from the logits, n_vocab for all of them
+    std::vector<llama_token_data> cur;
+};
+
+// The k largest logits, in no particular order. Candidates above thr are buffered up to 2k;
+// a full buffer is cut to its best k, which raises thr, so after the first few thousand
+// logits most blocks of 16 are skipped with one vector compare.
+static void logits_top_k(const float * logits, int32_t n_vocab, int32_t k, std::vector<llama_token_data> & out) {
+    out.clear();
+    out.reserve(2 * (size_t) k);
+    float thr = -INFINITY;
+    auto cut = [&]() {
+        std::nth_element(out.begin(), out.begin() + (k - 1), out.end(),
+                         [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; });
+        out.resize(k);
+        thr = out[k - 1].logit;
+    };
+    auto add = [&](int32_t i) {
+        out.push_back({i, logits[i], 0.0f});
+        if (out.size() == 2 * (size_t) k) {
+            cut();
+        }
+    };
+
+    int32_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= n_vocab; i += 16) {
+        const float32x4_t m = vmaxq_f32(vmaxq_f32(vld1q_f32(logits + i),     vld1q_f32(logits + i + 4)),
+                                        vmaxq_f32(vld1q_f32(logits + i + 8), vld1q_f32(logits + i + 12)));
+        if (vmaxvq_f32(m) <= thr) {
+            continue;
+        }
+        for (int32_t j = i; j < i + 16; j++) {
+            if (logits[j] > thr) {
+                add(j);
+            }
+        }
+    }
+#endif
+    for (; i < n_vocab; i++) {
+        if (logits[i] > thr) {
+            add(i);
+        }
+    }
+    if (out.size() > (size_t) k) {
+        cut();
+    }
+}
+
+static void logits_all(const float * logits, int32_t n_vocab, std::vector<llama_token_data> & out) {
+    out.resize(n_vocab);
+    for (int32_t i = 0; i < n_vocab; i++) {
+        out[i] = {i, logits[i], 0.0f};
+    }
+}
+
+sampler_params sampler_params_from_java(JNIEnv *env, jobject params) {
+    sampler_params sp;
+    sp.temperature     = params_get_float(env, params, "temperature");
+    sp.top_k           = params_get_int(env, params, "topK");
+    sp.top_p           = params_get_float(env, params, "topP");
+    sp.min_p           = params_get_float(env, params, "minP");
+    sp.repeat_penalty  = params_get_float(env, params, "repeatPenalty");
+    sp.repeat_last_n   = params_get_int(env, params, "repeatLastN");
+    sp.grammar         = params_get_string(env, params, "grammar");
+    sp.seed            = (uint32_t) params_get_int(env, params, "seed");
+    return sp;
+}
+
+token_sampler * token_sampler_init(const llama_model * model, const sampler_params & sp) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    llama_sampler * grammar = nullptr;
+    if (!sp.grammar.empty()) {
+        grammar = llama_sampler_init_grammar(vocab, sp.grammar.c_str(), "root");
+        if (!grammar) {
+            LOGe("token_sampler_init: failed to parse the grammar");
+            return nullptr;
+        }
+    }
+
+    auto chain_params = llama_sampler_chain_default_params();
+    chain_params.no_perf = true;
+    llama_sampler * chain = llama_sampler_chain_init(chain_params);
+
+    // a penalty above 1 only lowers logits, so the top k after it are among the top k + last_n
+    // before; one below 1 raises them and needs the full vocabulary
+    const bool penalties = sp.repeat_penalty != 1.0f && sp.repeat_last_n > 0;
+    int32_t k;
+    if (penalties) {
+        llama_sampler_chain_add(chain, llama_sampler_init_penalties(sp.repeat_last_n, sp.repeat_penalty, 0.0f, 0.0f));
+    }
+    if (sp.temperature <= 0.0f) {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+        k = 1;
+    } else {
+        k = sp.top_k > 0 ? sp.top_k : llama_vocab_n_tokens(vocab);
+        if (sp.top_k > 0) {
+            llama_sampler_chain_add(chain, llama_sampler_init_top_k(k));
+        }
+        if (sp.top_p < 1.0f) {
+            llama_sampler_chain_add(chain, llama_sampler_init_top_p(sp.top_p, 1));
+        }
+        if (sp.min_p > 0.0f) {
+            llama_sampler_chain_add(chain, llama_sampler_init_min_p(sp.min_p, 1));
+        }
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(sp.temperature));
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(sp.seed));
+    }
+
+    auto * smpl = new token_sampler();
+    smpl->chain = chain;
+    smpl->grammar = grammar;
+    smpl->n_vocab = llama_vocab_n_tokens(vocab);
+    smpl->n_select = penalties && sp.repeat_penalty < 1.0f
+            ? smpl->n_vocab
+            : std::min(smpl->n_vocab, k + (penalties ? sp.repeat_last_n : 0));
+    return smpl;
+}
+
+void token_sampler_free(token_sampler * smpl) {
+    if (!smpl) {
+        return;
+    }
+    llama_sampler_free(smpl->chain);
+    if (smpl->grammar) {
+        llama_sampler_free(smpl->grammar);
+    }
+    delete smpl;
+}
+
+void token_sampler_reset(token_sampler * smpl) {
+    llama_sampler_reset(smpl->chain);
+    if (smpl->grammar) {
+        llama_sampler_reset(smpl->grammar);
+    }
+}
+
+static llama_token token_sampler_sample_logits(token_sampler * smpl, const float * logits) {
+    if (smpl->n_select < smpl->n_vocab) {
+        logits_top_k(logits, smpl->n_vocab, smpl->n_select, smpl->cur);
+    } else {
+        logits_all(logits, smpl->n_vocab, smpl->cur);
+    }
+    llama_token_data_array cur_p = { smpl->cur.data(), smpl->cur.size(), -1, false };
+
+    if (smpl->grammar) {
+        llama_sampler_apply(smpl->grammar, &cur_p);
+        const bool any = std::any_of(cur_p.data, cur_p.data + cur_p.size,
+                                     [](const llama_token_data & td) { return td.logit != -INFINITY; });
+        if (!any && smpl->n_select < smpl->n_vocab) {
+            // none of the candidates fits the grammar, look at the whole vocabulary
+            logits_all(logits, smpl->n_vocab, smpl->cur);
+            cur_p = { smpl->cur.data(), smpl->cur.size(), -1, false };
+            llama_sampler_apply(smpl->grammar, &cur_p);
+        }
+    }
+
+    llama_sampler_apply(smpl->chain, &cur_p);
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int64_t) cur_p.size);
+    const llama_token token = cur_p.data[cur_p.selected].id;
+
+    if (smpl->grammar) {
+        llama_sampler_accept(smpl->grammar, token);
+    }
+    llama_sampler_accept(smpl->chain, token);
+    return token;
+}
+
+llama_token token_sampler_sample(token_sampler * smpl, llama_context * ctx, int32_t idx) {
+    return token_sampler_sample_logits(smpl, llama_get_logits_ith(ctx, idx));
+}
+
 extern "C"
 JNIEXPORT jlong JNICALL
-Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *, jobject) {
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = true;
-    llama_sampler * smpl = llama_sampler_chain_init(sparams);
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+Java_android_llama_cpp_LLamaAndroid_new_1sampler(JNIEnv *env, jobject, jlong model_pointer, jobject params) {
+    const auto model = reinterpret_cast<llama_model *>(model_pointer);
+    if (!model) {
+        LOGe("new_sampler: Invalid model");
+        return 0;
+    }
+    const sampler_params sp = sampler_params_from_java(env, params);
+    LOGi("new_sampler: temperature = %.2f, top_k = %d, top_p = %.2f, min_p = %.2f, repeat_penalty = %.2f, grammar = %s",
+         sp.temperature, sp.top_k, sp.top_p, sp.min_p, sp.repeat_penalty, sp.grammar.empty() ? "no" : "yes");
+    return reinterpret_cast<jlong>(token_sampler_init(model, sp));
+}
+
+// Test hook for the candidate pass: samples n_steps random logit vectors with two samplers
+// built from params, one taking the top candidates and one the whole vocabulary. Returns the
+// first step at which they picked different tokens, n_steps if none did, -1 on error
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_sampler_1check(JNIEnv *env, jobject, jlong model_pointer, jobject params, jint n_steps) {
+    const auto model = reinterpret_cast<llama_model *>(model_pointer);
+    if (!model) {
+        LOGe("sampler_check: Invalid model");
+        return -1;
+    }
+    sampler_params sp = sampler_params_from_java(env, params);
+    if (sp.seed == LLAMA_DEFAULT_SEED) {
+        // both samplers have to make the same random draws
+        sp.seed = 1234;
+    }
+    token_sampler * fast = token_sampler_init(model, sp);
+    token_sampler * full = token_sampler_init(model, sp);
+    if (!fast || !full) {
+        token_sampler_free(fast);
+        token_sampler_free(full);
+        return -1;
+    }
+    full->n_select = full->n_vocab;
+
+    // A few tokens well above the noise, so answers repeat and the penalties change the pick
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = fast->n_vocab;
+    std::mt19937 rng(sp.seed);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::uniform_int_distribution<int32_t> any_token(0, n_vocab - 1);
+    std::vector<llama_token> hot(32);
+    for (auto & id : hot) {
+        id = any_token(rng);
+    }
+    std::vector<float> logits(n_vocab);
 
-    return reinterpret_cast<jlong>(smpl);
+    jint step = 0;
+    for (; step < n_steps; step++) {
+        for (auto & logit : logits) {
+            logit = noise(rng);
+        }
+        for (const llama_token id : hot) {
+            logits[id] += 4.0f;
+        }
+        const llama_token a = token_sampler_sample_logits(fast, logits.data());
+        const llama_token b = token_sampler_sample_logits(full, logits.data());
+        if (a != b) {
+            LOGe("sampler_check: step %d picked %d from the candidates, %d from the vocabulary", step, a, b);
+            break;
+        }
+        if (llama_vocab_is_eog(vocab, a)) {
+            // a grammar accepts nothing after the end of generation
+            step = n_steps;
+            break;
+        }
+    }
+
+    token_sampler_free(fast);
+    token_sampler_free(full);
+    return step;
 }
 
 extern "C"
 JNIEXPORT void JNICALL
 Java_android_llama_cpp_LLamaAndroid_free_1sampler(JNIEnv *, jobject, jlong sampler_pointer) {
-    llama_sampler_free(reinterpret_cast<llama_sampler *>(sampler_pointer));
+    token_sampler_free(reinterpret_cast<token_sampler *>(sampler_pointer));
 }
 
 extern "C"
@@ -380,11 +1130,10 @@ Java_android_llama_cpp_LLamaAndroid_completion_1init(
         jint n_len
     ) {
 
-    cached_token_chars.clear();
-
     const auto text = env->GetStringUTFChars(jtext, 0);
     const auto context = reinterpret_cast<llama_context *>(context_pointer);
     const auto batch = reinterpret_cast<llama_batch *>(batch_pointer);
+    text_threads_apply_thermal_scale(context);
 
     bool parse_special = (format_chat == JNI_TRUE);
     const auto tokens_list = common_tokenize(context, text, true, parse_special);
@@ -421,55 +1170,671 @@ Java_android_llama_cpp_LLamaAndroid_completion_1init(
     return batch->n_tokens;
 }
 
+bool stop_matcher_init(JNIEnv *env, stop_matcher & matcher, jobjectArray strings, jstring regex, jboolean json_object) {
+    const int n_strings = strings ? env->GetArrayLength(strings) : 0;
+    for (int i = 0; i < n_strings; i++) {
+        auto jstr = (jstring) env->GetObjectArrayElement(strings, i);
+        const char *str = env->GetStringUTFChars(jstr, nullptr);
+        if (*str) {
+            matcher.strings.emplace_back(str);
+        }
+        env->ReleaseStringUTFChars(jstr, str);
+        env->DeleteLocalRef(jstr);
+    }
+
+    if (regex) {
+        const char *pattern = env->GetStringUTFChars(regex, nullptr);
+        std::string error;
+        try {
+            matcher.regex = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize);
+            matcher.use_regex = true;
+        } catch (const std::regex_error & e) {
+            error = std::string("Invalid stop regex: ") + e.what();
+        }
+        env->ReleaseStringUTFChars(regex, pattern);
+        if (!error.empty()) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), error.c_str());
+            return false;
+        }
+    }
+
+    matcher.json_object = json_object;
+    return true;
+}
+
+bool stop_matcher::feed(const std::string & piece, std::string & out) {
+    const size_t n_old = text.size();
+    text += piece;
+
+    // earliest position to cut the text at
+    size_t cut = std::string::npos;
+
+    for (const auto & str : strings) {
+        // only matches that end in the new piece are new
+        const size_t from = n_old >= str.size() - 1 ? n_old - (str.size() - 1) : 0;
+        const size_t pos = text.find(str, from);
+        if (pos != std::string::npos) {
+            cut = std::min(cut, pos);
+        }
+    }
+
+    if (json_object) {
+        for (; json_pos < text.size(); json_pos++) {
+            const char c = text[json_pos];
+            if (json_in_string) {
+                if (json_escape) {
+                    json_escape = false;
+                } else if (c == '\\') {
+                    json_escape = true;
+                } else if (c == '"') {
+                    json_in_string = false;
+                }
+            } else if (json_depth == 0) {
+                // anything before the object starts is passed through
+                if (c == '{') {
+                    json_depth = 1;
+                }
+            } else if (c == '"') {
+                json_in_string = true;
+            } else if (c == '{' || c == '[') {
+                json_depth++;
+            } else if ((c == '}' || c == ']') && --json_depth == 0) {
+                cut = std::min(cut, json_pos + 1);
+                break;
+            }
+        }
+    }
+
+    if (use_regex) {
+        std::smatch match;
+        if (std::regex_search(text, match, regex) && match.length(0) > 0) {
+            cut = std::min(cut, (size_t) (match.position(0) + match.length(0)));
+        }
+    }
+
+    if (cut != std::string::npos) {
+        // never cut inside a UTF-8 sequence or before text already returned
+        while (cut < text.size() && cut > n_returned && (text[cut] & 0xC0) == 0x80) {
+            cut--;
+        }
+        cut = std::max(cut, n_returned);
+        out.append(text, n_returned, cut - n_returned);
+        n_returned = text.size();
+        return true;
+    }
+
+    // hold back the longest tail that is the start of a stop string
+    size_t n_hold = 0;
+    for (const auto & str : strings) {
+        for (size_t len = std::min(str.size() - 1, text.size()); len > n_hold; len--) {
+            if (text.compare(text.size() - len, len, str, 0, len) == 0) {
+                n_hold = len;
+                break;
+            }
+        }
+    }
+
+    const size_t n_safe = std::max(text.size() - n_hold, n_returned);
+    out.append(text, n_returned, n_safe - n_returned);
+    n_returned = n_safe;
+    return false;
+}
+
+void stop_matcher::flush(std::string & pending_utf8, std::string & out) {
+    if (!pending_utf8.empty()) {
+        const bool stopped = feed(utf8_replace_invalid(pending_utf8), out);
+        pending_utf8.clear();
+        if (stopped) {
+            return;
+        }
+    }
+    out.append(text, n_returned, std::string::npos);
+    n_returned = text.size();
+}
+
+void stop_matcher::reset() {
+    text.clear();
+    n_returned = 0;
+    json_pos = 0;
+    json_depth = 0;
+    json_in_string = false;
+    json_escape = false;
+}
+
+// Native generation state
+// The position and any incomplete UTF-8 bytes stay on the C++ side, so one generation_step
+// call can sample and decode many tokens without calling back into Kotlin.
+//
+// With n_draft > 0 the tokens following the latest earlier occurrence of the last n_ngram
+// tokens (prompt lookup) are decoded together with the sampled token and kept for as long
+// as the sampler agrees with them, so repeated phrases cost one decode for several tokens.
+// With the greedy sampler the output is the same as without drafting.
+struct generation {
+    llama_context * ctx;
+    llama_batch   * batch;
+    token_sampler * sampler;
+    llama_pos n_cur;
+    llama_pos n_end;
+    std::string pending_utf8;
+    stop_matcher stop;
+    std::atomic<bool> cancelled{false};
+    bool finished = false;
+
+    // sampled token that is not in the KV cache yet, -1 before the first step
+    llama_token next = -1;
+
+    int32_t n_draft = 0;
+    int32_t n_ngram = 0;
+    std::vector<llama_token> history; // prompt lookup source: prompt and generated tokens
+    std::vector<llama_token> draft;
+
+    int64_t n_drafted = 0;
+    int64_t n_accepted = 0;
+};
+
+// Draft tokens continuing the tokens at the end of history, from an earlier occurrence
+static void generation_draft(generation * gen, int32_t n_max) {
+    gen->draft.clear();
+    const auto & hist = gen->history;
+    const int n_hist = (int) hist.size();
+    for (int n = std::min(gen->n_ngram, n_hist - 1); n > 0 && gen->draft.empty(); n--) {
+        const llama_token * tail = hist.data() + n_hist - n;
+        // latest match first, it is usually the best continuation
+        for (int i = n_hist - n - 1; i >= 0; i--) {
+            if (std::equal(tail, tail + n, hist.data() + i)) {
+                const int from = i + n;
+                const int to = std::min(n_hist, from + n_max);
+                gen->draft.assign(hist.begin() + from, hist.begin() + to);
+                break;
+            }
+        }
+    }
+}
+
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_android_llama_cpp_LLamaAndroid_completion_1loop(
-        JNIEnv * env,
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_generation_1init(
+        JNIEnv *env,
         jobject,
         jlong context_pointer,
         jlong batch_pointer,
         jlong sampler_pointer,
+        jint n_past,
         jint n_len,
-        jobject intvar_ncur
+        jobjectArray stop_strings,
+        jstring stop_regex,
+        jboolean stop_json_object,
+        jint n_draft,
+        jint n_ngram,
+        jstring prompt
 ) {
-    const auto context = reinterpret_cast<llama_context *>(context_pointer);
-    const auto batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
-    const auto sampler = reinterpret_cast<llama_sampler *>(sampler_pointer);
-    const auto model = llama_get_model(context);
-    const auto vocab = llama_model_get_vocab(model);
+    auto *gen = new generation();
+    if (!stop_matcher_init(env, gen->stop, stop_strings, stop_regex, stop_json_object)) {
+        delete gen;
+        return 0;
+    }
+    gen->ctx     = reinterpret_cast<llama_context *>(context_pointer);
+    gen->batch   = reinterpret_cast<llama_batch   *>(batch_pointer);
+    gen->sampler = reinterpret_cast<token_sampler *>(sampler_pointer);
+    gen->n_cur   = n_past;
+    gen->n_end   = n_past + n_len;
+
+    // no penalty history or grammar state from the previous answer
+    token_sampler_reset(gen->sampler);
+
+    // the Kotlin side batch holds 128 tokens
+    gen->n_draft = std::max(0, std::min(n_draft, 32));
+    gen->n_ngram = std::max(1, (int) n_ngram);
+    if (gen->n_draft > 0 && prompt) {
+        const char *text = env->GetStringUTFChars(prompt, nullptr);
+        gen->history = common_tokenize(gen->ctx, text, false, true);
+        env->ReleaseStringUTFChars(prompt, text);
+    }
+    return reinterpret_cast<jlong>(gen);
+}
+
+// Handle a sampled token: returns false once generation has to stop before decoding it
+static bool generation_accept(generation * gen, const llama_vocab * vocab, llama_token token, std::string & text) {
+    if (gen->n_cur >= gen->n_end || llama_vocab_is_eog(vocab, token)) {
+        return false;
+    }
 
-    if (!la_int_var) la_int_var = env->GetObjectClass(intvar_ncur);
-    if (!la_int_var_value) la_int_var_value = env->GetMethodID(la_int_var, "getValue", "()I");
-    if (!la_int_var_inc) la_int_var_inc = env->GetMethodID(la_int_var, "inc", "()V");
+    gen->pending_utf8 += common_token_to_piece(gen->ctx, token);
+    if (is_valid_utf8(gen->pending_utf8.c_str())) {
+        const bool stopped = gen->stop.feed(gen->pending_utf8, text);
+        gen->pending_utf8.clear();
+        if (stopped) {
+            // the stopping token is never decoded
+            return false;
+        }
+    }
 
-    // sample the most likely token
-    const auto new_token_id = llama_sampler_sample(sampler, context, -1);
+    if (gen->n_draft > 0) {
+        gen->history.push_back(token);
+    }
+    MTMD_TRACE_ADD(MTMD_TRACE_GENERATED_TOKENS, 1);
+    return true;
+}
 
-    const auto n_cur = env->CallIntMethod(intvar_ncur, la_int_var_value);
-    if (llama_vocab_is_eog(vocab, new_token_id) || n_cur == n_len) {
+// Generate up to n_max tokens, returning early once max_millis have passed (0 = no limit).
+// Returns the text produced (possibly empty while a UTF-8 sequence is incomplete),
+// or null once generation has finished and all text has been returned.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_generation_1step(
+        JNIEnv * env,
+        jobject,
+        jlong generation_pointer,
+        jint n_max,
+        jint max_millis
+) {
+    auto *gen = reinterpret_cast<generation *>(generation_pointer);
+    if (gen->finished) {
         return nullptr;
     }
+    MTMD_TRACE_SCOPE("generation_step");
+    text_threads_apply_thermal_scale(gen->ctx);
 
-    auto new_token_chars = common_token_to_piece(context, new_token_id);
-    cached_token_chars += new_token_chars;
+    const auto vocab = llama_model_get_vocab(llama_get_model(gen->ctx));
+    const auto t_start = std::chrono::steady_clock::now();
+    llama_memory_t mem = llama_get_memory(gen->ctx);
 
-    jstring new_token = nullptr;
-    if (is_valid_utf8(cached_token_chars.c_str())) {
-        new_token = env->NewStringUTF(cached_token_chars.c_str());
-        LOGi("cached: %s, new_token_chars: `%s`, id: %d", cached_token_chars.c_str(), new_token_chars.c_str(), new_token_id);
-        cached_token_chars.clear();
-    } else {
-        new_token = env->NewStringUTF("");
+    if (gen->next < 0) {
+        gen->next = token_sampler_sample(gen->sampler, gen->ctx, -1);
     }
 
-    common_batch_clear(*batch);
-    common_batch_add(*batch, new_token_id, n_cur, { 0 }, true);
+    std::string text;
+    int n_generated = 0;
+    while (n_generated < n_max) {
+        if (gen->cancelled.load(std::memory_order_relaxed) || !generation_accept(gen, vocab, gen->next, text)) {
+            gen->finished = true;
+            break;
+        }
+        n_generated++;
 
-    env->CallVoidMethod(intvar_ncur, la_int_var_inc);
+        // draft tokens must fit before n_end, after the sampled token
+        const int32_t n_draft_max = std::min(gen->n_draft, gen->n_end - gen->n_cur - 1);
+        gen->draft.clear();
+        if (n_draft_max > 0) {
+            generation_draft(gen, n_draft_max);
+        }
 
-    if (llama_decode(context, *batch) != 0) {
-        LOGe("llama_decode() returned null");
+        common_batch_clear(*gen->batch);
+        common_batch_add(*gen->batch, gen->next, gen->n_cur, { 0 }, true);
+        for (size_t i = 0; i < gen->draft.size(); i++) {
+            common_batch_add(*gen->batch, gen->draft[i], gen->n_cur + 1 + (llama_pos) i, { 0 }, true);
+        }
+        gen->n_cur++;
+
+        int32_t ret;
+        {
+            MTMD_TRACE_SCOPE("generation_decode");
+            ret = llama_decode(gen->ctx, *gen->batch);
+        }
+        if (ret != 0) {
+            LOGe("generation_step: llama_decode() failed at n_cur = %d", gen->n_cur);
+            gen->finished = true;
+            break;
+        }
+
+        // keep draft tokens for as long as the sampler agrees with them
+        int32_t i_out = 0;
+        gen->next = token_sampler_sample(gen->sampler, gen->ctx, i_out);
+        for (const llama_token token : gen->draft) {
+            if (gen->next != token) {
+                break;
+            }
+            if (!generation_accept(gen, vocab, token, text)) {
+                gen->finished = true;
+                break;
+            }
+            n_generated++;
+            gen->n_cur++;
+            gen->next = token_sampler_sample(gen->sampler, gen->ctx, ++i_out);
+        }
+        if (!gen->draft.empty()) {
+            gen->n_drafted += (int64_t) gen->draft.size();
+            gen->n_accepted += i_out;
+            // drop the rejected draft tokens from the KV cache
+            llama_memory_seq_rm(mem, 0, gen->n_cur, -1);
+        }
+        if (gen->finished) {
+            break;
+        }
+
+        if (max_millis > 0 && std::chrono::steady_clock::now() - t_start >= std::chrono::milliseconds(max_millis)) {
+            break;
+        }
+    }
+
+    if (gen->finished) {
+        gen->stop.flush(gen->pending_utf8, text);
+        if (gen->n_drafted > 0) {
+            LOGi("generation: %lld of %lld draft tokens accepted",
+                 (long long) gen->n_accepted, (long long) gen->n_drafted);
+        }
+    }
+    if (gen->finished && text.empty()) {
+        return nullptr;
+    }
+    return env->NewStringUTF(text.c_str());
+}
+
+// May be called from any thread while generation_step is running
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_generation_1cancel(JNIEnv *, jobject, jlong generation_pointer) {
+    reinterpret_cast<generation *>(generation_pointer)->cancelled.store(true, std::memory_order_relaxed);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_generation_1free(JNIEnv *, jobject, jlong generation_pointer) {
+    delete reinterpret_cast<generation *>(generation_pointer);
+}
+
+// Concurrent text requests
+// Each request runs on its own sequence with its own sampler. pool_step decodes the next
+// token of every running request, plus prompt tokens of new ones, in one shared batch, so
+// requests advance together instead of one after another.
+struct pool_slot {
+    llama_seq_id seq = -1; // -1 while the slot is free
+    token_sampler * sampler = nullptr;
+    std::vector<llama_token> prompt;
+    size_t n_prompt_done = 0;
+    llama_pos n_cur = 0;
+    llama_pos n_end = 0;
+    llama_token next = -1; // sampled, not decoded yet
+    int32_t i_batch = -1;  // output row in the current batch
+    stop_matcher stop;
+    std::string pending_utf8;
+    std::string text;      // generated, not returned yet
+    bool finished = false;
+};
+
+struct seq_pool {
+    llama_context * ctx;
+    llama_batch batch;
+    int32_t n_batch;
+    std::vector<pool_slot> slots;
+
+    seq_pool(llama_context * ctx, int32_t n_batch, size_t n_slots)
+        : ctx(ctx), batch(llama_batch_init(n_batch, 0, 1)), n_batch(n_batch), slots(n_slots) {}
+};
+
+static void pool_slot_clear(seq_pool * pool, pool_slot & slot) {
+    if (slot.seq >= 0) {
+        seq_release(pool->ctx, slot.seq);
+    }
+    token_sampler_free(slot.sampler);
+    slot.seq = -1;
+    slot.sampler = nullptr;
+    slot.prompt.clear();
+    slot.n_prompt_done = 0;
+    slot.next = -1;
+    slot.i_batch = -1;
+    slot.stop = stop_matcher();
+    slot.pending_utf8.clear();
+    slot.text.clear();
+    slot.finished = false;
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_android_llama_cpp_LLamaAndroid_pool_1init(JNIEnv *, jobject, jlong context_pointer, jint n_batch) {
+    auto *ctx = reinterpret_cast<llama_context *>(context_pointer);
+    // seq 0 stays with the single-request paths
+    const size_t n_slots = std::max(1u, llama_n_seq_max(ctx)) - 1;
+    return reinterpret_cast<jlong>(new seq_pool(ctx, n_batch, n_slots));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_pool_1free(JNIEnv *, jobject, jlong pool_pointer) {
+    auto *pool = reinterpret_cast<seq_pool *>(pool_pointer);
+    for (auto & slot : pool->slots) {
+        pool_slot_clear(pool, slot);
+    }
+    llama_batch_free(pool->batch);
+    delete pool;
+}
+
+// Queue a text request; returns its slot, -1 when all sequences are busy or the stop regex is
+// invalid (stop_matcher_init() leaves IllegalArgumentException pending, which the JVM throws on
+// return), or -2 for a grammar that does not parse
+extern "C"
+JNIEXPORT jint JNICALL
+Java_android_llama_cpp_LLamaAndroid_pool_1add(
+        JNIEnv *env,
+        jobject,
+        jlong pool_pointer,
+        jstring jtext,
+        jboolean format_chat,
+        jint n_len,
+        jobjectArray stop_strings,
+        jstring stop_regex,
+        jboolean stop_json_object,
+        jobject sampler_params_java) {
+
+    auto *pool = reinterpret_cast<seq_pool *>(pool_pointer);
+
+    int32_t i_slot = -1;
+    for (size_t i = 0; i < pool->slots.size(); i++) {
+        if (pool->slots[i].seq < 0) {
+            i_slot = (int32_t) i;
+            break;
+        }
+    }
+    if (i_slot < 0) {
+        return -1;
+    }
+
+    auto & slot = pool->slots[i_slot];
+    if (!stop_matcher_init(env, slot.stop, stop_strings, stop_regex, stop_json_object)) {
+        slot.stop = stop_matcher();
+        return -1;
+    }
+    slot.seq = seq_acquire(pool->ctx);
+    if (slot.seq < 0) {
+        pool_slot_clear(pool, slot);
+        return -1;
+    }
+
+    const char *text = env->GetStringUTFChars(jtext, nullptr);
+    slot.prompt = common_tokenize(pool->ctx, text, true, format_chat == JNI_TRUE);
+    env->ReleaseStringUTFChars(jtext, text);
+
+    slot.sampler = token_sampler_init(llama_get_model(pool->ctx), sampler_params_from_java(env, sampler_params_java));
+    if (!slot.sampler) {
+        pool_slot_clear(pool, slot);
+        return -2;
+    }
+
+    slot.n_cur = 0;
+    slot.n_end = (llama_pos) slot.prompt.size() + n_len;
+    slot.finished = slot.prompt.empty();
+    return i_slot;
+}
+
+// Handle a token sampled for a slot: returns false once the slot has to stop
+static bool pool_slot_accept(seq_pool * pool, pool_slot & slot, const llama_vocab * vocab, llama_token token) {
+    if (slot.n_cur >= slot.n_end || llama_vocab_is_eog(vocab, token)) {
+        return false;
     }
+    MTMD_TRACE_ADD(MTMD_TRACE_GENERATED_TOKENS, 1);
+    slot.pending_utf8 += common_token_to_piece(pool->ctx, token);
+    if (is_valid_utf8(slot.pending_utf8.c_str())) {
+        const bool stopped = slot.stop.feed(slot.pending_utf8, slot.text);
+        slot.pending_utf8.clear();
+        return !stopped;
+    }
+    return true;
+}
 
-    return new_token;
+// One shared decode for all running slots; returns false if there was nothing to decode
+static bool pool_decode(seq_pool * pool) {
+    MTMD_TRACE_SCOPE("pool_decode");
+    const auto vocab = llama_model_get_vocab(llama_get_model(pool->ctx));
+    common_batch_clear(pool->batch);
+
+    // tokens of generating slots first, prompts use the rest of the batch
+    for (auto & slot : pool->slots) {
+        if (slot.seq >= 0 && !slot.finished && slot.next >= 0) {
+            slot.i_batch = pool->batch.n_tokens;
+            common_batch_add(pool->batch, slot.next, slot.n_cur++, { slot.seq }, true);
+            slot.next = -1;
+        }
+    }
+    for (auto & slot : pool->slots) {
+        if (slot.seq < 0 || slot.finished || slot.n_prompt_done == slot.prompt.size()) {
+            continue;
+        }
+        while (slot.n_prompt_done < slot.prompt.size() && pool->batch.n_tokens < pool->n_batch) {
+            const bool last = slot.n_prompt_done + 1 == slot.prompt.size();
+            if (last) {
+                slot.i_batch = pool->batch.n_tokens;
+            }
+            common_batch_add(pool->batch, slot.prompt[slot.n_prompt_done++], slot.n_cur++, { slot.seq }, last);
+        }
+    }
+
+    if (pool->batch.n_tokens == 0) {
+        return false;
+    }
+
+    if (llama_decode(pool->ctx, pool->batch) != 0) {
+        LOGe("pool_step: llama_decode() failed");
+        for (auto & slot : pool->slots) {
+            slot.i_batch = -1;
+            if (slot.seq >= 0) {
+                slot.finished = true;
+            }
+        }
+        return true;
+    }
+
+    for (auto & slot : pool->slots) {
+        if (slot.i_batch < 0) {
+            continue;
+        }
+        const llama_token token = token_sampler_sample(slot.sampler, pool->ctx, slot.i_batch);
+        slot.i_batch = -1;
+        if (pool_slot_accept(pool, slot, vocab, token)) {
+            slot.next = token;
+        } else {
+            slot.finished = true;
+        }
+    }
+    return true;
+}
+
+// Decode until the slot has text to return or max_millis have passed, advancing every other
+// running slot along the way. Returns the slot's new text, or null once it has finished and
+// all text has been returned.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_pool_1step(
+        JNIEnv *env,
+        jobject,
+        jlong pool_pointer,
+        jint i_slot,
+        jint max_millis) {
+
+    auto *pool = reinterpret_cast<seq_pool *>(pool_pointer);
+    auto & slot = pool->slots[i_slot];
+    const auto t_start = std::chrono::steady_clock::now();
+    text_threads_apply_thermal_scale(pool->ctx);
+
+    while (!slot.finished && slot.text.empty()) {
+        if (!pool_decode(pool)) {
+            break;
+        }
+        if (max_millis > 0 && std::chrono::steady_clock::now() - t_start >= std::chrono::milliseconds(max_millis)) {
+            break;
+        }
+    }
+
+    if (slot.finished) {
+        slot.stop.flush(slot.pending_utf8, slot.text);
+        if (slot.text.empty()) {
+            return nullptr;
+        }
+    }
+    jstring result = env->NewStringUTF(slot.text.c_str());
+    slot.text.clear();
+    return result;
+}
+
+// Free the slot and its sequence, finished or not
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_pool_1release(JNIEnv *, jobject, jlong pool_pointer, jint i_slot) {
+    auto *pool = reinterpret_cast<seq_pool *>(pool_pointer);
+    pool_slot_clear(pool, pool->slots[i_slot]);
+}
+
+// Counters of mtmd-trace.h in enum order, read in one call; null when built without
+// LLAMA_ANDROID_TRACE
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_android_llama_cpp_LLamaAndroid_trace_1counters(JNIEnv *env, jobject) {
+#ifdef MTMD_TRACE
+    jlong values[MTMD_TRACE_N_COUNTERS];
+    for (int i = 0; i < MTMD_TRACE_N_COUNTERS; i++) {
+        values[i] = (jlong) g_mtmd_trace_counters[i].load(std::memory_order_relaxed);
+    }
+    jlongArray result = env->NewLongArray(MTMD_TRACE_N_COUNTERS);
+    env->SetLongArrayRegion(result, 0, MTMD_TRACE_N_COUNTERS, values);
+    return result;
+#else
+    (void) env;
+    return nullptr;
+#endif
+}
+
+// Time per ggml op as a JSON array of {"op", "count", "us"}, slowest first; null when built
+// without LLAMA_ANDROID_TRACE. Empty unless the context was created with traceOps.
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_android_llama_cpp_LLamaAndroid_trace_1op_1stats(JNIEnv *env, jobject) {
+#ifdef MTMD_TRACE
+    std::vector<std::pair<int64_t, int>> ops;
+    for (int op = 0; op < GGML_OP_COUNT; op++) {
+        const int64_t us = g_trace_op_us[op].load(std::memory_order_relaxed);
+        if (g_trace_op_count[op].load(std::memory_order_relaxed) > 0) {
+            ops.emplace_back(us, op);
+        }
+    }
+    std::sort(ops.begin(), ops.end(), std::greater<>());
+
+    std::stringstream json;
+    json << "[";
+    for (size_t i = 0; i < ops.size(); i++) {
+        const int op = ops[i].second;
+        json << (i > 0 ? "," : "")
+             << "{\"op\":\"" << json_escape(ggml_op_name((ggml_op) op)) << "\""
+             << ",\"count\":" << g_trace_op_count[op].load(std::memory_order_relaxed)
+             << ",\"us\":" << ops[i].first << "}";
+    }
+    json << "]";
+    return env->NewStringUTF(json.str().c_str());
+#else
+    (void) env;
+    return nullptr;
+#endif
+}
+
+// Zero the counters and op times, e.g. before a measured run
+extern "C"
+JNIEXPORT void JNICALL
+Java_android_llama_cpp_LLamaAndroid_trace_1reset(JNIEnv *, jobject) {
+#ifdef MTMD_TRACE
+    for (auto & counter : g_mtmd_trace_counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (int op = 0; op < GGML_OP_COUNT; op++) {
+        g_trace_op_us[op].store(0, std::memory_order_relaxed);
+        g_trace_op_count[op].store(0, std::memory_order_relaxed);
+    }
+#endif
 }
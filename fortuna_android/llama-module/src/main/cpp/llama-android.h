@@ -0,0 +1,127 @@
+#pragma once
+
+// Helpers shared by llama-android.cpp and llama-android-vlm.cpp
+
+#include <jni.h>
+#include <regex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "llama.h"
+#include "ggml-cpu.h"
+
+bool is_valid_utf8(const char * string);
+// str with every invalid or incomplete UTF-8 sequence replaced by U+FFFD
+std::string utf8_replace_invalid(const std::string & str);
+
+// Online cores from /sys/devices/system/cpu, fastest first by cpu_capacity, then by
+// cpuinfo_max_freq. The slowest cluster of a big.LITTLE part comes last and is not counted
+// in n_perf; on a uniform CPU every core is a performance core.
+struct cpu_topology {
+    std::vector<int> cores;
+    int n_perf = 0;
+};
+const cpu_topology & cpu_topology_get();
+
+// Threadpool of n_threads allowed on n_cores of cpu_topology_get().cores, starting at first
+ggml_threadpool * cpu_threadpool_new(int n_threads, int first, int n_cores);
+
+// Text context threadpool on the fastest cores. set replaces the pool when it is too small
+// and applies the thermal scale; free detaches it before the context goes.
+void text_threads_set(llama_context * ctx, int n_threads, int n_threads_batch);
+void text_threads_free(llama_context * ctx);
+// Cores taken by the text pool, 0 without one
+int  text_threads_n_cores();
+// 1 for full speed, lower to run fewer threads while the device is hot; may be set from any
+// thread, the text context picks it up at the next apply
+void  text_threads_set_thermal_scale(float scale);
+float text_threads_thermal_scale();
+// Sets the thread counts of ctx for the current thermal scale if it changed. Run loop only,
+// between decodes: llama_set_n_threads() is not synchronized with a running llama_decode()
+void  text_threads_apply_thermal_scale(llama_context * ctx);
+
+// Fields of android.llama.cpp.LlamaParams and SamplerParams
+jint params_get_int(JNIEnv *env, jobject params, const char *name);
+bool params_get_bool(JNIEnv *env, jobject params, const char *name);
+float params_get_float(JNIEnv *env, jobject params, const char *name);
+std::string params_get_string(JNIEnv *env, jobject params, const char *name);
+
+llama_model_params   model_params_from_java(JNIEnv *env, jobject params);
+llama_context_params context_params_from_java(JNIEnv *env, jobject params);
+
+// Token sampling, from android.llama.cpp.SamplerParams; the defaults are greedy decoding.
+// token_sampler_sample() first picks the largest logits (NEON on arm64): 1 for greedy, top_k
+// otherwise, plus repeat_last_n when penalties are on. The llama.cpp samplers then only run
+// on those candidates, so a token costs one pass over the logits whatever the chain.
+// A grammar that rejects every candidate is applied to the full vocabulary instead.
+struct sampler_params {
+    float    temperature    = 0.0f; // <= 0: greedy
+    int32_t  top_k          = 40;   // <= 0: the whole vocabulary
+    float    top_p          = 1.0f;
+    float    min_p          = 0.0f;
+    float    repeat_penalty = 1.0f; // 1: off
+    int32_t  repeat_last_n  = 64;
+    std::string grammar;            // GBNF, empty for none
+    uint32_t seed           = LLAMA_DEFAULT_SEED;
+};
+sampler_params sampler_params_from_java(JNIEnv *env, jobject params);
+
+struct token_sampler;
+// Returns null if the grammar does not parse
+token_sampler * token_sampler_init(const llama_model * model, const sampler_params & params);
+void            token_sampler_free(token_sampler * smpl);
+// Forgets the penalty history and grammar state, before a new answer
+void            token_sampler_reset(token_sampler * smpl);
+// Samples from the logits of output idx (-1 for the last) and accepts the token
+llama_token     token_sampler_sample(token_sampler * smpl, llama_context * ctx, int32_t idx);
+
+// Sequence ids 1..n_seq_max-1 for work that runs next to the single-request paths on seq 0.
+// Returns -1 when all are taken; release clears the sequence. Call from the run loop only.
+llama_seq_id seq_acquire(llama_context * ctx);
+void         seq_release(llama_context * ctx, llama_seq_id seq);
+// True while any of those sequences is acquired
+bool         seq_any_acquired(llama_context * ctx);
+
+// Ends a generation early on stop strings, a regex match or the end of a JSON object,
+// checked against the detokenized text. Text from a stop string on is dropped; a regex
+// match or the closing brace of the object is the last text returned.
+struct stop_matcher {
+    std::vector<std::string> strings;
+    std::regex regex;
+    bool use_regex = false;
+    bool json_object = false;
+
+    std::string text;       // text generated so far
+    size_t n_returned = 0;  // bytes of text handed out by feed/flush
+
+    // JSON scan state, up to json_pos
+    size_t json_pos = 0;
+    int json_depth = 0;
+    bool json_in_string = false;
+    bool json_escape = false;
+
+    // Append a piece of valid UTF-8 and add the text that can be returned so far to out;
+    // a tail that may still turn into a stop string is held back. Returns true on a stop.
+    bool feed(const std::string & piece, std::string & out);
+    // Add the held back text to out, for a generation that ended without a stop. pending_utf8,
+    // the bytes of a UTF-8 sequence cut short by the end of generation, is fed first, as U+FFFD
+    void flush(std::string & pending_utf8, std::string & out);
+    // Forget the generated text, keeping the conditions
+    void reset();
+};
+
+// Throws IllegalArgumentException and returns false for an invalid regex
+bool stop_matcher_init(JNIEnv *env, stop_matcher & matcher, jobjectArray strings, jstring regex, jboolean json_object);
+
+// Benchmark reporting, as JSON fragments
+std::string json_escape(const std::string & str);
+// Array of the ggml backend devices: name, description and type
+std::string bench_devices_json();
+// Object with n, mean, std, min, max, p50, p95 and p99 of samples
+std::string bench_stats_json(std::vector<double> samples);
+// Peak resident set size of the process (VmHWM), 0 if unknown
+long bench_peak_rss_kb();
+
+inline double bench_ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
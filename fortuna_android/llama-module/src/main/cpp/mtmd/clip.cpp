@@ -4,6 +4,7 @@
 // Note: Even when using identical normalized image inputs (see normalize_image_u8_to_f32()) we have a significant difference in resulting embeddings compared to pytorch
 #include "clip.h"
 #include "clip-impl.h"
+#include "mtmd-trace.h"
 #include "ggml.h"
 #include "ggml-cpp.h"
 #include "ggml-cpu.h"
@@ -12,6 +13,7 @@
 #include "gguf.h"
 
 #include <cassert>
+#include <cerrno>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
@@ -27,6 +29,25 @@
 #include <array>
 #include <numeric>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+            #define CLIP_USE_MMAP
+        #endif
+    #endif
+#endif
 
 struct clip_logger_state g_logger_state = {GGML_LOG_LEVEL_CONT, clip_log_callback_default, NULL};
 
@@ -370,6 +391,67 @@ struct clip_model {
     }
 };
 
+// precomputed source indices and weights of a separable resampling filter along one axis
+struct resize_taps {
+    int n_taps = 0;           // taps per output pixel (4 for bicubic, 2 for bilinear)
+    std::vector<int32_t> idx; // [n_dst * n_taps], clamped to the source size
+    std::vector<float>   w;   // [n_dst * n_taps]
+};
+
+enum resize_filter {
+    RESIZE_FILTER_BILINEAR,
+    RESIZE_FILTER_BICUBIC,
+};
+
+#ifdef CLIP_USE_MMAP
+// read-only mapping of a model file
+struct clip_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    clip_mmap(const std::string & fname) {
+        int fd = open(fname.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error(string_format("failed to open %s: %s", fname.c_str(), strerror(errno)));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error(string_format("failed to stat %s: %s", fname.c_str(), strerror(errno)));
+        }
+        size = (size_t) st.st_size;
+        addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd); // the mapping keeps the file referenced
+        if (addr == MAP_FAILED) {
+            addr = nullptr;
+            throw std::runtime_error(string_format("failed to mmap %s: %s", fname.c_str(), strerror(errno)));
+        }
+    }
+
+    ~clip_mmap() {
+        if (addr) {
+            munmap(addr, size);
+        }
+    }
+
+    void advise(int advice) const {
+        if (posix_madvise(addr, size, advice) != 0) {
+            LOG_WRN("%s: posix_madvise(%d) failed\n", __func__, advice);
+        }
+    }
+
+    const uint8_t * data() const {
+        return static_cast<const uint8_t *>(addr);
+    }
+};
+#endif
+
+// graph inputs that only depend on the patch grid, as flat buffers by input name
+struct clip_pos_inputs {
+    std::vector<std::pair<const char *, std::vector<int32_t>>> i32;
+    std::vector<std::pair<const char *, std::vector<float>>>   f32;
+};
+
 struct clip_ctx {
     clip_model model;
 
@@ -383,17 +465,43 @@ struct clip_ctx {
 
     ggml_backend_t backend = nullptr;
     ggml_backend_t backend_cpu = nullptr;
+#ifdef CLIP_USE_MMAP
+    std::unique_ptr<clip_mmap> weights_mmap; // backs buf when the weights are used in place, must outlive it
+#endif
     ggml_backend_buffer_ptr buf;
 
     int max_nodes = 8192;
     ggml_backend_sched_ptr sched;
 
+    // the graph of the last encoded input size stays allocated in sched,
+    // consecutive inputs of the same size (camera frames, slices) only set inputs and compute
+    struct {
+        ggml_context_ptr ctx;      // tensor metadata, lives in buf_compute_meta
+        ggml_cgraph * gf = nullptr;
+        int nx = 0;
+        int ny = 0;
+    } graph_cache;
+
+    void graph_cache_clear() {
+        graph_cache.gf = nullptr;
+        graph_cache.ctx.reset();
+    }
+
+    // positional inputs by (pos_w, pos_h), e.g. the qwen2.5vl window mask is (pos_w * pos_h)^2 floats
+    std::map<std::pair<int, int>, clip_pos_inputs> pos_inputs_cache;
+
     // for debugging
     bool debug_graph = false;
     std::vector<ggml_tensor *> debug_print_tensors;
 
+    // image preprocessing
+    int n_threads_preproc = 1;
+    std::mutex resize_taps_mutex; // preprocessing may run concurrently with encoding
+    std::map<std::tuple<resize_filter, int, int>, std::shared_ptr<const resize_taps>> resize_taps_cache; // (filter, src, dst)
+
     clip_ctx(clip_context_params & ctx_params) {
         debug_graph = std::getenv("MTMD_DEBUG_GRAPH") != nullptr;
+        n_threads_preproc = std::max(1, ctx_params.n_threads);
         backend_cpu = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
         if (!backend_cpu) {
             throw std::runtime_error("failed to initialize CPU backend");
@@ -424,6 +532,11 @@ struct clip_ctx {
         backend_ptrs.push_back(backend_cpu);
         backend_buft.push_back(ggml_backend_get_default_buffer_type(backend_cpu));
 
+        sched_init();
+    }
+
+    // a fresh scheduler owns no compute buffers, they are allocated again by the next graph
+    void sched_init() {
         sched.reset(
             ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), 8192, false, true)
         );
@@ -2081,9 +2194,9 @@ private:
 
 };
 
-static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32_batch & imgs) {
-    GGML_ASSERT(imgs.entries.size() == 1 && "n_batch > 1 is not supported");
-    clip_graph graph(ctx, *imgs.entries[0]);
+// if ctx_out is set, it takes ownership of the ggml_context holding the graph
+static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32 & img, ggml_context_ptr * ctx_out = nullptr) {
+    clip_graph graph(ctx, img);
 
     ggml_cgraph * res;
 
@@ -2130,6 +2243,9 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
                 res = graph.build_llava();
             } break;
     }
+    if (ctx_out) {
+        *ctx_out = std::move(graph.ctx0_ptr);
+    }
     return res;
 }
 
@@ -2771,6 +2887,11 @@ struct clip_model_loader {
         }
 
         // load data
+#ifdef CLIP_USE_MMAP
+        if (load_data_mmap(ctx_clip, tensors_to_load, tensor_offset)) {
+            return;
+        }
+#endif
         {
             std::vector<uint8_t> read_buf;
 
@@ -2807,6 +2928,64 @@ struct clip_model_loader {
         }
     }
 
+#ifdef CLIP_USE_MMAP
+    // CPU weights point straight into the mapping; other buffers are uploaded from it without
+    // a staging copy. Returns false if the file cannot be mapped, so the caller can fall back
+    // to reading it.
+    bool load_data_mmap(clip_ctx & ctx_clip,
+                        const std::vector<ggml_tensor *> & tensors_to_load,
+                        std::map<std::string, size_t> & tensor_offset) {
+        std::unique_ptr<clip_mmap> mapping;
+        try {
+            mapping.reset(new clip_mmap(fname));
+        } catch (const std::exception & e) {
+            LOG_WRN("%s: %s, falling back to read()\n", __func__, e.what());
+            return false;
+        }
+
+        for (auto & t : tensors_to_load) {
+            if (tensor_offset[t->name] + ggml_nbytes(t) > mapping->size) {
+                throw std::runtime_error(string_format("%s: tensor %s is out of file bounds\n", __func__, t->name));
+            }
+        }
+
+        ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(ctx_clip.backend);
+        const uintptr_t align = ggml_backend_buft_get_alignment(buft);
+        bool in_place = buft == ggml_backend_cpu_buffer_type();
+        for (auto & t : tensors_to_load) {
+            in_place = in_place && ((uintptr_t) (mapping->data() + tensor_offset[t->name]) % align == 0);
+        }
+
+        if (in_place) {
+            mapping->advise(POSIX_MADV_WILLNEED);
+            ctx_clip.buf.reset(ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size));
+            ggml_backend_buffer_set_usage(ctx_clip.buf.get(), GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            for (auto & t : tensors_to_load) {
+                ggml_tensor * cur = ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+                void * addr = const_cast<uint8_t *>(mapping->data()) + tensor_offset[t->name];
+                if (ggml_backend_tensor_alloc(ctx_clip.buf.get(), cur, addr) != GGML_STATUS_SUCCESS) {
+                    throw std::runtime_error(string_format("%s: failed to map tensor %s\n", __func__, t->name));
+                }
+            }
+            ctx_clip.weights_mmap = std::move(mapping);
+            LOG_DBG("%s: mapped %zu tensors from %s\n", __func__, tensors_to_load.size(), fname.c_str());
+            return true;
+        }
+
+        // tensors are uploaded in file order, so the kernel can read ahead
+        mapping->advise(POSIX_MADV_SEQUENTIAL);
+        ctx_clip.buf.reset(ggml_backend_alloc_ctx_tensors_from_buft(ctx_clip.ctx_data.get(), buft));
+        ggml_backend_buffer_set_usage(ctx_clip.buf.get(), GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        for (auto & t : tensors_to_load) {
+            ggml_tensor * cur = ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+            ggml_backend_tensor_set(cur, mapping->data() + tensor_offset[t->name], 0, ggml_nbytes(cur));
+        }
+        // the mapping is dropped here, releasing its pages
+        LOG_DBG("%s: uploaded %zu tensors from %s\n", __func__, tensors_to_load.size(), fname.c_str());
+        return true;
+    }
+#endif
+
     void alloc_compute_meta(clip_ctx & ctx_clip) {
         const auto & hparams = ctx_clip.model.hparams;
         ctx_clip.buf_compute_meta.resize(ctx_clip.max_nodes * ggml_tensor_overhead() + ggml_graph_overhead());
@@ -2823,7 +3002,8 @@ struct clip_model_loader {
         }
         batch.entries.push_back(std::move(img));
 
-        ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, batch);
+        ctx_clip.graph_cache_clear();
+        ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, *batch.entries[0]);
         ggml_backend_sched_reserve(ctx_clip.sched.get(), gf);
 
         for (size_t i = 0; i < ctx_clip.backend_ptrs.size(); ++i) {
@@ -3222,6 +3402,147 @@ struct image_manipulation {
         return {aligned_width, aligned_height};
     }
 
+    // build the taps used by bicubic_resize() / bilinear_resize() along one axis
+    static void init_resize_taps(resize_taps & taps, resize_filter filter, int n_src, int n_dst) {
+        taps.n_taps = filter == RESIZE_FILTER_BICUBIC ? 4 : 2;
+        taps.idx.resize((size_t)n_dst * taps.n_taps);
+        taps.w.resize((size_t)n_dst * taps.n_taps);
+
+        if (filter == RESIZE_FILTER_BICUBIC) {
+            const float t = (float)n_src / (float)n_dst;
+            for (int j = 0; j < n_dst; j++) {
+                const int   x  = (int)(t * j);
+                const float dx = t * j - x;
+                int32_t * idx = &taps.idx[j * 4];
+                float   * w   = &taps.w[j * 4];
+                for (int k = 0; k < 4; k++) {
+                    idx[k] = clip(x - 1 + k, 0, n_src - 1);
+                }
+                // same polynomial as bicubic_resize(), expanded per tap
+                w[0] = -dx / 3.0f + dx * dx / 2.0f - dx * dx * dx / 6.0f;
+                w[2] =  dx        + dx * dx / 2.0f - dx * dx * dx / 2.0f;
+                w[3] = -dx / 6.0f                  + dx * dx * dx / 6.0f;
+                w[1] = 1.0f - w[0] - w[2] - w[3];
+            }
+        } else {
+            const float ratio = static_cast<float>(n_src - 1) / n_dst;
+            for (int j = 0; j < n_dst; j++) {
+                const float p  = ratio * j;
+                const int   x  = static_cast<int>(p);
+                const float dx = p - x;
+                taps.idx[j * 2 + 0] = clip(x,     0, n_src - 1);
+                taps.idx[j * 2 + 1] = clip(x + 1, 0, n_src - 1);
+                taps.w[j * 2 + 0] = 1.0f - dx;
+                taps.w[j * 2 + 1] = dx;
+            }
+        }
+    }
+
+    // resample + normalize in a single pass, writing f32 directly
+    // the output is the window (x0, y0, w, h) of the image resized to the size the taps were built for,
+    // so resize + crop + normalize_image_u8_to_f32() collapse into one pass without any u8 intermediate
+    // round_nearest: round the resampled value (bicubic_resize) instead of truncating it (bilinear_resize)
+    static void resize_normalize(const clip_image_u8 & src, clip_image_f32 & dst,
+                                 const resize_taps & tx, const resize_taps & ty,
+                                 int x0, int y0, int w, int h, bool round_nearest,
+                                 const float mean[3], const float std[3], int n_threads) {
+        dst.nx = w;
+        dst.ny = h;
+        dst.buf.resize((size_t)3 * w * h);
+
+        // (v / 255 - mean) / std == v * scale + bias, repeated so a run of 12 floats covers 4 whole pixels
+        float scale[12];
+        float bias[12];
+        for (int i = 0; i < 12; i++) {
+            scale[i] =  1.0f / (255.0f * std[i % 3]);
+            bias[i]  = -mean[i % 3] / std[i % 3];
+        }
+
+        auto worker = [&](int row_start, int row_end) {
+            const int n = 3 * w;
+            std::vector<float> hrow(n);
+            std::vector<float> acc(n);
+            for (int i = row_start; i < row_end; i++) {
+                std::fill(acc.begin(), acc.end(), 0.0f);
+                const int32_t * ry = &ty.idx[(size_t)(y0 + i) * ty.n_taps];
+                const float   * wy = &ty.w  [(size_t)(y0 + i) * ty.n_taps];
+                for (int k = 0; k < ty.n_taps; k++) {
+                    // horizontal pass on source row ry[k]
+                    const uint8_t * row = &src.buf[(size_t)ry[k] * src.nx * 3];
+                    for (int j = 0; j < w; j++) {
+                        const int32_t * rx = &tx.idx[(size_t)(x0 + j) * tx.n_taps];
+                        const float   * wx = &tx.w  [(size_t)(x0 + j) * tx.n_taps];
+                        float r = 0.0f, g = 0.0f, b = 0.0f;
+                        for (int t = 0; t < tx.n_taps; t++) {
+                            const uint8_t * p = row + rx[t] * 3;
+                            r += wx[t] * p[0];
+                            g += wx[t] * p[1];
+                            b += wx[t] * p[2];
+                        }
+                        hrow[j * 3 + 0] = r;
+                        hrow[j * 3 + 1] = g;
+                        hrow[j * 3 + 2] = b;
+                    }
+                    // vertical accumulation
+                    int c = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+                    const float32x4_t vw = vdupq_n_f32(wy[k]);
+                    for (; c + 4 <= n; c += 4) {
+                        vst1q_f32(&acc[c], vfmaq_f32(vld1q_f32(&acc[c]), vld1q_f32(&hrow[c]), vw));
+                    }
+#endif
+                    for (; c < n; c++) {
+                        acc[c] += wy[k] * hrow[c];
+                    }
+                }
+
+                // quantize to u8 range like the u8 resizers do, then normalize
+                float * out = &dst.buf[(size_t)i * n];
+                int c = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+                const float32x4_t vmin = vdupq_n_f32(0.0f);
+                const float32x4_t vmax = vdupq_n_f32(255.0f);
+                for (; c + 12 <= n; c += 12) {
+                    for (int q = 0; q < 3; q++) {
+                        float32x4_t v = vld1q_f32(&acc[c + q * 4]);
+                        v = round_nearest ? vrndaq_f32(v) : vrndq_f32(v);
+                        v = vminq_f32(vmaxq_f32(v, vmin), vmax);
+                        v = vfmaq_f32(vld1q_f32(&bias[q * 4]), v, vld1q_f32(&scale[q * 4]));
+                        vst1q_f32(&out[c + q * 4], v);
+                    }
+                }
+#endif
+                for (; c < n; c++) {
+                    float v = round_nearest ? std::round(acc[c]) : std::trunc(acc[c]);
+                    v = std::min(std::max(v, 0.0f), 255.0f);
+                    out[c] = v * scale[c % 12] + bias[c % 12];
+                }
+            }
+        };
+
+        // thread startup is not worth it for small outputs
+        const int n_rows_min = std::max(1, (64 * 1024) / std::max(1, w));
+        n_threads = std::max(1, std::min(n_threads, h / n_rows_min));
+        if (n_threads == 1) {
+            worker(0, h);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        const int rows_per_thread = (h + n_threads - 1) / n_threads;
+        for (int t = 1; t < n_threads; t++) {
+            const int start = t * rows_per_thread;
+            const int end   = std::min(h, start + rows_per_thread);
+            if (start < end) {
+                threads.emplace_back(worker, start, end);
+            }
+        }
+        worker(0, std::min(h, rows_per_thread));
+        for (auto & th : threads) {
+            th.join();
+        }
+    }
+
 private:
     static inline int clip(int x, int lower, int upper) {
         return std::max(lower, std::min(x, upper));
@@ -3233,6 +3554,32 @@ private:
     }
 };
 
+// filter tables only depend on the (src, dst) sizes, camera frames mostly come in a handful of sizes
+static std::shared_ptr<const resize_taps> clip_get_resize_taps(clip_ctx * ctx, resize_filter filter, int n_src, int n_dst) {
+    std::lock_guard<std::mutex> lock(ctx->resize_taps_mutex);
+    auto key = std::make_tuple(filter, n_src, n_dst);
+    auto it = ctx->resize_taps_cache.find(key);
+    if (it != ctx->resize_taps_cache.end()) {
+        return it->second;
+    }
+    if (ctx->resize_taps_cache.size() >= 32) {
+        ctx->resize_taps_cache.clear();
+    }
+    auto taps = std::make_shared<resize_taps>();
+    image_manipulation::init_resize_taps(*taps, filter, n_src, n_dst);
+    ctx->resize_taps_cache[key] = taps;
+    return taps;
+}
+
+// same as bicubic_resize() followed by normalize_image_u8_to_f32(), in one pass
+static void clip_bicubic_resize_normalize(clip_ctx * ctx, const clip_image_u8 & img, clip_image_f32 & dst, int target_width, int target_height) {
+    const auto & params = ctx->model.hparams;
+    auto tx = clip_get_resize_taps(ctx, RESIZE_FILTER_BICUBIC, img.nx, target_width);
+    auto ty = clip_get_resize_taps(ctx, RESIZE_FILTER_BICUBIC, img.ny, target_height);
+    image_manipulation::resize_normalize(img, dst, *tx, *ty, 0, 0, target_width, target_height, true,
+                                         params.image_mean, params.image_std, ctx->n_threads_preproc);
+}
+
 /**
  * implementation of LLaVA-UHD:
  *  - https://arxiv.org/pdf/2403.11703
@@ -3404,6 +3751,44 @@ struct llava_uhd {
         return output;
     }
 
+    // same as slice_image() followed by normalize_image_u8_to_f32() on every output,
+    // but resamples each slice straight from the source image into f32
+    static std::vector<clip_image_f32_ptr> slice_image_f32(struct clip_ctx * ctx, const clip_image_u8 * img, const slice_instructions & inst) {
+        const auto & params = ctx->model.hparams;
+        std::vector<clip_image_f32_ptr> output;
+
+        if (inst.padding_refined) {
+            // resize_and_pad_image() has no fused equivalent
+            for (auto & slice : slice_image(img, inst)) {
+                clip_image_f32_ptr res(clip_image_f32_init());
+                normalize_image_u8_to_f32(*slice, *res, params.image_mean, params.image_std);
+                output.push_back(std::move(res));
+            }
+            return output;
+        }
+
+        // overview: bicubic resize
+        clip_image_f32_ptr overview(clip_image_f32_init());
+        clip_bicubic_resize_normalize(ctx, *img, *overview, inst.overview_size.width, inst.overview_size.height);
+        output.push_back(std::move(overview));
+        if (inst.slices.empty()) {
+            return output;
+        }
+
+        // slices: windows of the bilinear-resized refined image
+        auto tx = clip_get_resize_taps(ctx, RESIZE_FILTER_BILINEAR, img->nx, inst.refined_size.width);
+        auto ty = clip_get_resize_taps(ctx, RESIZE_FILTER_BILINEAR, img->ny, inst.refined_size.height);
+        for (const auto & slice : inst.slices) {
+            clip_image_f32_ptr res(clip_image_f32_init());
+            image_manipulation::resize_normalize(*img, *res, *tx, *ty,
+                                                 slice.x, slice.y, slice.size.width, slice.size.height, false,
+                                                 params.image_mean, params.image_std, ctx->n_threads_preproc);
+            output.push_back(std::move(res));
+        }
+
+        return output;
+    }
+
 private:
     static clip_image_size get_best_resize(const clip_image_size & original_size, int scale_resolution, int patch_size, bool allow_upscale = false) {
         int width  = original_size.width;
@@ -3531,6 +3916,7 @@ private:
 // returns the normalized float tensor for llava-1.5, for spatial_unpad with anyres processing for llava-1.6 it returns the normalized image patch tensors as a vector
 // res_imgs memory is being allocated here, previous allocations will be freed if found
 bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, struct clip_image_f32_batch * res_imgs) {
+    MTMD_TRACE_SCOPE("clip_preprocess");
     clip_image_size original_size{img->nx, img->ny};
     bool pad_to_square = true;
     auto & params = ctx->model.hparams;
@@ -3541,12 +3927,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
 
     if (clip_is_minicpmv(ctx)) {
         auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
-        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst);
-
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            // clip_image_save_to_bmp(*imgs[i], "slice_" + std::to_string(i) + ".bmp");
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
+        for (auto & res : llava_uhd::slice_image_f32(ctx, img, inst)) {
             res_imgs->entries.push_back(std::move(res));
         }
 
@@ -3555,15 +3936,11 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
         return true;
 
     } else if (ctx->proj_type() == PROJECTOR_TYPE_QWEN2VL || ctx->proj_type() == PROJECTOR_TYPE_QWEN25VL) {
-        clip_image_u8 resized;
         auto patch_size = params.patch_size * 2;
         auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, patch_size, params.image_size);
-        image_manipulation::bicubic_resize(*img, resized, new_size.width, new_size.height);
 
         clip_image_f32_ptr img_f32(clip_image_f32_init());
-        // clip_image_f32_ptr res(clip_image_f32_init());
-        normalize_image_u8_to_f32(resized, *img_f32, params.image_mean, params.image_std);
-        // res_imgs->data[0] = *res;
+        clip_bicubic_resize_normalize(ctx, *img, *img_f32, new_size.width, new_size.height);
         res_imgs->entries.push_back(std::move(img_f32));
         return true;
     } else if (ctx->proj_type() == PROJECTOR_TYPE_IDEFICS3) {
@@ -3596,13 +3973,8 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
                 });
             }
         }
-        auto imgs = llava_uhd::slice_image(img, instructions);
-
-        // cast and normalize to f32
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            // clip_image_save_to_bmp(*imgs[i], "slice_" + std::to_string(i) + ".bmp");
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
+        // resize, slice and normalize to f32 in one pass per output
+        for (auto & res : llava_uhd::slice_image_f32(ctx, img, instructions)) {
             res_imgs->entries.push_back(std::move(res));
         }
 
@@ -3634,11 +4006,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
     } else if (ctx->proj_type() == PROJECTOR_TYPE_LLAMA4) {
         GGML_ASSERT(!params.image_res_candidates.empty());
         auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
-        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst);
-
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
+        for (auto & res : llava_uhd::slice_image_f32(ctx, img, inst)) {
             res_imgs->entries.push_back(std::move(res));
         }
 
@@ -3741,6 +4109,28 @@ void clip_free(clip_ctx * ctx) {
     delete ctx;
 }
 
+void clip_set_threadpool(clip_ctx * ctx, ggml_threadpool_t threadpool) {
+    ggml_backend_cpu_set_threadpool(ctx->backend_cpu, threadpool);
+}
+
+size_t clip_model_nbytes(const struct clip_ctx * ctx) {
+    return ctx->buf ? ggml_backend_buffer_get_size(ctx->buf.get()) : 0;
+}
+
+size_t clip_compute_nbytes(const struct clip_ctx * ctx) {
+    size_t size = 0;
+    for (ggml_backend_t backend : ctx->backend_ptrs) {
+        size += ggml_backend_sched_get_buffer_size(ctx->sched.get(), backend);
+    }
+    return size;
+}
+
+void clip_release_compute(clip_ctx * ctx) {
+    ctx->graph_cache_clear();
+    ctx->pos_inputs_cache.clear();
+    ctx->sched_init();
+}
+
 // deprecated
 size_t clip_embd_nbytes(const struct clip_ctx * ctx) {
     const int32_t nx = ctx->model.hparams.image_size;
@@ -3788,6 +4178,60 @@ int clip_n_output_tokens_y(const struct clip_ctx * ctx, struct clip_image_f32 *
     return 1;
 }
 
+bool clip_n_output_grid(const struct clip_ctx * ctx, struct clip_image_f32 * img, int * nx, int * ny) {
+    const auto & params = ctx->model.hparams;
+    const int patch_size = params.patch_size;
+    int x_patch = 0;
+    int y_patch = 0;
+
+    switch (ctx->proj_type()) {
+        case PROJECTOR_TYPE_MLP:
+        case PROJECTOR_TYPE_MLP_NORM:
+            {
+                x_patch = img->nx / patch_size;
+                y_patch = img->ny / patch_size;
+            } break;
+        case PROJECTOR_TYPE_LDP:
+        case PROJECTOR_TYPE_LDPV2:
+            {
+                x_patch = img->nx / patch_size / 2;
+                y_patch = img->ny / patch_size / 2;
+            } break;
+        case PROJECTOR_TYPE_QWEN2VL:
+        case PROJECTOR_TYPE_QWEN25VL:
+            {
+                x_patch = clip_n_output_tokens_x(ctx, img);
+                y_patch = clip_n_output_tokens_y(ctx, img);
+            } break;
+        case PROJECTOR_TYPE_GEMMA3:
+        case PROJECTOR_TYPE_IDEFICS3:
+        case PROJECTOR_TYPE_INTERNVL:
+        case PROJECTOR_TYPE_LLAMA4:
+            {
+                const int scale_factor = params.proj_scale_factor;
+                x_patch = img->nx / patch_size / scale_factor;
+                y_patch = img->ny / patch_size / scale_factor;
+            } break;
+        case PROJECTOR_TYPE_LFM2:
+        case PROJECTOR_TYPE_KIMIVL:
+            {
+                const int out_patch_size = patch_size * params.proj_scale_factor;
+                x_patch = CLIP_ALIGN(img->nx, out_patch_size) / out_patch_size;
+                y_patch = CLIP_ALIGN(img->ny, out_patch_size) / out_patch_size;
+            } break;
+        default:
+            return false;
+    }
+
+    // the token count is the source of truth, anything extra (e.g. a class token) breaks the layout
+    if (x_patch <= 0 || y_patch <= 0 || x_patch * y_patch != clip_n_output_tokens(ctx, img)) {
+        return false;
+    }
+    *nx = x_patch;
+    *ny = y_patch;
+    return true;
+}
+
 int clip_n_output_tokens(const struct clip_ctx * ctx, struct clip_image_f32 * img) {
     const auto & params = ctx->model.hparams;
 
@@ -3900,209 +4344,48 @@ int clip_n_output_tokens(const struct clip_ctx * ctx, struct clip_image_f32 * im
     return n_patches;
 }
 
-static std::vector<std::vector<std::vector<float>>> get_1d_sincos_pos_embed_from_grid_new(int embed_dim, const std::vector<std::vector<float>> & pos) {
+// 2D sin-cos embeddings of an H x W grid, flat with embed_dim floats per position
+// positions are ordered w * H + h; the first half of each row encodes h, the second half w
+static std::vector<float> get_2d_sincos_pos_embed(int embed_dim, int H, int W) {
     assert(embed_dim % 2 == 0);
-    int H = pos.size();
-    int W = pos[0].size();
+    const int half    = embed_dim / 2;
+    const int quarter = half / 2;
 
-    std::vector<float> omega(embed_dim / 2);
-    for (int i = 0; i < embed_dim / 2; ++i) {
-        omega[i] = 1.0 / pow(10000.0, static_cast<float>(i) / (embed_dim / 2));
+    std::vector<float> omega(quarter);
+    for (int i = 0; i < quarter; ++i) {
+        omega[i] = 1.0 / pow(10000.0, static_cast<float>(i) / quarter);
     }
 
-    std::vector<std::vector<std::vector<float>>> emb(H, std::vector<std::vector<float>>(W, std::vector<float>(embed_dim)));
+    std::vector<float> emb((size_t)H * W * embed_dim, 0.0f);
     for (int h = 0; h < H; ++h) {
         for (int w = 0; w < W; ++w) {
-            for (int d = 0; d < embed_dim / 2; ++d) {
-                float out_value = pos[h][w] * omega[d];
-                emb[h][w][d] = sin(out_value);
-                emb[h][w][d + embed_dim / 2] = cos(out_value);
+            float * row = emb.data() + ((size_t)w * H + h) * embed_dim;
+            for (int d = 0; d < quarter; ++d) {
+                const float out_h = h * omega[d];
+                const float out_w = w * omega[d];
+                row[d]                  = sin(out_h);
+                row[d + quarter]        = cos(out_h);
+                row[half + d]           = sin(out_w);
+                row[half + d + quarter] = cos(out_w);
             }
         }
     }
-
     return emb;
 }
 
-static std::vector<std::vector<std::vector<float>>> get_2d_sincos_pos_embed_from_grid(int embed_dim, const std::vector<std::vector<std::vector<float>>> & grid) {
-    assert(embed_dim % 2 == 0);
-    std::vector<std::vector<std::vector<float>>> emb_h = get_1d_sincos_pos_embed_from_grid_new(embed_dim / 2, grid[0]); // (H, W, D/2)
-    std::vector<std::vector<std::vector<float>>> emb_w = get_1d_sincos_pos_embed_from_grid_new(embed_dim / 2, grid[1]); // (H, W, D/2)
-
-    int H = emb_h.size();
-    int W = emb_h[0].size();
-    std::vector<std::vector<std::vector<float>>> emb(H, std::vector<std::vector<float>>(W, std::vector<float>(embed_dim)));
-
-    for (int h = 0; h < H; ++h) {
-        for (int w = 0; w < W; ++w) {
-            for (int d = 0; d < embed_dim / 2; ++d) {
-                emb[h][w][d] = emb_h[h][w][d];
-                emb[h][w][d + embed_dim / 2] = emb_w[h][w][d];
-            }
-        }
-    }
-    return emb;
-}
-
-static std::vector<std::vector<float>> get_2d_sincos_pos_embed(int embed_dim, const std::pair<int, int> image_size) {
-    int grid_h_size = image_size.first;
-    int grid_w_size = image_size.second;
-
-    std::vector<float> grid_h(grid_h_size);
-    std::vector<float> grid_w(grid_w_size);
-
-    for (int i = 0; i < grid_h_size; ++i) {
-        grid_h[i] = static_cast<float>(i);
-    }
-    for (int i = 0; i < grid_w_size; ++i) {
-        grid_w[i] = static_cast<float>(i);
-    }
-
-    std::vector<std::vector<float>> grid(grid_h_size, std::vector<float>(grid_w_size));
-    for (int h = 0; h < grid_h_size; ++h) {
-        for (int w = 0; w < grid_w_size; ++w) {
-            grid[h][w] = grid_w[w];
-        }
-    }
-    std::vector<std::vector<std::vector<float>>> grid_2d = {grid, grid};
-    for (int h = 0; h < grid_h_size; ++h) {
-        for (int w = 0; w < grid_w_size; ++w) {
-            grid_2d[0][h][w] = grid_h[h];
-            grid_2d[1][h][w] = grid_w[w];
-        }
-    }
-
-    std::vector<std::vector<std::vector<float>>> pos_embed_3d = get_2d_sincos_pos_embed_from_grid(embed_dim, grid_2d);
-
-    int H = image_size.first;
-    int W = image_size.second;
-    std::vector<std::vector<float>> pos_embed_2d(H * W, std::vector<float>(embed_dim));
-    for (int h = 0; h < H; ++h) {
-        for (int w = 0; w < W; ++w) {
-            pos_embed_2d[w * H + h] = pos_embed_3d[h][w];
-        }
-    }
-
-    return pos_embed_2d;
-}
-
-bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec) {
-    clip_image_f32_batch imgs;
-    clip_image_f32_ptr img_copy(clip_image_f32_init());
-    *img_copy = *img;
-    imgs.entries.push_back(std::move(img_copy));
-
-    return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
-}
-
-bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs_c_ptr, float * vec) {
-    const clip_image_f32_batch & imgs = *imgs_c_ptr;
-    int batch_size = imgs.entries.size();
-
-    // TODO @ngxson : implement batch size > 1 as a loop
-    //                we don't need true batching support because the cgraph will gonna be big anyway
-    if (batch_size != 1) {
-        return false; // only support batch size of 1
-    }
-
-    // build the inference graph
-    ctx->debug_print_tensors.clear();
-    ggml_backend_sched_reset(ctx->sched.get());
-    ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    ggml_backend_sched_alloc_graph(ctx->sched.get(), gf);
-
-    // set inputs
+// build the positional inputs of the graph for a pos_w x pos_h patch grid
+static clip_pos_inputs clip_pos_inputs_build(const clip_ctx * ctx, int pos_w, int pos_h) {
     const auto & model   = ctx->model;
     const auto & hparams = model.hparams;
 
-    const int image_size_width  = imgs.entries[0]->nx;
-    const int image_size_height = imgs.entries[0]->ny;
-
-    const int patch_size    = hparams.patch_size;
-    const int num_patches   = ((image_size_width / patch_size) * (image_size_height / patch_size));
+    const int patch_size  = hparams.patch_size;
+    const int num_patches = pos_w * pos_h;
     const int n_pos = num_patches + (model.class_embedding ? 1 : 0);
-    const int pos_w = image_size_width  / patch_size;
-    const int pos_h = image_size_height / patch_size;
 
     const bool use_window_attn = hparams.n_wa_pattern > 0; // for qwen2.5vl
 
-    auto get_inp_tensor = [&gf](const char * name) {
-        ggml_tensor * inp = ggml_graph_get_tensor(gf, name);
-        if (inp == nullptr) {
-            GGML_ABORT("Failed to get tensor %s", name);
-        }
-        if (!(inp->flags & GGML_TENSOR_FLAG_INPUT)) {
-            GGML_ABORT("Tensor %s is not an input tensor", name);
-        }
-        return inp;
-    };
-
-    auto set_input_f32 = [&get_inp_tensor](const char * name, std::vector<float> & values) {
-        ggml_tensor * cur = get_inp_tensor(name);
-        GGML_ASSERT(cur->type == GGML_TYPE_F32);
-        GGML_ASSERT(ggml_nelements(cur) == (int64_t)values.size());
-        ggml_backend_tensor_set(cur, values.data(), 0, ggml_nbytes(cur));
-    };
-
-    auto set_input_i32 = [&get_inp_tensor](const char * name, std::vector<int32_t> & values) {
-        ggml_tensor * cur = get_inp_tensor(name);
-        GGML_ASSERT(cur->type == GGML_TYPE_I32);
-        GGML_ASSERT(ggml_nelements(cur) == (int64_t)values.size());
-        ggml_backend_tensor_set(cur, values.data(), 0, ggml_nbytes(cur));
-    };
-
-    // set input pixel values
-    if (!imgs.is_audio) {
-        size_t nelem = 0;
-        for (const auto & img : imgs.entries) {
-            nelem += img->nx * img->ny * 3;
-        }
-        std::vector<float> inp_raw(nelem);
-
-        // layout of data (note: the channel dim is unrolled to better visualize the layout):
-        //
-        // ┌──W──┐
-        // │     H │  channel = R
-        // ├─────┤ │
-        // │     H │  channel = G
-        // ├─────┤ │
-        // │     H │  channel = B
-        // └─────┘ │
-        //   ──────┘ x B
-
-        for (size_t i = 0; i < imgs.entries.size(); i++) {
-            const int nx = imgs.entries[i]->nx;
-            const int ny = imgs.entries[i]->ny;
-            const int n = nx * ny;
-
-            for (int b = 0; b < batch_size; b++) {
-                float * batch_entry = inp_raw.data() + b * (3*n);
-                for (int y = 0; y < ny; y++) {
-                    for (int x = 0; x < nx; x++) {
-                        size_t base_src = 3*(y * nx + x); // idx of the first channel
-                        size_t base_dst =    y * nx + x;  // idx of the first channel
-                        batch_entry[      base_dst] = imgs.entries[b]->buf[base_src    ];
-                        batch_entry[1*n + base_dst] = imgs.entries[b]->buf[base_src + 1];
-                        batch_entry[2*n + base_dst] = imgs.entries[b]->buf[base_src + 2];
-                    }
-                }
-            }
-        }
-        set_input_f32("inp_raw", inp_raw);
-
-    } else {
-        // audio input
-        GGML_ASSERT(imgs.entries.size() == 1);
-        const auto & mel_inp = imgs.entries[0];
-        const int n_step = mel_inp->nx;
-        const int n_mel  = mel_inp->ny;
-        std::vector<float> inp_raw(n_step * n_mel);
-        std::memcpy(inp_raw.data(), mel_inp->buf.data(), n_step * n_mel * sizeof(float));
-        set_input_f32("inp_raw", inp_raw);
-    }
-
-    // set input per projector
-    switch (ctx->model.proj_type) {
+    clip_pos_inputs inputs;
+    switch (model.proj_type) {
         case PROJECTOR_TYPE_MINICPMV:
             {
                 // inspired from siglip:
@@ -4122,31 +4405,20 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                         positions[id++] = bucket_coords_h[i]*70 + bucket_coords_w[j];
                     }
                 }
-                set_input_i32("positions", positions);
+                inputs.i32.emplace_back("positions", std::move(positions));
 
                 // inspired from resampler of Qwen-VL:
                 //    -> https://huggingface.co/Qwen/Qwen-VL/tree/main
                 //    -> https://huggingface.co/Qwen/Qwen-VL/blob/0547ed36a86561e2e42fecec8fd0c4f6953e33c4/visual.py#L23
                 int embed_dim = clip_n_mmproj_embd(ctx);
-
-                // TODO @ngxson : this is very inefficient, can we do this using ggml_sin and ggml_cos?
-                auto pos_embed_t = get_2d_sincos_pos_embed(embed_dim, std::make_pair(pos_w, pos_h));
-
-                std::vector<float> pos_embed(embed_dim * pos_w * pos_h);
-                for(int i = 0; i < pos_w * pos_h; ++i){
-                    for(int j = 0; j < embed_dim; ++j){
-                        pos_embed[i * embed_dim + j] = pos_embed_t[i][j];
-                    }
-                }
-
-                set_input_f32("pos_embed", pos_embed);
+                inputs.f32.emplace_back("pos_embed", get_2d_sincos_pos_embed(embed_dim, pos_w, pos_h));
             } break;
         case PROJECTOR_TYPE_QWEN2VL:
             {
                 const int merge_ratio = 2;
-                const int pw = image_size_width  / patch_size;
-                const int ph = image_size_height / patch_size;
-                std::vector<int> positions(n_pos * 4);
+                const int pw = pos_w;
+                const int ph = pos_h;
+                std::vector<int32_t> positions(n_pos * 4);
                 int ptr = 0;
                 for (int y = 0; y < ph; y += merge_ratio) {
                     for (int x = 0; x < pw; x += merge_ratio) {
@@ -4162,27 +4434,27 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                     }
                 }
 
-                set_input_i32("positions", positions);
+                inputs.i32.emplace_back("positions", std::move(positions));
             } break;
         case PROJECTOR_TYPE_QWEN25VL:
             {
                 // pw * ph = number of tokens output by ViT after apply patch merger
                 // ipw * ipw = number of vision token been processed inside ViT
                 const int merge_ratio = 2;
-                const int pw  = image_size_width  / patch_size / merge_ratio;
-                const int ph  = image_size_height / patch_size / merge_ratio;
-                const int ipw = image_size_width  / patch_size;
-                const int iph = image_size_height / patch_size;
+                const int pw  = pos_w / merge_ratio;
+                const int ph  = pos_h / merge_ratio;
+                const int ipw = pos_w;
+                const int iph = pos_h;
 
-                std::vector<int> idx    (ph * pw);
-                std::vector<int> inv_idx(ph * pw);
+                std::vector<int32_t> idx    (ph * pw);
+                std::vector<int32_t> inv_idx(ph * pw);
 
                 if (use_window_attn) {
                     const int attn_window_size = 112;
                     const int grid_window = attn_window_size / patch_size / merge_ratio;
                     int dst = 0;
                     // [num_vision_tokens, num_vision_tokens] attention mask tensor
-                    std::vector<float> mask(pow(ipw * iph, 2), std::numeric_limits<float>::lowest());
+                    std::vector<float> mask((size_t)(ipw * iph) * (ipw * iph), std::numeric_limits<float>::lowest());
                     int mask_row = 0;
 
                     for (int y = 0; y < ph; y += grid_window) {
@@ -4203,7 +4475,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                             }
 
                             for (int r=0; r < win_h * win_w * merge_ratio * merge_ratio; r++) {
-                                int row_offset = mask_row * (ipw * iph);
+                                size_t row_offset = (size_t)mask_row * (ipw * iph);
                                 std::fill(
                                     mask.begin() + row_offset + (dst_0 * merge_ratio * merge_ratio),
                                     mask.begin() + row_offset + (dst   * merge_ratio * merge_ratio),
@@ -4213,9 +4485,9 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                         }
                     }
 
-                    set_input_i32("window_idx",     idx);
-                    set_input_i32("inv_window_idx", inv_idx);
-                    set_input_f32("window_mask",    mask);
+                    inputs.i32.emplace_back("window_idx",     idx);
+                    inputs.i32.emplace_back("inv_window_idx", std::move(inv_idx));
+                    inputs.f32.emplace_back("window_mask",    std::move(mask));
                 } else {
                     for (int i = 0; i < ph * pw; i++) {
                         idx[i] = i;
@@ -4223,7 +4495,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                 }
 
                 const int mpow = merge_ratio * merge_ratio;
-                std::vector<int> positions(n_pos * 4);
+                std::vector<int32_t> positions(n_pos * 4);
 
                 int ptr = 0;
                 for (int y = 0; y < iph; y += merge_ratio) {
@@ -4243,24 +4515,24 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                     }
                 }
 
-                set_input_i32("positions", positions);
+                inputs.i32.emplace_back("positions", std::move(positions));
             } break;
         case PROJECTOR_TYPE_PIXTRAL:
         case PROJECTOR_TYPE_KIMIVL:
             {
                 // set the 2D positions
-                int n_patches_per_col = image_size_width / patch_size;
-                std::vector<int> pos_data(n_pos);
+                int n_patches_per_col = pos_w;
+                std::vector<int32_t> pos_data(n_pos);
                 // dimension H
                 for (int i = 0; i < n_pos; i++) {
                     pos_data[i] = i / n_patches_per_col;
                 }
-                set_input_i32("pos_h", pos_data);
+                inputs.i32.emplace_back("pos_h", pos_data);
                 // dimension W
                 for (int i = 0; i < n_pos; i++) {
                     pos_data[i] = i % n_patches_per_col;
                 }
-                set_input_i32("pos_w", pos_data);
+                inputs.i32.emplace_back("pos_w", std::move(pos_data));
             } break;
         case PROJECTOR_TYPE_GLM_EDGE:
         {
@@ -4269,7 +4541,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
             for (int i = 0; i < n_pos; i++) {
                 positions[i] = i;
             }
-            set_input_i32("positions", positions);
+            inputs.i32.emplace_back("positions", std::move(positions));
         } break;
         case PROJECTOR_TYPE_MLP:
         case PROJECTOR_TYPE_MLP_NORM:
@@ -4281,7 +4553,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                 for (int i = 0; i < n_pos; i++) {
                     positions[i] = i;
                 }
-                set_input_i32("positions", positions);
+                inputs.i32.emplace_back("positions", std::move(positions));
 
                 // The patches vector is used to get rows to index into the embeds with;
                 // we should skip dim 0 only if we have CLS to avoid going out of bounds
@@ -4291,7 +4563,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                 for (int i = 0; i < num_patches; i++) {
                     patches[i] = i + patch_offset;
                 }
-                set_input_i32("patches", patches);
+                inputs.i32.emplace_back("patches", std::move(patches));
             } break;
         case PROJECTOR_TYPE_GEMMA3:
         case PROJECTOR_TYPE_IDEFICS3:
@@ -4306,35 +4578,136 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         case PROJECTOR_TYPE_LLAMA4:
             {
                 // set the 2D positions
-                int n_patches_per_col = image_size_width / patch_size;
-                std::vector<int> pos_data(num_patches + 1, 0); // +1 for the [CLS] token
+                int n_patches_per_col = pos_w;
+                std::vector<int32_t> pos_data(num_patches + 1, 0); // +1 for the [CLS] token
                 // last pos is always kept 0, it's for CLS
                 // dimension H
                 for (int i = 0; i < num_patches; i++) {
                     pos_data[i] = (i / n_patches_per_col) + 1;
                 }
-                set_input_i32("pos_h", pos_data);
+                inputs.i32.emplace_back("pos_h", pos_data);
                 // dimension W
                 for (int i = 0; i < num_patches; i++) {
                     pos_data[i] = (i % n_patches_per_col) + 1;
                 }
-                set_input_i32("pos_w", pos_data);
+                inputs.i32.emplace_back("pos_w", std::move(pos_data));
             } break;
         default:
             GGML_ABORT("Unknown projector type");
     }
+    return inputs;
+}
 
-    // ggml_backend_cpu_set_n_threads(ctx->backend_cpu, n_threads);
-    ggml_backend_dev_t dev = ggml_backend_get_device(ctx->backend_cpu);
-    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
-    if (reg) {
-        auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
-        if (ggml_backend_set_n_threads_fn) {
-            ggml_backend_set_n_threads_fn(ctx->backend_cpu, n_threads);
+// positional inputs for an image, built on first use of its patch grid
+static const clip_pos_inputs & clip_pos_inputs_get(clip_ctx * ctx, const clip_image_f32 & img) {
+    const int patch_size = ctx->model.hparams.patch_size;
+    const std::pair<int, int> key(img.nx / patch_size, img.ny / patch_size);
+    auto it = ctx->pos_inputs_cache.find(key);
+    if (it != ctx->pos_inputs_cache.end()) {
+        return it->second;
+    }
+    // camera frames use one or two sizes, this only bounds pathological callers
+    if (ctx->pos_inputs_cache.size() >= 8) {
+        ctx->pos_inputs_cache.clear();
+    }
+    return ctx->pos_inputs_cache.emplace(key, clip_pos_inputs_build(ctx, key.first, key.second)).first->second;
+}
+
+bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f32 * img, float * vec) {
+    clip_image_f32_batch imgs;
+    clip_image_f32_ptr img_copy(clip_image_f32_init());
+    *img_copy = *img;
+    imgs.entries.push_back(std::move(img_copy));
+
+    return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
+}
+
+// set the inputs of an already allocated graph for one image, compute it and copy the embeddings to vec
+// pos are the positional inputs to upload, NULL when the graph still holds them from the previous call
+static bool clip_image_encode_graph(clip_ctx * ctx, ggml_cgraph * gf, clip_image_f32 & img, bool is_audio,
+                                    const clip_pos_inputs * pos, float * vec) {
+    // set inputs
+    auto get_inp_tensor = [&gf](const char * name) {
+        ggml_tensor * inp = ggml_graph_get_tensor(gf, name);
+        if (inp == nullptr) {
+            GGML_ABORT("Failed to get tensor %s", name);
+        }
+        if (!(inp->flags & GGML_TENSOR_FLAG_INPUT)) {
+            GGML_ABORT("Tensor %s is not an input tensor", name);
+        }
+        return inp;
+    };
+
+    auto set_input_f32 = [&get_inp_tensor](const char * name, const std::vector<float> & values) {
+        ggml_tensor * cur = get_inp_tensor(name);
+        GGML_ASSERT(cur->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_nelements(cur) == (int64_t)values.size());
+        ggml_backend_tensor_set(cur, values.data(), 0, ggml_nbytes(cur));
+    };
+
+    auto set_input_i32 = [&get_inp_tensor](const char * name, const std::vector<int32_t> & values) {
+        ggml_tensor * cur = get_inp_tensor(name);
+        GGML_ASSERT(cur->type == GGML_TYPE_I32);
+        GGML_ASSERT(ggml_nelements(cur) == (int64_t)values.size());
+        ggml_backend_tensor_set(cur, values.data(), 0, ggml_nbytes(cur));
+    };
+
+    // set input pixel values
+    if (!is_audio) {
+        std::vector<float> inp_raw((size_t)img.nx * img.ny * 3);
+
+        // layout of data (note: the channel dim is unrolled to better visualize the layout):
+        //
+        // ┌──W──┐
+        // │     H │  channel = R
+        // ├─────┤ │
+        // │     H │  channel = G
+        // ├─────┤ │
+        // │     H │  channel = B
+        // └─────┘ │
+        //   ──────┘
+
+        {
+            const int nx = img.nx;
+            const int ny = img.ny;
+            const int n = nx * ny;
+
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    size_t base_src = 3*(y * nx + x); // idx of the first channel
+                    size_t base_dst =    y * nx + x;  // idx of the first channel
+                    inp_raw[      base_dst] = img.buf[base_src    ];
+                    inp_raw[1*n + base_dst] = img.buf[base_src + 1];
+                    inp_raw[2*n + base_dst] = img.buf[base_src + 2];
+                }
+            }
+        }
+        set_input_f32("inp_raw", inp_raw);
+
+    } else {
+        // audio input
+        const int n_step = img.nx;
+        const int n_mel  = img.ny;
+        std::vector<float> inp_raw(n_step * n_mel);
+        std::memcpy(inp_raw.data(), img.buf.data(), n_step * n_mel * sizeof(float));
+        set_input_f32("inp_raw", inp_raw);
+    }
+
+    // the positional inputs only depend on the image size, they stay in the cached graph between calls
+    if (pos) {
+        for (const auto & inp : pos->i32) {
+            set_input_i32(inp.first, inp.second);
+        }
+        for (const auto & inp : pos->f32) {
+            set_input_f32(inp.first, inp.second);
         }
     }
 
-    auto status = ggml_backend_sched_graph_compute(ctx->sched.get(), gf);
+    ggml_status status;
+    {
+        MTMD_TRACE_SCOPE("clip_compute");
+        status = ggml_backend_sched_graph_compute(ctx->sched.get(), gf);
+    }
     if (status != GGML_STATUS_SUCCESS) {
         LOG_ERR("%s: ggml_backend_sched_graph_compute failed with error %d\n", __func__, status);
         return false;
@@ -4355,9 +4728,9 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     // the last node is the embedding tensor
     ggml_tensor * embeddings = ggml_graph_node(gf, -1);
 
-    // sanity check (only support batch size of 1 for now)
+    // sanity check
     const int n_tokens_out = embeddings->ne[1];
-    const int expected_n_tokens_out = clip_n_output_tokens(ctx, imgs.entries[0].get());
+    const int expected_n_tokens_out = clip_n_output_tokens(ctx, &img);
     if (n_tokens_out != expected_n_tokens_out) {
         LOG_ERR("%s: expected output %d tokens, got %d\n", __func__, expected_n_tokens_out, n_tokens_out);
         GGML_ABORT("Invalid number of output tokens");
@@ -4369,6 +4742,73 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     return true;
 }
 
+// the graph builders only handle a single image, but the graph only depends on the image size:
+// build and allocate it once and run it for every entry of the same size, writing the outputs contiguously
+// the graph is kept in ctx->graph_cache, so the next call with the same size skips building and allocation
+bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs_c_ptr, float * vec) {
+    MTMD_TRACE_SCOPE("clip_encode");
+    const clip_image_f32_batch & imgs = *imgs_c_ptr;
+    if (imgs.entries.empty()) {
+        return false;
+    }
+
+    // ggml_backend_cpu_set_n_threads(ctx->backend_cpu, n_threads);
+    ggml_backend_dev_t dev = ggml_backend_get_device(ctx->backend_cpu);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+    if (reg) {
+        auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+        if (ggml_backend_set_n_threads_fn) {
+            ggml_backend_set_n_threads_fn(ctx->backend_cpu, n_threads);
+        }
+    }
+
+    auto & cache = ctx->graph_cache;
+    for (const auto & entry : imgs.entries) {
+        clip_image_f32 & img = *entry;
+        const clip_pos_inputs * pos = nullptr;
+        if (cache.gf == nullptr || img.nx != cache.nx || img.ny != cache.ny) {
+            // build the inference graph
+            MTMD_TRACE_SCOPE("clip_build_graph");
+            MTMD_TRACE_ADD(MTMD_TRACE_ENCODER_GRAPHS, 1);
+            ctx->graph_cache_clear();
+            ctx->debug_print_tensors.clear();
+            ggml_backend_sched_reset(ctx->sched.get());
+            ggml_cgraph * gf = clip_image_build_graph(ctx, img, &cache.ctx);
+            // flagged as outputs, the allocator never reuses the memory of the positional inputs,
+            // so they are uploaded once here and read again by every compute of the cached graph
+            pos = &clip_pos_inputs_get(ctx, img);
+            for (const auto & inp : pos->i32) {
+                ggml_tensor * t = ggml_graph_get_tensor(gf, inp.first);
+                if (t) {
+                    ggml_set_output(t);
+                }
+            }
+            for (const auto & inp : pos->f32) {
+                ggml_tensor * t = ggml_graph_get_tensor(gf, inp.first);
+                if (t) {
+                    ggml_set_output(t);
+                }
+            }
+            if (!ggml_backend_sched_alloc_graph(ctx->sched.get(), gf)) {
+                LOG_ERR("%s: failed to allocate the compute graph for %dx%d\n", __func__, img.nx, img.ny);
+                ctx->graph_cache_clear();
+                return false;
+            }
+            cache.gf = gf;
+            cache.nx = img.nx;
+            cache.ny = img.ny;
+        }
+
+        if (!clip_image_encode_graph(ctx, cache.gf, img, imgs.is_audio, pos, vec)) {
+            ctx->graph_cache_clear();
+            return false;
+        }
+        vec += ggml_nelements(ggml_graph_node(cache.gf, -1));
+    }
+
+    return true;
+}
+
 int clip_n_mmproj_embd(const struct clip_ctx * ctx) {
     switch (ctx->model.proj_type) {
         case PROJECTOR_TYPE_LDP:
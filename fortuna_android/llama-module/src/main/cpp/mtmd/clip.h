@@ -25,6 +25,7 @@ enum clip_modality {
 struct clip_context_params {
     bool use_gpu;
     enum ggml_log_level verbosity;
+    int n_threads; // used by image preprocessing
 };
 
 struct clip_init_result {
@@ -36,6 +37,16 @@ struct clip_init_result clip_init(const char * fname, struct clip_context_params
 
 void clip_free(struct clip_ctx * ctx);
 
+// run the CPU part of the graphs on this threadpool, NULL for a disposable one per graph
+void clip_set_threadpool(struct clip_ctx * ctx, ggml_threadpool_t threadpool);
+
+// bytes held by the weights, and by the compute buffers of the cached graph
+size_t clip_model_nbytes(const struct clip_ctx * ctx);
+size_t clip_compute_nbytes(const struct clip_ctx * ctx);
+
+// free the compute buffers, the cached graph and its positional inputs, the next encode rebuilds them
+void clip_release_compute(struct clip_ctx * ctx);
+
 size_t clip_embd_nbytes(const struct clip_ctx * ctx);
 size_t clip_embd_nbytes_by_img(const struct clip_ctx * ctx, int img_w, int img_h);
 
@@ -53,6 +64,10 @@ int clip_n_output_tokens(const struct clip_ctx * ctx, struct clip_image_f32 * im
 int clip_n_output_tokens_x(const struct clip_ctx * ctx, struct clip_image_f32 * img);
 int clip_n_output_tokens_y(const struct clip_ctx * ctx, struct clip_image_f32 * img);
 
+// row-major 2D layout of the output tokens, used to pool neighbouring tokens after encoding
+// returns false if the output is not a plain grid (resampler queries, [IMG_BREAK] or BOI/EOI tokens, audio)
+bool clip_n_output_grid(const struct clip_ctx * ctx, struct clip_image_f32 * img, int * nx, int * ny);
+
 // this should be equal to the embedding dimension of the text model
 int clip_n_mmproj_embd(const struct clip_ctx * ctx);
 
@@ -88,6 +103,8 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const struct clip_image_u8 * i
 struct ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ctx);
 
 bool clip_image_encode      (struct clip_ctx * ctx, int n_threads, struct clip_image_f32 * img, float * vec);
+// encodes every entry of the batch, the embeddings are written back to back into vec
+// entries of the same size share one graph and allocation
 bool clip_image_batch_encode(struct clip_ctx * ctx, int n_threads, const struct clip_image_f32_batch * imgs, float * vec);
 
 int clip_is_minicpmv(const struct clip_ctx * ctx);
@@ -9,6 +9,10 @@
 #include <fstream>
 #include <algorithm>
 
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 // most of the code here is copied from whisper.cpp
 
 // align x to upper multiple of n
@@ -17,13 +21,19 @@
 namespace whisper_preprocessor {
 
 #define SIN_COS_N_COUNT WHISPER_N_FFT
+#define FFT_MAX_FACTORS 16
+#define FFT_MAX_RADIX   16
 namespace {
 struct whisper_global_cache {
     // In FFT, we frequently use sine and cosine operations with the same values.
     // We can use precalculated values to speed up the process.
+    // w_n^j = exp(-2*pi*i*j/n) of any n dividing SIN_COS_N_COUNT is cos_vals[j*s] - i*sin_vals[j*s], s = SIN_COS_N_COUNT/n
     float sin_vals[SIN_COS_N_COUNT];
     float cos_vals[SIN_COS_N_COUNT];
 
+    // radices of the complex FFT of WHISPER_N_FFT/2 points used for the real FFT of a frame
+    int fft_factors[FFT_MAX_FACTORS];
+
     // Hann window (Use cosf to eliminate difference)
     // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
@@ -32,6 +42,20 @@ struct whisper_global_cache {
     whisper_global_cache() {
         fill_sin_cos_table();
         fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        fill_fft_factors(WHISPER_N_FFT / 2);
+    }
+
+    // 4s first, then 2s and odd primes: 200 = 4 * 2 * 5 * 5
+    void fill_fft_factors(int n) {
+        int i = 0;
+        for (int p : {4, 2, 3, 5, 7, 11, 13}) {
+            while (n % p == 0) {
+                fft_factors[i++] = p;
+                n /= p;
+            }
+        }
+        WHISPER_ASSERT(n == 1 && "unsupported FFT size");
+        fft_factors[i] = 1;
     }
 
     void fill_sin_cos_table() {
@@ -54,129 +78,243 @@ struct whisper_global_cache {
 } global_cache;
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
-
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
+// mixed-radix decimation-in-time complex FFT of n points, n dividing SIN_COS_N_COUNT
+// in holds interleaved (re, im) pairs read every stride pairs, out receives n contiguous pairs
+// factors lists the radices of n and ends with 1
+static void cfft(const float * in, int stride, float * out, int n, const int * factors) {
+    const float * cos_vals = global_cache.cos_vals;
+    const float * sin_vals = global_cache.sin_vals;
+
+    const int p = factors[0];
+    const int m = n / p;
+    if (m == 1) {
+        // DFT of the last p points
+        for (int r = 0; r < p; r++) {
+            float re = 0;
+            float im = 0;
+            for (int q = 0; q < p; q++) {
+                const int idx = (q * r % p) * (SIN_COS_N_COUNT / p);
+                const float xr = in[2 * q * stride + 0];
+                const float xi = in[2 * q * stride + 1];
+                re += xr * cos_vals[idx] + xi * sin_vals[idx];
+                im += xi * cos_vals[idx] - xr * sin_vals[idx];
+            }
+            out[2 * r + 0] = re;
+            out[2 * r + 1] = im;
         }
+        return;
+    }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+    // sub-transform q of the samples q, q + p, q + 2p, ... goes to out[q*m .. (q+1)*m)
+    for (int q = 0; q < p; q++) {
+        cfft(in + 2 * q * stride, stride * p, out + 2 * q * m, m, factors + 1);
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
+    // X[k + r*m] = sum_q (w_n^(q*k) Y_q[k]) w_p^(q*r), in place: each k reads and writes out[k + q*m] only
+    const int step = SIN_COS_N_COUNT / n;
+    if (p == 2) {
+        for (int k = 0; k < m; k++) {
+            float * a = out + 2 * k;
+            float * b = out + 2 * (k + m);
+            const float wr =  cos_vals[k * step];
+            const float wi = -sin_vals[k * step];
+            const float br = wr * b[0] - wi * b[1];
+            const float bi = wr * b[1] + wi * b[0];
+            b[0] = a[0] - br;
+            b[1] = a[1] - bi;
+            a[0] += br;
+            a[1] += bi;
+        }
         return;
     }
-
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
+    if (p == 4) {
+        for (int k = 0; k < m; k++) {
+            float t[8];
+            for (int q = 0; q < 4; q++) {
+                const float * y = out + 2 * (k + q * m);
+                const float wr =  cos_vals[q * k * step];
+                const float wi = -sin_vals[q * k * step];
+                t[2 * q + 0] = wr * y[0] - wi * y[1];
+                t[2 * q + 1] = wr * y[1] + wi * y[0];
+            }
+            // w_4 = -i
+            const float s0r = t[0] + t[4], s0i = t[1] + t[5];
+            const float d0r = t[0] - t[4], d0i = t[1] - t[5];
+            const float s1r = t[2] + t[6], s1i = t[3] + t[7];
+            const float d1r = t[2] - t[6], d1i = t[3] - t[7];
+            float * x0 = out + 2 * k;
+            float * x1 = out + 2 * (k + m);
+            float * x2 = out + 2 * (k + 2 * m);
+            float * x3 = out + 2 * (k + 3 * m);
+            x0[0] = s0r + s1r; x0[1] = s0i + s1i;
+            x1[0] = d0r + d1i; x1[1] = d0i - d1r;
+            x2[0] = s0r - s1r; x2[1] = s0i - s1i;
+            x3[0] = d0r - d1i; x3[1] = d0i + d1r;
+        }
         return;
     }
-
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
+    GGML_ASSERT(p <= FFT_MAX_RADIX);
+    for (int k = 0; k < m; k++) {
+        float t[2 * FFT_MAX_RADIX];
+        for (int q = 0; q < p; q++) {
+            const float * y = out + 2 * (k + q * m);
+            const float wr =  cos_vals[q * k * step];
+            const float wi = -sin_vals[q * k * step];
+            t[2 * q + 0] = wr * y[0] - wi * y[1];
+            t[2 * q + 1] = wr * y[1] + wi * y[0];
+        }
+        for (int r = 0; r < p; r++) {
+            float re = 0;
+            float im = 0;
+            for (int q = 0; q < p; q++) {
+                const int idx = (q * r % p) * (SIN_COS_N_COUNT / p);
+                re += t[2 * q + 0] * cos_vals[idx] + t[2 * q + 1] * sin_vals[idx];
+                im += t[2 * q + 1] * cos_vals[idx] - t[2 * q + 0] * sin_vals[idx];
+            }
+            out[2 * (k + r * m) + 0] = re;
+            out[2 * (k + r * m) + 1] = im;
+        }
     }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
+}
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
+// power spectrum |X[k]|^2, k = 0 .. WHISPER_N_FFT/2, of a real frame of WHISPER_N_FFT samples
+// the frame is read as WHISPER_N_FFT/2 complex points z[n] = in[2n] + i*in[2n+1], transformed in one
+// complex FFT of half the size, then split into the spectra of the even and odd samples
+// work holds WHISPER_N_FFT floats
+static void rfft_power(const float * in, float * work, float * power) {
+    const int n = WHISPER_N_FFT;
+    const int m = n / 2;
+    cfft(in, 1, work, m, global_cache.fft_factors);
+
+    for (int k = 0; k <= m; k++) {
+        // Z[k] = (a, b), Z[m - k] = (c, d)
+        const float a = work[2 * (k % m) + 0];
+        const float b = work[2 * (k % m) + 1];
+        const float c = work[2 * ((m - k) % m) + 0];
+        const float d = work[2 * ((m - k) % m) + 1];
+        // even = (Z[k] + conj(Z[m - k])) / 2, odd = (Z[k] - conj(Z[m - k])) / 2i
+        const float er = 0.5f * (a + c);
+        const float ei = 0.5f * (b - d);
+        const float or_ = 0.5f * (b + d);
+        const float oi = -0.5f * (a - c);
+        // X[k] = even + w_n^k odd
+        const float wr =  global_cache.cos_vals[k];
+        const float wi = -global_cache.sin_vals[k];
+        const float xr = er + wr * or_ - wi * oi;
+        const float xi = ei + wr * oi + wi * or_;
+        power[k] = xr * xr + xi * xi;
     }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+}
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+// dot product of the nonzero band of a mel filter with the power spectrum
+static float mel_band_dot(const float * filter, const float * power, int n) {
+    int k = 0;
+    float sum = 0.0f;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; k + 4 <= n; k += 4) {
+        acc = vfmaq_f32(acc, vld1q_f32(filter + k), vld1q_f32(power + k));
+    }
+    sum = vaddvq_f32(acc);
+#endif
+    for (; k < n; k++) {
+        sum += filter[k] * power[k];
+    }
+    return sum;
+}
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+// [lo, hi) of the nonzero coefficients of each mel filter, most of a filter row is zero
+struct mel_bands {
+    std::vector<int> lo;
+    std::vector<int> hi;
+
+    explicit mel_bands(const whisper_filters & filters) : lo(filters.n_mel, 0), hi(filters.n_mel, 0) {
+        for (int j = 0; j < filters.n_mel; j++) {
+            const float * row = filters.data.data() + (size_t) j * filters.n_fft;
+            int l = 0;
+            int h = filters.n_fft;
+            while (l < h && row[l] == 0.0f) {
+                l++;
+            }
+            while (h > l && row[h - 1] == 0.0f) {
+                h--;
+            }
+            lo[j] = l;
+            hi[j] = h;
+        }
+    }
+};
+
+// buffers to compute the log-mel column of one frame
+struct mel_frame_buffers {
+    std::vector<float> fft_in;
+    std::vector<float> fft_work;
+    std::vector<float> power;
+
+    explicit mel_frame_buffers(const whisper_filters & filters) :
+        fft_in(WHISPER_N_FFT, 0.0f), fft_work(WHISPER_N_FFT), power(filters.n_fft) {
+        // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+        WHISPER_ASSERT(filters.n_fft == 1 + (WHISPER_N_FFT / 2));
+    }
+};
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+// log10 mel energies of the frame starting at samples, zero-padded after n samples,
+// written to out[j * out_stride] for mel band j
+static void log_mel_frame(const float * samples, int n, const whisper_filters & filters, const mel_bands & bands,
+                          mel_frame_buffers & buf, float * out, size_t out_stride) {
+    const float * hann = global_cache.hann_window;
+    const int n_fft = filters.n_fft;
+    n = std::min(n, WHISPER_N_FFT);
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    // apply Hann window (~10% faster)
+    for (int j = 0; j < n; j++) {
+        buf.fft_in[j] = hann[j] * samples[j];
     }
-}
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    // fill the rest with zeros
+    std::fill(buf.fft_in.begin() + n, buf.fft_in.end(), 0.0f);
 
-    int n_fft = filters.n_fft;
-    int i = ith;
+    // FFT, then modulus^2 of the n_fft bins
+    rfft_power(buf.fft_in.data(), buf.fft_work.data(), buf.power.data());
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    WHISPER_ASSERT(n_fft == 1 + (frame_size / 2));
-
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+    // mel spectrogram
+    for (int j = 0; j < filters.n_mel; j++) {
+        const int lo = bands.lo[j];
+        const float sum = mel_band_dot(filters.data.data() + (size_t) j * n_fft + lo, buf.power.data() + lo, bands.hi[j] - lo);
+        out[j * out_stride] = log10(std::max((double) sum, 1e-10));
+    }
+}
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
+// clamp to 8 (log10) below the maximum and scale, ref: whisper/audio.py
+static void log_mel_normalize(whisper_mel & mel) {
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
         }
+    }
+
+    mmax -= 8.0;
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
         }
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
+}
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> & samples,
+                                              int n_samples, int frame_step, int n_threads,
+                                              const whisper_filters & filters, const mel_bands & bands, whisper_mel & mel) {
+    mel_frame_buffers buf(filters);
+    int i = ith;
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+        log_mel_frame(samples.data() + offset, n_samples - offset, filters, bands, buf, mel.data.data() + i, mel.n_len);
     }
 
     // Otherwise fft_out are all zero
@@ -202,9 +340,7 @@ static bool log_mel_spectrogram(
         whisper_mel & mel) {
     //const int64_t t_start_us = ggml_time_us();
 
-    // Hann window
     WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
-    const float * hann = global_cache.hann_window;
 
     // Calculate the length of padding
     int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
@@ -229,17 +365,18 @@ static bool log_mel_spectrogram(
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
+    const mel_bands bands(filters);
     {
         std::vector<std::thread> workers(n_threads - 1);
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(samples_padded),
+                    n_samples + stage_2_pad, frame_step, n_threads,
+                    std::cref(filters), std::cref(bands), std::ref(mel));
         }
 
         // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        log_mel_spectrogram_worker_thread(0, samples_padded, n_samples + stage_2_pad, frame_step, n_threads, filters, bands, mel);
 
         for (int iw = 0; iw < n_threads - 1; ++iw) {
             workers[iw].join();
@@ -247,22 +384,7 @@ static bool log_mel_spectrogram(
     }
 
     // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
-
-    mmax -= 8.0;
-
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    log_mel_normalize(mel);
 
     // Dump log_mel_spectrogram
     if (debug) {
@@ -282,6 +404,7 @@ bool preprocess_audio(
         const float * samples,
         size_t n_samples,
         const whisper_filters & filters,
+        int n_threads,
         std::vector<whisper_mel> & output) {
 
     if (n_samples == 0) {
@@ -297,7 +420,7 @@ bool preprocess_audio(
                 WHISPER_N_FFT,
                 WHISPER_HOP_LENGTH,
                 filters.n_mel,
-                4, // n_threads
+                std::max(1, n_threads),
                 filters,
                 false, // debug
                 out_full);
@@ -333,6 +456,100 @@ bool preprocess_audio(
     return true;
 }
 
+struct whisper_mel_stream::impl {
+    const whisper_filters & filters;
+    const int n_frames;
+    mel_bands bands;
+    mel_frame_buffers buf;
+
+    bool started = false;
+    std::vector<float> head;    // first samples, until there are enough for the reflective padding
+    std::vector<float> pending; // padded samples from the start of the next frame on
+    whisper_mel cur;            // chunk being filled, n_cur frames so far
+    int n_cur = 0;
+
+    impl(const whisper_filters & filters, int n_frames) : filters(filters), n_frames(n_frames), bands(filters), buf(filters) {
+        cur.n_mel     = filters.n_mel;
+        cur.n_len     = n_frames;
+        cur.n_len_org = n_frames;
+        cur.data.resize((size_t) cur.n_mel * n_frames);
+    }
+
+    void add_frame(const float * samples, int n, std::vector<whisper_mel> & output) {
+        log_mel_frame(samples, n, filters, bands, buf, cur.data.data() + n_cur, n_frames);
+        if (++n_cur == n_frames) {
+            log_mel_normalize(cur);
+            output.push_back(cur);
+            n_cur = 0;
+        }
+    }
+
+    // reflective pad of WHISPER_N_FFT / 2 samples at the beginning of audio
+    void start() {
+        const int pad = WHISPER_N_FFT / 2;
+        pending.assign(pad, 0.0f);
+        const int n_reflect = std::min(pad, (int) head.size() - 1);
+        for (int i = 0; i < n_reflect; i++) {
+            pending[pad - 1 - i] = head[1 + i];
+        }
+        pending.insert(pending.end(), head.begin(), head.end());
+        head.clear();
+        started = true;
+    }
+};
+
+whisper_mel_stream::whisper_mel_stream(const whisper_filters & filters, int n_frames) : pimpl(new impl(filters, n_frames)) {}
+
+whisper_mel_stream::~whisper_mel_stream() = default;
+
+void whisper_mel_stream::push(const float * samples, size_t n_samples, std::vector<whisper_mel> & output) {
+    impl & s = *pimpl;
+    if (!s.started) {
+        s.head.insert(s.head.end(), samples, samples + n_samples);
+        if (s.head.size() <= WHISPER_N_FFT / 2) {
+            return;
+        }
+        s.start();
+    } else {
+        s.pending.insert(s.pending.end(), samples, samples + n_samples);
+    }
+
+    // every frame with all of its samples, the overlap stays for the next call
+    size_t off = 0;
+    for (; off + WHISPER_N_FFT <= s.pending.size(); off += WHISPER_HOP_LENGTH) {
+        s.add_frame(s.pending.data() + off, WHISPER_N_FFT, output);
+    }
+    s.pending.erase(s.pending.begin(), s.pending.begin() + off);
+}
+
+void whisper_mel_stream::finish(std::vector<whisper_mel> & output) {
+    impl & s = *pimpl;
+    if (!s.started) {
+        if (s.head.empty()) {
+            return;
+        }
+        s.start();
+    }
+
+    // the frames that overlap the end of audio are zero-padded, like the tail of preprocess_audio()
+    for (size_t off = 0; off <= s.pending.size(); off += WHISPER_HOP_LENGTH) {
+        s.add_frame(s.pending.data() + off, s.pending.size() - off, output);
+    }
+    if (s.n_cur > 0) {
+        // silent frames up to a full chunk
+        const float silence = log10(1e-10);
+        for (int j = 0; j < s.cur.n_mel; j++) {
+            std::fill(s.cur.data.begin() + (size_t) j * s.n_frames + s.n_cur,
+                      s.cur.data.begin() + (size_t) (j + 1) * s.n_frames, silence);
+        }
+        log_mel_normalize(s.cur);
+        output.push_back(s.cur);
+        s.n_cur = 0;
+    }
+    s.pending.clear();
+    s.started = false;
+}
+
 } // namespace whisper_preprocessor
 
 
@@ -3,6 +3,7 @@
 #include "ggml.h"
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -32,12 +33,34 @@ struct whisper_filters {
     std::vector<float> data;
 };
 
+// n_threads compute the frames of the spectrogram in parallel
 bool preprocess_audio(
         const float * samples,
         size_t n_samples,
         const whisper_filters & filters,
+        int n_threads,
         std::vector<whisper_mel> & output);
 
+// incremental log-mel spectrogram of audio that is still being recorded
+// frames overlap by WHISPER_N_FFT - WHISPER_HOP_LENGTH samples, which are kept between calls to push()
+// note: each chunk of n_frames is normalized on its own, as whisper does per 30 s window,
+//       while preprocess_audio() normalizes the whole clip at once
+struct whisper_mel_stream {
+    whisper_mel_stream(const whisper_filters & filters, int n_frames);
+    ~whisper_mel_stream();
+
+    // appends the chunks completed by these samples to output
+    void push(const float * samples, size_t n_samples, std::vector<whisper_mel> & output);
+
+    // pads the last frames with silence to a full chunk and appends it to output, if any audio is left
+    // the stream can then be reused for new audio
+    void finish(std::vector<whisper_mel> & output);
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
 } // namespace whisper_preprocessor
 
 namespace whisper_precalc_filters {
@@ -9,10 +9,16 @@
 
 #include "mtmd.h"
 #include "mtmd-helper.h"
+#include "mtmd-trace.h"
 #include "llama.h"
 
 #include <algorithm>
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 //#define MTMD_AUDIO_DEBUG
@@ -174,6 +180,7 @@ int32_t mtmd_helper_decode_image_chunk(
         llama_seq_id seq_id,
         int32_t n_batch,
         llama_pos * new_n_past) {
+    MTMD_TRACE_SCOPE("mtmd_decode_image");
     auto chunk_type = mtmd_input_chunk_get_type(chunk);
     const char * name = chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE ? "image" : "audio";
     if (chunk_type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
@@ -186,6 +193,7 @@ int32_t mtmd_helper_decode_image_chunk(
     int n_pos_per_embd = mtmd_decode_use_mrope(ctx) ? 4 : 1;
 
     int32_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+    MTMD_TRACE_ADD(MTMD_TRACE_PROMPT_TOKENS, n_tokens);
     int32_t i_batch = 0;
     int32_t n_img_batches = GGML_PAD(n_tokens, n_batch) / n_batch;
     decode_embd_batch batch_embd(encoded_embd, n_tokens, n_pos_per_embd, n_mmproj_embd);
@@ -259,6 +267,8 @@ int32_t mtmd_helper_eval_chunk_single(mtmd_context * ctx,
         size_t n_tokens;
         const auto tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
         // LOG_INF("decoding text chunk, n_tokens = %zu\n", n_tokens);
+        MTMD_TRACE_SCOPE("mtmd_decode_text");
+        MTMD_TRACE_ADD(MTMD_TRACE_PROMPT_TOKENS, n_tokens);
         size_t i = 0;
         while (i < n_tokens) { // split into batches
             text_batch.n_tokens = 0; // clear the batch
@@ -289,19 +299,24 @@ int32_t mtmd_helper_eval_chunk_single(mtmd_context * ctx,
         const char * name = chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE ? "image" : "audio";
         int64_t t0 = ggml_time_ms();
 
-        LOG_INF("encoding %s slice...\n", name);
-
-        ret = mtmd_encode_chunk(ctx, chunk);
-        if (ret != 0) {
-            LOG_ERR("failed to encode %s slice\n", name);
-            llama_batch_free(text_batch);
-            return ret;
-        }
+        // reuse the embeddings of an image seen before; both paths copy them out under a lock,
+        // so another thread encoding or trimming the cache cannot change them while decoding
+        std::vector<float> embd((size_t) mtmd_input_chunk_get_n_tokens(chunk) * llama_model_n_embd(llama_get_model(lctx)));
+        if (mtmd_embd_cache_get(ctx, chunk, embd.data())) {
+            LOG_INF("%s slice found in embedding cache\n", name);
+        } else {
+            LOG_INF("encoding %s slice...\n", name);
 
-        LOG_INF("%s slice encoded in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
+            ret = mtmd_encode_chunk_to(ctx, chunk, embd.data());
+            if (ret != 0) {
+                LOG_ERR("failed to encode %s slice\n", name);
+                llama_batch_free(text_batch);
+                return ret;
+            }
 
-        float * embd = mtmd_get_output_embd(ctx);
-        ret = mtmd_helper_decode_image_chunk(ctx, lctx, chunk, embd, n_past, seq_id, n_batch, new_n_past);
+            LOG_INF("%s slice encoded in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
+        }
+        ret = mtmd_helper_decode_image_chunk(ctx, lctx, chunk, embd.data(), n_past, seq_id, n_batch, new_n_past);
         if (ret != 0) {
             LOG_ERR("failed to decode %s\n", name);
             llama_batch_free(text_batch);
@@ -344,6 +359,201 @@ int32_t mtmd_helper_eval_chunks(mtmd_context * ctx,
     return 0;
 }
 
+//
+// encode pipeline
+//
+
+namespace {
+
+struct pipeline_job {
+    const mtmd_input_chunks * chunks;
+    std::vector<std::vector<float>> embd; // one entry per chunk, empty for text chunks
+    size_t n_done = 0;   // chunks [0, n_done) have been processed by the worker
+    bool failed   = false;
+    bool busy     = false; // the worker is encoding chunk n_done
+};
+
+} // namespace
+
+struct mtmd_helper_pipeline {
+    mtmd_context * ctx;
+    int n_embd;
+    size_t max_pending;
+
+    std::mutex mutex;
+    std::condition_variable cv_work; // a job was submitted, or stop
+    std::condition_variable cv_done; // a chunk was processed, or a job was released
+    std::deque<std::unique_ptr<pipeline_job>> jobs; // in submission order
+    bool stop = false;
+    std::thread worker;
+
+    // must be called with the mutex held
+    pipeline_job * find(const mtmd_input_chunks * chunks) {
+        for (auto & job : jobs) {
+            if (job->chunks == chunks) {
+                return job.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // must be called with the mutex held
+    pipeline_job * next_pending() {
+        for (auto & job : jobs) {
+            if (!job->failed && job->n_done < job->embd.size()) {
+                return job.get();
+            }
+        }
+        return nullptr;
+    }
+
+    void run() {
+        while (true) {
+            pipeline_job * job;
+            const mtmd_input_chunk * chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [&] { return stop || next_pending() != nullptr; });
+                if (stop) {
+                    return;
+                }
+                job = next_pending();
+                job->busy = true;
+                chunk = mtmd_input_chunks_get(job->chunks, job->n_done);
+            }
+
+            bool ok = true;
+            std::vector<float> embd;
+            if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                int64_t t0 = ggml_time_ms();
+                // copied under the encode lock, the caller thread may encode in the meantime
+                embd.resize((size_t) mtmd_input_chunk_get_n_tokens(chunk) * n_embd);
+                ok = mtmd_encode_chunk_to(ctx, chunk, embd.data()) == 0;
+                if (ok) {
+                    LOG_INF("pipeline: slice encoded in %" PRId64 " ms\n", ggml_time_ms() - t0);
+                } else {
+                    LOG_ERR("pipeline: failed to encode slice\n");
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok) {
+                    job->embd[job->n_done] = std::move(embd);
+                    job->n_done++;
+                } else {
+                    job->failed = true;
+                }
+                job->busy = false;
+            }
+            cv_done.notify_all();
+        }
+    }
+};
+
+mtmd_helper_pipeline * mtmd_helper_pipeline_init(mtmd_context * ctx,
+                                                 const struct llama_model * model,
+                                                 int32_t max_pending) {
+    if (!ctx || !model || max_pending <= 0) {
+        LOG_ERR("%s: invalid arguments\n", __func__);
+        return nullptr;
+    }
+    auto * pl = new mtmd_helper_pipeline();
+    pl->ctx         = ctx;
+    pl->n_embd      = llama_model_n_embd(model);
+    pl->max_pending = (size_t) max_pending;
+    pl->worker      = std::thread([pl] { pl->run(); });
+    return pl;
+}
+
+void mtmd_helper_pipeline_free(mtmd_helper_pipeline * pl) {
+    if (!pl) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pl->mutex);
+        pl->stop = true;
+    }
+    pl->cv_work.notify_all();
+    pl->worker.join();
+    delete pl;
+}
+
+int32_t mtmd_helper_pipeline_submit(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks) {
+    {
+        std::lock_guard<std::mutex> lock(pl->mutex);
+        if (pl->jobs.size() >= pl->max_pending) {
+            return 1;
+        }
+        auto job = std::make_unique<pipeline_job>();
+        job->chunks = chunks;
+        job->embd.resize(mtmd_input_chunks_size(chunks));
+        pl->jobs.push_back(std::move(job));
+    }
+    pl->cv_work.notify_one();
+    return 0;
+}
+
+float * mtmd_helper_pipeline_get_embd(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks, size_t i) {
+    std::unique_lock<std::mutex> lock(pl->mutex);
+    pipeline_job * job = pl->find(chunks);
+    if (!job || i >= job->embd.size()) {
+        LOG_ERR("%s: chunks were not submitted\n", __func__);
+        return nullptr;
+    }
+    pl->cv_done.wait(lock, [&] { return job->failed || job->n_done > i; });
+    if (job->n_done <= i || job->embd[i].empty()) {
+        return nullptr;
+    }
+    return job->embd[i].data();
+}
+
+void mtmd_helper_pipeline_release(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks) {
+    {
+        std::unique_lock<std::mutex> lock(pl->mutex);
+        pipeline_job * job = pl->find(chunks);
+        if (!job) {
+            return;
+        }
+        pl->cv_done.wait(lock, [&] { return !job->busy; });
+        pl->jobs.erase(std::find_if(pl->jobs.begin(), pl->jobs.end(),
+                                    [&](const std::unique_ptr<pipeline_job> & j) { return j.get() == job; }));
+    }
+    pl->cv_done.notify_all();
+}
+
+int32_t mtmd_helper_pipeline_eval_chunks(mtmd_helper_pipeline * pl,
+                                         struct llama_context * lctx,
+                                         const mtmd_input_chunks * chunks,
+                                         llama_pos n_past,
+                                         llama_seq_id seq_id,
+                                         int32_t n_batch,
+                                         bool logits_last,
+                                         llama_pos * new_n_past) {
+    size_t n_chunks = mtmd_input_chunks_size(chunks);
+    int32_t res = 0;
+
+    for (size_t i = 0; i < n_chunks; i++) {
+        bool chunk_logits_last = (i == n_chunks - 1) && logits_last;
+        auto chunk = mtmd_input_chunks_get(chunks, i);
+
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            res = mtmd_helper_eval_chunk_single(pl->ctx, lctx, chunk, n_past, seq_id, n_batch, chunk_logits_last, &n_past);
+        } else {
+            float * embd = mtmd_helper_pipeline_get_embd(pl, chunks, i);
+            res = embd ? mtmd_helper_decode_image_chunk(pl->ctx, lctx, chunk, embd, n_past, seq_id, n_batch, &n_past) : 1;
+        }
+        if (res != 0) {
+            LOG_ERR("failed to eval chunk %zu\n", i);
+            break;
+        }
+        *new_n_past = n_past;
+    }
+
+    mtmd_helper_pipeline_release(pl, chunks);
+    return res;
+}
+
 namespace audio_helpers {
 
 static bool is_audio_file(const char * buf, size_t len) {
@@ -80,6 +80,45 @@ MTMD_API int32_t mtmd_helper_decode_image_chunk(mtmd_context * ctx,
                                                 int32_t n_batch,
                                                 llama_pos * new_n_past);
 
+// encode pipeline
+// a background worker runs mtmd_encode_chunk() on the media chunks of submitted prompts,
+// so the vision encoder can work on the next frame while the text model is still generating
+// for the current one
+// while a pipeline is alive, mtmd_encode*() and mtmd_helper_eval_chunk*() must not be called
+// on the same mtmd_context from other threads
+typedef struct mtmd_helper_pipeline mtmd_helper_pipeline;
+
+// model is the text model, used to size the embedding buffers
+// max_pending is the number of submitted prompts that may wait for mtmd_helper_pipeline_release()
+// returns nullptr on failure
+MTMD_API mtmd_helper_pipeline * mtmd_helper_pipeline_init(mtmd_context * ctx,
+                                                          const struct llama_model * model,
+                                                          int32_t max_pending);
+MTMD_API void mtmd_helper_pipeline_free(mtmd_helper_pipeline * pl);
+
+// queue the media chunks of a prompt for encoding; chunks must stay alive until released
+// returns 0 on success, 1 if max_pending prompts are already queued
+MTMD_API int32_t mtmd_helper_pipeline_submit(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks);
+
+// wait for media chunk i of submitted chunks to be encoded
+// returns the embeddings (owned by the pipeline, valid until release), or nullptr if encoding failed
+MTMD_API float * mtmd_helper_pipeline_get_embd(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks, size_t i);
+
+// forget submitted chunks, waiting for the worker if it is encoding one of them
+MTMD_API void mtmd_helper_pipeline_release(mtmd_helper_pipeline * pl, const mtmd_input_chunks * chunks);
+
+// works like mtmd_helper_eval_chunks() on submitted chunks, using the embeddings computed by the worker
+// the chunks are released before returning
+// this function is NOT thread-safe (one caller per pipeline)
+MTMD_API int32_t mtmd_helper_pipeline_eval_chunks(mtmd_helper_pipeline * pl,
+                                                  struct llama_context * lctx,
+                                                  const mtmd_input_chunks * chunks,
+                                                  llama_pos n_past,
+                                                  llama_seq_id seq_id,
+                                                  int32_t n_batch,
+                                                  bool logits_last,
+                                                  llama_pos * new_n_past);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,61 @@
+#pragma once
+
+// Tracing of the inference hot paths, shared by mtmd, clip and the JNI layer
+//
+// Built with -DLLAMA_ANDROID_TRACE=ON (gradle: -PllamaTrace=ON), MTMD_TRACE_SCOPE() emits an
+// ATrace section that shows up in Perfetto / systrace, and MTMD_TRACE_ADD() bumps a relaxed
+// atomic counter. Without it both macros expand to nothing, so the default build pays nothing.
+
+#include <cstdint>
+
+#ifdef MTMD_TRACE
+#include <atomic>
+#ifdef __ANDROID__
+#include <android/trace.h>
+#endif
+#endif
+
+// keep in sync with android.llama.cpp.TraceCounters
+enum mtmd_trace_counter {
+    MTMD_TRACE_FRAMES,              // bitmaps tokenized (camera frames, photos, audio clips)
+    MTMD_TRACE_IMAGES_ENCODED,      // images run through the vision encoder
+    MTMD_TRACE_EMBD_CACHE_HITS,     // images whose embeddings came from the cache
+    MTMD_TRACE_PROMPT_TOKENS,       // text and image tokens decoded as prompt
+    MTMD_TRACE_GENERATED_TOKENS,    // tokens sampled by the generation loops
+    MTMD_TRACE_PREFIX_CACHE_TOKENS, // prompt tokens reused from the KV cache
+    MTMD_TRACE_ENCODER_GRAPHS,      // encoder graphs built and allocated, once per new image size
+    MTMD_TRACE_BYTES_ALLOCATED,     // bytes of image embedding buffers allocated
+    MTMD_TRACE_N_COUNTERS,
+};
+
+#ifdef MTMD_TRACE
+
+inline std::atomic<int64_t> g_mtmd_trace_counters[MTMD_TRACE_N_COUNTERS];
+
+struct mtmd_trace_scope {
+    explicit mtmd_trace_scope(const char * name) {
+#ifdef __ANDROID__
+        ATrace_beginSection(name);
+#else
+        (void) name;
+#endif
+    }
+    ~mtmd_trace_scope() {
+#ifdef __ANDROID__
+        ATrace_endSection();
+#endif
+    }
+};
+
+#define MTMD_TRACE_CAT_(a, b) a##b
+#define MTMD_TRACE_CAT(a, b) MTMD_TRACE_CAT_(a, b)
+#define MTMD_TRACE_SCOPE(name) mtmd_trace_scope MTMD_TRACE_CAT(mtmd_trace_scope_, __LINE__)(name)
+#define MTMD_TRACE_ADD(counter, n) \
+    g_mtmd_trace_counters[counter].fetch_add((int64_t) (n), std::memory_order_relaxed)
+
+#else
+
+#define MTMD_TRACE_SCOPE(name) ((void) 0)
+#define MTMD_TRACE_ADD(counter, n) ((void) 0)
+
+#endif
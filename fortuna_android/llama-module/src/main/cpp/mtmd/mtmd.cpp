@@ -2,15 +2,24 @@
 #include "clip-impl.h"
 #include "mtmd.h"
 #include "mtmd-audio.h"
+#include "mtmd-trace.h"
 
 #include "llama.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // represents raw image data, layout is RGBRGBRGB...
@@ -21,6 +30,10 @@ struct mtmd_bitmap {
     std::vector<unsigned char> data;
     std::string id; // optional user-defined id, for ex: can be set to image hash, useful for KV cache tracking
     bool is_audio = false; // true if the bitmap is audio
+
+    // audio from mtmd_audio_stream_finish(): its mel chunks, and their embeddings computed while streaming
+    std::vector<whisper_preprocessor::whisper_mel> audio_mel;
+    std::vector<std::vector<float>> audio_embd;
 };
 
 struct mtmd_image_tokens {
@@ -30,6 +43,7 @@ struct mtmd_image_tokens {
     uint32_t n_tokens() const { return nx * ny; }
     clip_image_f32_batch batch_f32; // preprocessed image patches
     std::string id; // optional user-defined ID, useful for KV cache tracking
+    std::string cache_key; // key in the embedding cache, empty if the cache is disabled
 
     mtmd_image_tokens clone() {
         return mtmd_image_tokens{
@@ -37,7 +51,8 @@ struct mtmd_image_tokens {
             ny,
             use_mrope_pos,
             batch_f32.clone(),
-            id
+            id,
+            cache_key
         };
     }
 };
@@ -47,12 +62,14 @@ struct mtmd_audio_tokens {
     uint32_t n_tokens; // number of tokens
     clip_image_f32_batch batch_f32; // preprocessed image patches
     std::string id; // optional user-defined ID, useful for KV cache tracking
+    std::vector<float> embd; // encoder output computed ahead of mtmd_encode_chunk(), empty if not
 
     mtmd_audio_tokens clone() {
         return mtmd_audio_tokens{
             n_tokens,
             batch_f32.clone(),
-            id
+            id,
+            embd
         };
     }
 };
@@ -79,6 +96,99 @@ enum mtmd_slice_tmpl {
     MTMD_SLICE_TMPL_IDEFICS3,
 };
 
+// LRU cache of encoder outputs, bounded by a byte budget
+struct mtmd_embd_cache {
+    using entry = std::pair<std::string, std::vector<float>>;
+
+    std::atomic<size_t> budget{0}; // in bytes, may be lowered by mtmd_embd_cache_set_budget()
+    size_t used   = 0; // in bytes
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> index;
+    std::mutex mutex;
+
+    bool enabled() const {
+        return budget > 0;
+    }
+
+    // on hit, copies the entry to out while it cannot be evicted and marks it as most recently used
+    bool get(const std::string & key, float * out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        const std::vector<float> & embd = it->second->second;
+        std::copy(embd.begin(), embd.end(), out);
+        return true;
+    }
+
+    void put(const std::string & key, const std::vector<float> & embd) {
+        const size_t n_bytes = embd.size() * sizeof(float);
+        if (n_bytes > budget) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            used -= it->second->second.size() * sizeof(float);
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        while (used + n_bytes > budget && !lru.empty()) {
+            used -= lru.back().second.size() * sizeof(float);
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        lru.emplace_front(key, embd);
+        index[key] = lru.begin();
+        used += n_bytes;
+    }
+
+    // evicts the least recently used entries until the cache fits the new budget
+    void set_budget(size_t n_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = n_bytes;
+        while (used > n_bytes && !lru.empty()) {
+            used -= lru.back().second.size() * sizeof(float);
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.clear();
+        index.clear();
+        used = 0;
+    }
+};
+
+// cheap content hash, only used as a cache key
+static std::string mtmd_bitmap_hash(const mtmd_bitmap * bitmap) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (((uint64_t) bitmap->nx << 32) | bitmap->ny);
+    const unsigned char * p = bitmap->data.data();
+    const size_t n = bitmap->data.size();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) h);
+    return buf;
+}
+
 const char * mtmd_default_marker() {
     return "<__media__>";
 }
@@ -91,19 +201,29 @@ mtmd_context_params mtmd_context_params_default() {
     params.verbosity = GGML_LOG_LEVEL_INFO;
     params.image_marker = MTMD_DEFAULT_IMAGE_MARKER;
     params.media_marker = mtmd_default_marker();
+    params.embd_cache_size = 0;
+    params.image_pool = 1;
     return params;
 }
 
 struct mtmd_context {
     struct clip_ctx * ctx_v; // vision
     struct clip_ctx * ctx_a; // audio
-    const struct llama_model * text_model;
+    const struct llama_model * text_model = nullptr; // may be attached after loading the mmproj
     std::vector<float> image_embd_v; // image embedding vector
+    std::vector<float> image_embd_raw; // encoder output before pooling
 
     bool print_timings;
-    int n_threads;
+    std::atomic<int> n_threads; // may be lowered by mtmd_set_n_threads() while a worker encodes
     std::string media_marker;
-    const int n_embd_text;
+    int n_embd_text = 0;
+    int image_pool = 1;
+
+    mtmd_embd_cache embd_cache;
+
+    // encoders may run on a worker thread while the app releases memory from another one
+    std::mutex encode_mutex;
+    std::atomic<bool> low_memory{false}; // release the encoder compute buffers after each encode
 
     // these are not token, but strings used to mark the beginning and end of image/audio embeddings
     std::string img_beg;
@@ -129,6 +249,9 @@ struct mtmd_context {
 
     // string template for slice image delimiters with row/col (idefics3)
     std::string sli_img_start_tmpl;
+    // its tokens per (row, col), tokenized on first use; entries are never erased
+    std::mutex sli_img_start_mutex;
+    std::map<std::pair<int, int>, std::vector<llama_token>> tok_sli_img_start_grid;
 
     // for whisper, we pre-calculate the mel filter bank
     whisper_preprocessor::whisper_filters w_filters;
@@ -138,11 +261,9 @@ struct mtmd_context {
     mtmd_context(const char * mmproj_fname,
                    const llama_model * text_model,
                    const mtmd_context_params & ctx_params) :
-        text_model   (text_model),
         print_timings(ctx_params.print_timings),
         n_threads    (ctx_params.n_threads),
-        media_marker (ctx_params.media_marker),
-        n_embd_text  (llama_model_n_embd(text_model))
+        media_marker (ctx_params.media_marker)
     {
         if (std::string(ctx_params.image_marker) != MTMD_DEFAULT_IMAGE_MARKER) {
             throw std::runtime_error("custom image_marker is not supported anymore, use media_marker instead");
@@ -152,9 +273,13 @@ struct mtmd_context {
             throw std::runtime_error("media_marker must not be empty");
         }
 
+        embd_cache.budget = ctx_params.embd_cache_size;
+        image_pool = std::max(1, ctx_params.image_pool);
+
         clip_context_params ctx_clip_params;
         ctx_clip_params.use_gpu   = ctx_params.use_gpu;
         ctx_clip_params.verbosity = ctx_params.verbosity;
+        ctx_clip_params.n_threads = ctx_params.n_threads;
         auto res = clip_init(mmproj_fname, ctx_clip_params);
         ctx_v = res.ctx_v;
         ctx_a = res.ctx_a;
@@ -173,15 +298,25 @@ struct mtmd_context {
             }
         }
 
+        if (text_model) {
+            set_text_model(text_model);
+        }
+    }
+
+    // the special tokens of the media templates come from the text model vocab
+    void set_text_model(const llama_model * model) {
         // since we already validate n_embd of vision and audio mmproj,
         // we can safely assume that they are the same
+        int n_embd_model = llama_model_n_embd(model);
         int n_embd_clip = clip_n_mmproj_embd(ctx_v ? ctx_v : ctx_a);
-        if (n_embd_text != n_embd_clip) {
+        if (n_embd_model != n_embd_clip) {
             throw std::runtime_error(string_format(
                 "mismatch between text model (n_embd = %d) and mmproj (n_embd = %d)\n"
                 "hint: you may be using wrong mmproj\n",
-                n_embd_text, n_embd_clip));
+                n_embd_model, n_embd_clip));
         }
+        text_model  = model;
+        n_embd_text = n_embd_model;
         if (ctx_v) {
             init_vision();
         }
@@ -363,93 +498,225 @@ mtmd_context * mtmd_init_from_file(const char * mmproj_fname,
     }
 }
 
+mtmd_context * mtmd_init_from_file_deferred(const char * mmproj_fname,
+        const struct mtmd_context_params ctx_params) {
+    try {
+        return new mtmd_context(mmproj_fname, nullptr, ctx_params);
+    } catch (const std::exception & e) {
+        LOG_ERR("%s: error: %s\n", __func__, e.what());
+        return nullptr;
+    }
+}
+
+int32_t mtmd_set_text_model(mtmd_context * ctx, const struct llama_model * text_model) {
+    if (ctx->text_model) {
+        LOG_ERR("%s: error: text model already set\n", __func__);
+        return 1;
+    }
+    try {
+        ctx->set_text_model(text_model);
+    } catch (const std::exception & e) {
+        LOG_ERR("%s: error: %s\n", __func__, e.what());
+        return 1;
+    }
+    return 0;
+}
+
 void mtmd_free(mtmd_context * ctx) {
     if (ctx) {
         delete ctx;
     }
 }
 
+void mtmd_set_threadpool(mtmd_context * ctx, ggml_threadpool_t threadpool) {
+    if (ctx->ctx_v) {
+        clip_set_threadpool(ctx->ctx_v, threadpool);
+    }
+    if (ctx->ctx_a) {
+        clip_set_threadpool(ctx->ctx_a, threadpool);
+    }
+}
+
+void mtmd_set_n_threads(mtmd_context * ctx, int n_threads) {
+    ctx->n_threads = std::max(1, n_threads);
+}
+
+// output tokens of one preprocessed image, before and after spatial pooling
+// images whose output has no 2D layout keep all their tokens (pool = 1)
+struct mtmd_image_grid {
+    int nx;
+    int ny;
+    int pool;
+
+    int pooled_nx() const { return (nx + pool - 1) / pool; }
+    int pooled_ny() const { return (ny + pool - 1) / pool; }
+    int n_raw() const { return nx * ny; }
+    int n_tokens() const { return pooled_nx() * pooled_ny(); }
+};
+
+static mtmd_image_grid mtmd_image_grid_get(mtmd_context * ctx, clip_image_f32 * img) {
+    mtmd_image_grid grid{0, 1, 1};
+    if (ctx->image_pool > 1 && clip_n_output_grid(ctx->ctx_v, img, &grid.nx, &grid.ny)) {
+        grid.pool = ctx->image_pool;
+    } else {
+        grid.nx = clip_n_output_tokens(ctx->ctx_v, img);
+        grid.ny = 1;
+    }
+    return grid;
+}
+
+// average each pool x pool block of src (row-major, grid.nx * grid.ny tokens) into one token of dst
+// blocks on the right and bottom edges may be smaller
+static void mtmd_image_grid_pool(const mtmd_image_grid & grid, int n_embd, const float * src, float * dst) {
+    const int p = grid.pool;
+    for (int py = 0; py < grid.pooled_ny(); py++) {
+        for (int px = 0; px < grid.pooled_nx(); px++) {
+            float * out = dst + (size_t)(py * grid.pooled_nx() + px) * n_embd;
+            std::fill(out, out + n_embd, 0.0f);
+            const int y1 = std::min(grid.ny, (py + 1) * p);
+            const int x1 = std::min(grid.nx, (px + 1) * p);
+            for (int y = py * p; y < y1; y++) {
+                for (int x = px * p; x < x1; x++) {
+                    const float * in = src + (size_t)(y * grid.nx + x) * n_embd;
+                    for (int i = 0; i < n_embd; i++) {
+                        out[i] += in[i];
+                    }
+                }
+            }
+            const float scale = 1.0f / (float)((y1 - py * p) * (x1 - px * p));
+            for (int i = 0; i < n_embd; i++) {
+                out[i] *= scale;
+            }
+        }
+    }
+}
+
+// a prompt template split at its media markers, with the text parts tokenized once
+struct mtmd_prompt {
+    struct part {
+        bool is_marker;
+        std::vector<llama_token> tokens; // empty for a marker
+    };
+    std::vector<part> parts; // BOS and EOS included
+    size_t n_markers = 0;
+
+    // media delimiters of the model
+    std::vector<llama_token> img_beg;
+    std::vector<llama_token> img_end;
+    std::vector<llama_token> aud_beg;
+    std::vector<llama_token> aud_end;
+};
+
 struct mtmd_tokenizer {
     mtmd_context * ctx;
-    std::vector<const mtmd_bitmap *> bitmaps;
-
-    std::string input_text;
-    bool add_special;
-    bool parse_special;
+    const mtmd_prompt & prompt;
+    const mtmd_bitmap ** bitmaps;
+    size_t n_bitmaps;
     const llama_vocab * vocab;
 
-    mtmd_input_chunks cur;
+    // the entries of the output are reused: [0, n_cur) is the new prompt, the rest is left from the last call
+    mtmd_input_chunks & cur;
+    size_t n_cur = 0;
 
     mtmd_tokenizer(mtmd_context * ctx,
-            const mtmd_input_text * text,
+            const mtmd_prompt & prompt,
             const mtmd_bitmap ** bitmaps,
-            size_t n_bitmaps) : ctx(ctx), bitmaps(bitmaps, bitmaps + n_bitmaps) {
-        add_special   = text->add_special;
-        parse_special = text->parse_special;
-        input_text    = text->text;
-        vocab         = llama_model_get_vocab(ctx->text_model);
+            size_t n_bitmaps,
+            mtmd_input_chunks & output) : ctx(ctx), prompt(prompt), bitmaps(bitmaps), n_bitmaps(n_bitmaps), cur(output) {
+        vocab = llama_model_get_vocab(ctx->text_model);
+    }
+
+    static void compile(mtmd_context * ctx, const mtmd_input_text * text, mtmd_prompt & prompt) {
+        const llama_vocab * vocab = llama_model_get_vocab(ctx->text_model);
+        std::string input_text = text->text;
 
         // for compatibility, we convert image marker to media marker
         string_replace_all(input_text, MTMD_DEFAULT_IMAGE_MARKER, ctx->media_marker);
-    }
 
-    int32_t tokenize(mtmd_input_chunks * output) {
-        cur.entries.clear();
-        std::vector<std::string> parts = split_text(input_text, ctx->media_marker);
-        size_t i_bm = 0; // index of the current bitmap
-        for (auto & part : parts) {
-            if (part == ctx->media_marker) {
-                // this is a marker, we should add the next bitmap
-                if (i_bm >= bitmaps.size()) {
-                    LOG_ERR("%s: error: number of bitmaps (%zu) does not match number of markers (%zu)\n",
-                            __func__, bitmaps.size(), parts.size() - 1);
-                    return 1;
-                }
-                const mtmd_bitmap * bitmap = bitmaps[i_bm++];
-                int32_t res = add_media(bitmap);
-                if (res != 0) {
-                    return res;
-                }
+        prompt.parts.clear();
+        prompt.n_markers = 0;
+        auto add_tokens = [&](const std::vector<llama_token> & tokens) {
+            if (tokens.empty()) {
+                return;
+            }
+            if (!prompt.parts.empty() && !prompt.parts.back().is_marker) {
+                auto & last = prompt.parts.back().tokens;
+                last.insert(last.end(), tokens.begin(), tokens.end());
             } else {
-                // this is a text part, we should add it as text
-                add_text(part, parse_special);
+                prompt.parts.push_back({false, tokens});
             }
-        }
+        };
 
-        if (add_special && llama_vocab_get_add_bos(vocab)) {
-            // if first chunk is text, we add BOS token to first text chunk
-            // otherwise, create a new text chunk with BOS token
-            if (!cur.entries.empty() && cur.entries[0].type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
-                // add BOS token to the beginning of first text chunk
-                cur.entries[0].tokens_text.insert(cur.entries[0].tokens_text.begin(), llama_vocab_bos(vocab));
+        // the BOS token goes in front of the first chunk, and the EOS token after the last one;
+        // a leading image gets a text chunk of its own for the BOS token
+        if (text->add_special && llama_vocab_get_add_bos(vocab)) {
+            add_tokens({llama_vocab_bos(vocab)});
+        }
+        for (auto & part : split_text(input_text, ctx->media_marker)) {
+            if (part == ctx->media_marker) {
+                prompt.parts.push_back({true, {}});
+                prompt.n_markers++;
             } else {
-                // create a new text chunk with BOS token at the beginning
-                mtmd_input_chunk bos_chunk{
-                    MTMD_INPUT_CHUNK_TYPE_TEXT,
-                    {llama_vocab_bos(vocab)},
-                    nullptr, // image tokens
-                    nullptr, // audio tokens
-                };
-                cur.entries.insert(cur.entries.begin(), std::move(bos_chunk));
+                LOG_DBG("%s: %s\n", __func__, part.c_str());
+                add_tokens(mtmd_tokenize_text_internal(vocab, part, /* add_special */ false, text->parse_special));
             }
         }
-
-        if (add_special && llama_vocab_get_add_eos(vocab)) {
-            // if last chunk is text, we add EOS token to it
-            add_text({llama_vocab_eos(vocab)});
+        if (text->add_special && llama_vocab_get_add_eos(vocab)) {
+            add_tokens({llama_vocab_eos(vocab)});
         }
 
-        if (i_bm != bitmaps.size()) {
+        auto tokenize_special = [&](const std::string & txt) {
+            return txt.empty() ? std::vector<llama_token>() : mtmd_tokenize_text_internal(vocab, txt, false, true);
+        };
+        prompt.img_beg = tokenize_special(ctx->img_beg);
+        prompt.img_end = tokenize_special(ctx->img_end);
+        prompt.aud_beg = tokenize_special(ctx->aud_beg);
+        prompt.aud_end = tokenize_special(ctx->aud_end);
+    }
+
+    int32_t tokenize() {
+        if (n_bitmaps != prompt.n_markers) {
             LOG_ERR("%s: error: number of bitmaps (%zu) does not match number of markers (%zu)\n",
-                    __func__, bitmaps.size(), parts.size() - 1);
+                    __func__, n_bitmaps, prompt.n_markers);
+            cur.entries.clear();
             return 1;
         }
 
-        *output = std::move(cur);
+        size_t i_bm = 0; // index of the current bitmap
+        for (const auto & part : prompt.parts) {
+            if (part.is_marker) {
+                // this is a marker, we should add the next bitmap
+                int32_t res = add_media(bitmaps[i_bm++]);
+                if (res != 0) {
+                    cur.entries.clear();
+                    return res;
+                }
+            } else {
+                // this is a text part, we should add it as text
+                add_text(part.tokens);
+            }
+        }
+
+        cur.entries.erase(cur.entries.begin() + n_cur, cur.entries.end());
 
         return 0;
     }
 
+    // the slice delimiter of sli_img_start_tmpl for a row and column, formatted and tokenized
+    // once per context instead of for every slice of every frame
+    const std::vector<llama_token> & sli_img_start_tokens(int row, int col) {
+        std::lock_guard<std::mutex> lock(ctx->sli_img_start_mutex);
+        auto & tokens = ctx->tok_sli_img_start_grid[{row, col}];
+        if (tokens.empty()) {
+            const size_t sz = std::snprintf(nullptr, 0, ctx->sli_img_start_tmpl.c_str(), row, col) + 1;
+            std::unique_ptr<char[]> buf(new char[sz]);
+            std::snprintf(buf.get(), sz, ctx->sli_img_start_tmpl.c_str(), row, col);
+            tokens = mtmd_tokenize_text_internal(vocab, std::string(buf.get(), buf.get() + sz - 1),
+                                                 /* add_special */ false, /* parse_special */ true);
+        }
+        return tokens;
+    }
+
     void add_text(const std::string & txt, bool parse_special) {
         LOG_DBG("%s: %s\n", __func__, txt.c_str());
         auto tokens = mtmd_tokenize_text_internal(vocab, txt, /* add_special */ false, parse_special);
@@ -461,11 +728,14 @@ struct mtmd_tokenizer {
             return;
         }
         // if last entry is also a text chunk, add tokens to it instead of creating new chunk
-        if (!cur.entries.empty() && cur.entries.back().type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
-            cur.entries.back().tokens_text.insert(
-                                            cur.entries.back().tokens_text.end(),
+        if (n_cur > 0 && cur.entries[n_cur - 1].type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            cur.entries[n_cur - 1].tokens_text.insert(
+                                            cur.entries[n_cur - 1].tokens_text.end(),
                                             tokens.begin(),
                                             tokens.end());
+        } else if (n_cur < cur.entries.size() && cur.entries[n_cur].type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            // reuse the text chunk left at this position
+            cur.entries[n_cur++].tokens_text.assign(tokens.begin(), tokens.end());
         } else {
             mtmd_input_chunk chunk{
                 MTMD_INPUT_CHUNK_TYPE_TEXT,
@@ -473,8 +743,17 @@ struct mtmd_tokenizer {
                 nullptr, // image tokens
                 nullptr, // audio tokens
             };
+            add_chunk(std::move(chunk));
+        }
+    }
+
+    void add_chunk(mtmd_input_chunk && chunk) {
+        if (n_cur < cur.entries.size()) {
+            cur.entries[n_cur] = std::move(chunk);
+        } else {
             cur.entries.emplace_back(std::move(chunk));
         }
+        n_cur++;
     }
 
     int32_t add_media(const mtmd_bitmap * bitmap) {
@@ -487,7 +766,12 @@ struct mtmd_tokenizer {
             }
 
             if (!ctx->img_beg.empty()) {
-                add_text(ctx->img_beg, true); // add image begin token
+                add_text(prompt.img_beg); // add image begin token
+            }
+
+            std::string cache_key;
+            if (ctx->embd_cache.enabled()) {
+                cache_key = bitmap->id.empty() ? "hash:" + mtmd_bitmap_hash(bitmap) : "id:" + bitmap->id;
             }
 
             // convert mtmd_bitmap to clip_image_u8
@@ -516,7 +800,7 @@ struct mtmd_tokenizer {
                 const int n_row = batch_f32.grid_y;
                 // split batch into chunks of single images
                 // NOTE: batch_f32 will be invalidated after this call
-                auto chunks = split_batch_to_chunk(std::move(batch_f32), bitmap->id);
+                auto chunks = split_batch_to_chunk(std::move(batch_f32), bitmap->id, cache_key);
                 GGML_ASSERT(chunks.size() > 0);
 
                 auto ov_chunk = std::move(chunks.front());
@@ -525,7 +809,7 @@ struct mtmd_tokenizer {
                 // add overview image (first)
                 if (ctx->ov_img_first) {
                     add_text(ctx->tok_ov_img_start);
-                    cur.entries.emplace_back(std::move(ov_chunk));
+                    add_chunk(std::move(ov_chunk));
                     add_text(ctx->tok_ov_img_end);
                 }
 
@@ -540,12 +824,9 @@ struct mtmd_tokenizer {
                                 add_text(ctx->tok_sli_img_start);
                             } else if (!ctx->sli_img_start_tmpl.empty()) {
                                 // If using a template to preceed a slice image
-                                const size_t sz = std::snprintf(nullptr, 0, ctx->sli_img_start_tmpl.c_str(), y+1, x+1) + 1;
-                                std::unique_ptr<char[]> buf(new char[sz]);
-                                std::snprintf(buf.get(), sz, ctx->sli_img_start_tmpl.c_str(), y+1, x+1);
-                                add_text(std::string(buf.get(), buf.get() + sz - 1), true);
+                                add_text(sli_img_start_tokens(y+1, x+1));
                             }
-                            cur.entries.emplace_back(std::move(chunks[y * n_col + x]));
+                            add_chunk(std::move(chunks[y * n_col + x]));
                             add_text(ctx->tok_sli_img_end);
                             if (!is_last_in_row) {
                                 add_text(ctx->tok_sli_img_mid);
@@ -561,21 +842,28 @@ struct mtmd_tokenizer {
                 // add overview image (last)
                 if (!ctx->ov_img_first) {
                     add_text(ctx->tok_ov_img_start);
-                    cur.entries.emplace_back(std::move(ov_chunk));
+                    add_chunk(std::move(ov_chunk));
                     add_text(ctx->tok_ov_img_end);
                 }
 
             } else {
+                // counts are after pooling, so positions match what mtmd_encode() outputs
                 size_t n_tokens = 0;
                 for (const auto & entry : batch_f32.entries) {
-                    n_tokens += clip_n_output_tokens(ctx->ctx_v, entry.get());
+                    n_tokens += mtmd_image_grid_get(ctx, entry.get()).n_tokens();
                 }
 
                 mtmd_image_tokens_ptr image_tokens(new mtmd_image_tokens);
                 if (ctx->use_mrope) {
                     // for Qwen2VL, we need this information for M-RoPE decoding positions
-                    image_tokens->nx = clip_n_output_tokens_x(ctx->ctx_v, batch_f32.entries[0].get());
-                    image_tokens->ny = clip_n_output_tokens_y(ctx->ctx_v, batch_f32.entries[0].get());
+                    const mtmd_image_grid grid = mtmd_image_grid_get(ctx, batch_f32.entries[0].get());
+                    if (grid.pool > 1) {
+                        image_tokens->nx = grid.pooled_nx();
+                        image_tokens->ny = grid.pooled_ny();
+                    } else {
+                        image_tokens->nx = clip_n_output_tokens_x(ctx->ctx_v, batch_f32.entries[0].get());
+                        image_tokens->ny = clip_n_output_tokens_y(ctx->ctx_v, batch_f32.entries[0].get());
+                    }
                     image_tokens->use_mrope_pos = true;
                 } else {
                     // other models, we only need the total number of tokens
@@ -584,6 +872,7 @@ struct mtmd_tokenizer {
                 }
                 image_tokens->batch_f32 = std::move(batch_f32);
                 image_tokens->id = bitmap->id; // optional
+                image_tokens->cache_key = cache_key;
 
                 LOG_DBG("image_tokens->nx = %d\n", image_tokens->nx);
                 LOG_DBG("image_tokens->ny = %d\n", image_tokens->ny);
@@ -595,11 +884,11 @@ struct mtmd_tokenizer {
                     std::move(image_tokens),
                     nullptr, // audio tokens
                 };
-                cur.entries.emplace_back(std::move(chunk));
+                add_chunk(std::move(chunk));
             }
 
             if (!ctx->img_end.empty()) {
-                add_text(ctx->img_end, true); // add image end token
+                add_text(prompt.img_end); // add image end token
             }
 
         } else {
@@ -616,23 +905,28 @@ struct mtmd_tokenizer {
             }
 
             if (!ctx->aud_beg.empty()) {
-                add_text(ctx->aud_beg, true); // add audio begin token
+                add_text(prompt.aud_beg); // add audio begin token
             }
 
-            // preprocess audio
+            // preprocess audio, unless it was streamed
             GGML_ASSERT(ctx->w_filters.n_mel); // make sure we have filter preloaded
             std::vector<whisper_preprocessor::whisper_mel> mel_spec_chunks;
-            const float * samples = (const float *)bitmap->data.data();
-            size_t n_samples = bitmap->data.size() / sizeof(float);
-            bool ok = whisper_preprocessor::preprocess_audio(samples, n_samples, ctx->w_filters, mel_spec_chunks);
-            if (!ok) {
-                LOG_ERR("Unable to preprocess audio\n");
-                return 2;
+            if (!bitmap->audio_mel.empty()) {
+                mel_spec_chunks = bitmap->audio_mel;
+            } else {
+                const float * samples = (const float *)bitmap->data.data();
+                size_t n_samples = bitmap->data.size() / sizeof(float);
+                bool ok = whisper_preprocessor::preprocess_audio(samples, n_samples, ctx->w_filters, ctx->n_threads, mel_spec_chunks);
+                if (!ok) {
+                    LOG_ERR("Unable to preprocess audio\n");
+                    return 2;
+                }
             }
 
             // consider each mel_spec as a separate audio chunk
             // TODO: maybe support batching, but this may come with memory cost
-            for (auto & mel_spec : mel_spec_chunks) {
+            for (size_t i_chunk = 0; i_chunk < mel_spec_chunks.size(); i_chunk++) {
+                auto & mel_spec = mel_spec_chunks[i_chunk];
                 clip_image_f32_ptr mel_f32(clip_image_f32_init());
                 mel_f32->nx  = mel_spec.n_len;
                 mel_f32->ny  = mel_spec.n_mel;
@@ -647,6 +941,9 @@ struct mtmd_tokenizer {
                 audio_tokens->n_tokens = n_tokens;
                 audio_tokens->batch_f32 = std::move(batch_f32);
                 audio_tokens->id = bitmap->id; // optional
+                if (i_chunk < bitmap->audio_embd.size()) {
+                    audio_tokens->embd = bitmap->audio_embd[i_chunk];
+                }
 
                 LOG_DBG("audio_tokens->n_tokens = %d\n", audio_tokens->n_tokens);
 
@@ -656,26 +953,30 @@ struct mtmd_tokenizer {
                     nullptr, // image tokens
                     std::move(audio_tokens),
                 };
-                cur.entries.emplace_back(std::move(chunk));
+                add_chunk(std::move(chunk));
             }
 
             if (!ctx->aud_end.empty()) {
-                add_text(ctx->aud_end, true); // add audio end token
+                add_text(prompt.aud_end); // add audio end token
             }
         }
 
         return 0;
     }
 
-    std::vector<mtmd_input_chunk> split_batch_to_chunk(clip_image_f32_batch && batch_f32, const std::string & id) {
+    std::vector<mtmd_input_chunk> split_batch_to_chunk(clip_image_f32_batch && batch_f32, const std::string & id, const std::string & cache_key) {
         std::vector<mtmd_input_chunk> chunks;
 
         for (auto & entry : batch_f32.entries) {
             mtmd_image_tokens_ptr image_tokens(new mtmd_image_tokens);
-            image_tokens->nx = clip_n_output_tokens(ctx->ctx_v, entry.get());
+            image_tokens->nx = mtmd_image_grid_get(ctx, entry.get()).n_tokens();
             image_tokens->ny = 1;
             image_tokens->batch_f32.entries.push_back(std::move(entry));
             image_tokens->id = id;
+            if (!cache_key.empty()) {
+                // every slice shares the bitmap id
+                image_tokens->cache_key = cache_key + "#" + std::to_string(chunks.size());
+            }
 
             mtmd_input_chunk chunk{
                 MTMD_INPUT_CHUNK_TYPE_IMAGE,
@@ -736,25 +1037,78 @@ int32_t mtmd_tokenize(mtmd_context * ctx,
             const mtmd_input_text * text,
             const mtmd_bitmap ** bitmaps,
             size_t n_bitmaps) {
-    mtmd_tokenizer tokenizer(ctx, text, bitmaps, n_bitmaps);
-    return tokenizer.tokenize(output);
+    MTMD_TRACE_SCOPE("mtmd_tokenize");
+    MTMD_TRACE_ADD(MTMD_TRACE_FRAMES, n_bitmaps);
+    mtmd_prompt prompt;
+    mtmd_tokenizer::compile(ctx, text, prompt);
+    mtmd_tokenizer tokenizer(ctx, prompt, bitmaps, n_bitmaps, *output);
+    return tokenizer.tokenize();
 }
 
-int32_t mtmd_encode_chunk(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
-    if (chunk->type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
-        LOG_WRN("mtmd_encode_chunk has no effect for text chunks\n");
-        return 0;
-    } else if (chunk->type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+mtmd_prompt * mtmd_prompt_init(mtmd_context * ctx, const mtmd_input_text * text) {
+    mtmd_prompt * prompt = new mtmd_prompt;
+    mtmd_tokenizer::compile(ctx, text, *prompt);
+    return prompt;
+}
+
+size_t mtmd_prompt_n_markers(const mtmd_prompt * prompt) {
+    return prompt->n_markers;
+}
+
+void mtmd_prompt_free(mtmd_prompt * prompt) {
+    delete prompt;
+}
+
+int32_t mtmd_tokenize_prompt(mtmd_context * ctx,
+            mtmd_input_chunks * output,
+            const mtmd_prompt * prompt,
+            const mtmd_bitmap ** bitmaps,
+            size_t n_bitmaps) {
+    MTMD_TRACE_SCOPE("mtmd_tokenize");
+    MTMD_TRACE_ADD(MTMD_TRACE_FRAMES, n_bitmaps);
+    mtmd_tokenizer tokenizer(ctx, *prompt, bitmaps, n_bitmaps, *output);
+    return tokenizer.tokenize();
+}
+
+// drop what the encoders only need while encoding; the output embeddings are kept,
+// a worker may still be copying them. must be called with encode_mutex held
+static void mtmd_release_compute_locked(mtmd_context * ctx) {
+    if (ctx->ctx_v) {
+        clip_release_compute(ctx->ctx_v);
+    }
+    if (ctx->ctx_a) {
+        clip_release_compute(ctx->ctx_a);
+    }
+    std::vector<float>().swap(ctx->image_embd_raw);
+}
+
+// in low memory mode, nothing is kept for the next input of the same size
+static void mtmd_encode_done(mtmd_context * ctx) {
+    if (ctx->low_memory) {
+        mtmd_release_compute_locked(ctx);
+    }
+}
+
+static int32_t mtmd_encode_locked(mtmd_context * ctx, const mtmd_image_tokens * image_tokens);
+
+// must be called with encode_mutex held
+static int32_t mtmd_encode_chunk_locked(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
+    if (chunk->type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
         if (!ctx->ctx_v) {
             LOG_ERR("%s: model does not support vision input\n", __func__);
             return 1;
         }
-        return mtmd_encode(ctx, chunk->tokens_image.get());
+        return mtmd_encode_locked(ctx, chunk->tokens_image.get());
     } else if (chunk->type == MTMD_INPUT_CHUNK_TYPE_AUDIO) {
         if (!ctx->ctx_a) {
             LOG_ERR("%s: model does not support audio input\n", __func__);
             return 1;
         }
+        if (!chunk->tokens_audio->embd.empty()) {
+            // encoded while the audio was streamed
+            ctx->image_embd_v = chunk->tokens_audio->embd;
+            return 0;
+        }
         int n_mmproj_embd = ctx->n_embd_text;
         ctx->image_embd_v.resize(chunk->tokens_audio->n_tokens * n_mmproj_embd);
         bool ok = clip_image_batch_encode(
@@ -762,6 +1116,7 @@ int32_t mtmd_encode_chunk(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
             ctx->n_threads,
             &chunk->tokens_audio->batch_f32,
             ctx->image_embd_v.data());
+        mtmd_encode_done(ctx);
         return ok ? 0 : 1;
     }
 
@@ -769,40 +1124,335 @@ int32_t mtmd_encode_chunk(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
     return 1;
 }
 
-int32_t mtmd_encode(mtmd_context * ctx, const mtmd_image_tokens * image_tokens) {
+int32_t mtmd_encode_chunk(mtmd_context * ctx, const mtmd_input_chunk * chunk) {
+    if (chunk->type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+        LOG_WRN("mtmd_encode_chunk has no effect for text chunks\n");
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    return mtmd_encode_chunk_locked(ctx, chunk);
+}
+
+int32_t mtmd_encode_chunk_to(mtmd_context * ctx, const mtmd_input_chunk * chunk, float * out) {
+    if (chunk->type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+        LOG_WRN("mtmd_encode_chunk_to has no effect for text chunks\n");
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    int32_t ret = mtmd_encode_chunk_locked(ctx, chunk);
+    if (ret == 0) {
+        std::copy(ctx->image_embd_v.begin(), ctx->image_embd_v.end(), out);
+    }
+    return ret;
+}
+
+// resize an embedding buffer, counting the bytes of each reallocation
+static void mtmd_embd_resize(std::vector<float> & embd, size_t n) {
+#ifdef MTMD_TRACE
+    if (n > embd.capacity()) {
+        MTMD_TRACE_ADD(MTMD_TRACE_BYTES_ALLOCATED, n * sizeof(float));
+    }
+#endif
+    embd.resize(n);
+}
+
+// encode all entries of an image into out (n_tokens() * n_mmproj_embd floats), pooling them if enabled
+static bool mtmd_encode_image(mtmd_context * ctx, const mtmd_image_tokens * image_tokens, float * out) {
+    MTMD_TRACE_SCOPE("mtmd_encode");
+    MTMD_TRACE_ADD(MTMD_TRACE_IMAGES_ENCODED, 1);
     clip_ctx * ctx_clip = ctx->ctx_v;
-    if (!ctx_clip) {
+    const int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
+
+    std::vector<mtmd_image_grid> grids;
+    size_t n_raw = 0;
+    bool pooled = false;
+    for (const auto & entry : image_tokens->batch_f32.entries) {
+        grids.push_back(mtmd_image_grid_get(ctx, entry.get()));
+        n_raw += grids.back().n_raw();
+        pooled |= grids.back().pool > 1;
+    }
+
+    // all entries (e.g. llava-uhd slices) are encoded in one call, the outputs are contiguous
+    if (!pooled) {
+        return clip_image_batch_encode(ctx_clip, ctx->n_threads, &image_tokens->batch_f32, out);
+    }
+
+    mtmd_embd_resize(ctx->image_embd_raw, n_raw * n_mmproj_embd);
+    if (!clip_image_batch_encode(ctx_clip, ctx->n_threads, &image_tokens->batch_f32, ctx->image_embd_raw.data())) {
+        return false;
+    }
+    MTMD_TRACE_SCOPE("mtmd_pool");
+    const float * src = ctx->image_embd_raw.data();
+    for (const auto & grid : grids) {
+        mtmd_image_grid_pool(grid, n_mmproj_embd, src, out);
+        src += (size_t)grid.n_raw() * n_mmproj_embd;
+        out += (size_t)grid.n_tokens() * n_mmproj_embd;
+    }
+    LOG_DBG("%s: pooled %zu image tokens into %u\n", __func__, n_raw, image_tokens->n_tokens());
+    return true;
+}
+
+int32_t mtmd_encode(mtmd_context * ctx, const mtmd_image_tokens * image_tokens) {
+    if (!ctx->ctx_v) {
         LOG_ERR("%s: this API does not support non-vision input, please use mtmd_encode_chunk instead\n", __func__);
         return 1;
     }
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    return mtmd_encode_locked(ctx, image_tokens);
+}
+
+// must be called with encode_mutex held
+static int32_t mtmd_encode_locked(mtmd_context * ctx, const mtmd_image_tokens * image_tokens) {
+    clip_ctx * ctx_clip = ctx->ctx_v;
     int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
-    ctx->image_embd_v.resize(image_tokens->n_tokens() * n_mmproj_embd);
-    bool ok = false;
-
-    if (clip_is_llava(ctx_clip)
-        || clip_is_minicpmv(ctx_clip)
-        || clip_is_glm(ctx_clip)) {
-        // TODO @ngxson : llava does not support batched encoding ; this should be fixed inside clip_image_batch_encode()
-        const auto & entries = image_tokens->batch_f32.entries;
-        for (size_t i = 0; i < entries.size(); i++) {
-            int n_tokens_per_image = clip_n_output_tokens(ctx_clip, entries[i].get());
-            ok = clip_image_encode(
-                ctx_clip,
-                ctx->n_threads,
-                entries[i].get(),
-                ctx->image_embd_v.data() + i*n_mmproj_embd*n_tokens_per_image);
-        }
-    } else {
-        ok = clip_image_batch_encode(
-            ctx_clip,
-            ctx->n_threads,
-            &image_tokens->batch_f32,
-            ctx->image_embd_v.data());
+    mtmd_embd_resize(ctx->image_embd_v, image_tokens->n_tokens() * n_mmproj_embd);
+    const bool use_cache = ctx->embd_cache.enabled() && !image_tokens->cache_key.empty();
+    if (use_cache && ctx->embd_cache.get(image_tokens->cache_key, ctx->image_embd_v.data())) {
+        LOG_DBG("%s: image embeddings found in cache\n", __func__);
+        MTMD_TRACE_ADD(MTMD_TRACE_EMBD_CACHE_HITS, 1);
+        return 0;
+    }
+
+    bool ok = mtmd_encode_image(ctx, image_tokens, ctx->image_embd_v.data());
+    mtmd_encode_done(ctx);
+
+    if (ok && use_cache) {
+        ctx->embd_cache.put(image_tokens->cache_key, ctx->image_embd_v);
     }
 
     return ok ? 0 : 1;
 }
 
+int32_t mtmd_encode_chunks(mtmd_context * ctx,
+                           const mtmd_input_chunk ** chunks,
+                           size_t n_chunks,
+                           size_t * offsets) {
+    clip_ctx * ctx_clip = ctx->ctx_v;
+    if (!ctx_clip) {
+        LOG_ERR("%s: model does not support vision input\n", __func__);
+        return 1;
+    }
+    const int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
+
+    size_t n_total = 0;
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (chunks[i]->type != MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+            LOG_ERR("%s: chunk %zu is not an image\n", __func__, i);
+            return 1;
+        }
+        offsets[i] = n_total;
+        n_total += chunks[i]->tokens_image->n_tokens() * n_mmproj_embd;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    mtmd_embd_resize(ctx->image_embd_v, n_total);
+    for (size_t i = 0; i < n_chunks; i++) {
+        const mtmd_image_tokens * image_tokens = chunks[i]->tokens_image.get();
+        float * out = ctx->image_embd_v.data() + offsets[i];
+        const bool use_cache = ctx->embd_cache.enabled() && !image_tokens->cache_key.empty();
+        if (use_cache && ctx->embd_cache.get(image_tokens->cache_key, out)) {
+            MTMD_TRACE_ADD(MTMD_TRACE_EMBD_CACHE_HITS, 1);
+            continue;
+        }
+        // consecutive calls of the same image size share one cached graph
+        if (!mtmd_encode_image(ctx, image_tokens, out)) {
+            mtmd_encode_done(ctx);
+            return 1;
+        }
+        if (use_cache) {
+            ctx->embd_cache.put(image_tokens->cache_key,
+                std::vector<float>(out, out + image_tokens->n_tokens() * n_mmproj_embd));
+        }
+    }
+    mtmd_encode_done(ctx);
+    return 0;
+}
+
+bool mtmd_embd_cache_get(mtmd_context * ctx, const mtmd_input_chunk * chunk, float * out) {
+    if (!ctx->embd_cache.enabled() || chunk->type != MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+        return false;
+    }
+    const auto & key = chunk->tokens_image->cache_key;
+    if (key.empty() || !ctx->embd_cache.get(key, out)) {
+        return false;
+    }
+    MTMD_TRACE_ADD(MTMD_TRACE_EMBD_CACHE_HITS, 1);
+    return true;
+}
+
+void mtmd_embd_cache_clear(mtmd_context * ctx) {
+    ctx->embd_cache.clear();
+}
+
+void mtmd_embd_cache_set_budget(mtmd_context * ctx, size_t n_bytes) {
+    ctx->embd_cache.set_budget(n_bytes);
+}
+
+mtmd_memory_usage mtmd_get_memory_usage(mtmd_context * ctx) {
+    mtmd_memory_usage usage = {};
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    for (const clip_ctx * ctx_clip : {ctx->ctx_v, ctx->ctx_a}) {
+        if (ctx_clip) {
+            usage.model   += clip_model_nbytes(ctx_clip);
+            usage.compute += clip_compute_nbytes(ctx_clip);
+        }
+    }
+    usage.embd_cache = ctx->embd_cache.size();
+    usage.embd = (ctx->image_embd_v.capacity() + ctx->image_embd_raw.capacity()) * sizeof(float);
+    return usage;
+}
+
+void mtmd_release_compute(mtmd_context * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+    mtmd_release_compute_locked(ctx);
+}
+
+void mtmd_set_low_memory(mtmd_context * ctx, bool low_memory) {
+    ctx->low_memory = low_memory;
+}
+
+// streaming audio input
+
+struct mtmd_audio_stream_chunk {
+    whisper_preprocessor::whisper_mel mel;
+    std::vector<float> embd; // filled by the worker
+};
+
+struct mtmd_audio_stream {
+    mtmd_context * ctx;
+    whisper_preprocessor::whisper_mel_stream mel;
+    std::vector<float> samples; // everything pushed so far, kept as the data of the bitmap
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<mtmd_audio_stream_chunk> chunks; // references stay valid while chunks are appended
+    size_t n_encoded = 0; // chunks [0, n_encoded) have been processed by the worker
+    bool failed = false;
+    bool stop   = false;
+    std::thread worker;
+
+    // the whisper encoder only takes full 30 s chunks
+    explicit mtmd_audio_stream(mtmd_context * ctx) : ctx(ctx), mel(ctx->w_filters, 3000) {}
+
+    void add_chunks(std::vector<whisper_preprocessor::whisper_mel> && mels) {
+        if (mels.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto & m : mels) {
+                chunks.push_back({std::move(m), {}});
+            }
+        }
+        cv.notify_all();
+    }
+
+    void run() {
+        while (true) {
+            mtmd_audio_stream_chunk * chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || n_encoded < chunks.size(); });
+                if (stop) {
+                    return;
+                }
+                chunk = &chunks[n_encoded];
+            }
+
+            MTMD_TRACE_SCOPE("mtmd_audio_stream_encode");
+            clip_image_f32_ptr mel_f32(clip_image_f32_init());
+            mel_f32->nx  = chunk->mel.n_len;
+            mel_f32->ny  = chunk->mel.n_mel;
+            mel_f32->buf = chunk->mel.data;
+            std::vector<float> embd((size_t) clip_n_output_tokens(ctx->ctx_a, mel_f32.get()) * clip_n_mmproj_embd(ctx->ctx_a));
+
+            clip_image_f32_batch batch_f32;
+            batch_f32.is_audio = true;
+            batch_f32.entries.push_back(std::move(mel_f32));
+
+            bool ok;
+            {
+                std::lock_guard<std::mutex> lock(ctx->encode_mutex);
+                ok = clip_image_batch_encode(ctx->ctx_a, ctx->n_threads, &batch_f32, embd.data());
+                mtmd_encode_done(ctx);
+            }
+            if (!ok) {
+                LOG_ERR("%s: failed to encode audio chunk %zu\n", __func__, n_encoded);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok) {
+                    chunk->embd = std::move(embd);
+                } else {
+                    failed = true;
+                }
+                n_encoded++;
+            }
+            cv.notify_all();
+        }
+    }
+};
+
+mtmd_audio_stream * mtmd_audio_stream_init(mtmd_context * ctx) {
+    if (!ctx->ctx_a || !ctx->w_filters.n_mel) {
+        LOG_ERR("%s: model does not support audio input\n", __func__);
+        return nullptr;
+    }
+    mtmd_audio_stream * stream = new mtmd_audio_stream(ctx);
+    stream->worker = std::thread([stream] { stream->run(); });
+    return stream;
+}
+
+int32_t mtmd_audio_stream_push(mtmd_audio_stream * stream, const float * samples, size_t n_samples) {
+    stream->samples.insert(stream->samples.end(), samples, samples + n_samples);
+
+    std::vector<whisper_preprocessor::whisper_mel> mels;
+    stream->mel.push(samples, n_samples, mels);
+    stream->add_chunks(std::move(mels));
+
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    return stream->failed ? 1 : 0;
+}
+
+mtmd_bitmap * mtmd_audio_stream_finish(mtmd_audio_stream * stream) {
+    std::vector<whisper_preprocessor::whisper_mel> mels;
+    stream->mel.finish(mels);
+    stream->add_chunks(std::move(mels));
+
+    mtmd_bitmap * bitmap = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(stream->mutex);
+        stream->cv.wait(lock, [&] { return stream->n_encoded == stream->chunks.size(); });
+        if (!stream->failed && !stream->chunks.empty()) {
+            bitmap = mtmd_bitmap_init_from_audio(stream->samples.size(), stream->samples.data());
+            for (auto & chunk : stream->chunks) {
+                bitmap->audio_mel.push_back(std::move(chunk.mel));
+                bitmap->audio_embd.push_back(std::move(chunk.embd));
+            }
+        }
+        // ready for the next utterance
+        stream->chunks.clear();
+        stream->n_encoded = 0;
+        stream->failed = false;
+    }
+    stream->samples.clear();
+    return bitmap;
+}
+
+void mtmd_audio_stream_free(mtmd_audio_stream * stream) {
+    if (!stream) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->stop = true;
+    }
+    stream->cv.notify_all();
+    stream->worker.join();
+    delete stream;
+}
+
 float * mtmd_get_output_embd(mtmd_context * ctx) {
     return ctx->image_embd_v.data();
 }
@@ -834,6 +1484,13 @@ int mtmd_get_audio_bitrate(mtmd_context * ctx) {
     return 16000; // 16kHz
 }
 
+int mtmd_get_image_size(mtmd_context * ctx) {
+    if (!ctx->ctx_v) {
+        return -1;
+    }
+    return clip_get_image_size(ctx->ctx_v);
+}
+
 //
 // public API functions
 //
@@ -848,7 +1505,9 @@ mtmd_bitmap * mtmd_bitmap_init(uint32_t nx,
     bitmap->ny = ny;
     size_t data_size = (size_t)nx * ny * 3;
     bitmap->data.resize(data_size);
-    std::memcpy(bitmap->data.data(), data, data_size);
+    if (data) {
+        std::memcpy(bitmap->data.data(), data, data_size);
+    }
     return bitmap;
 }
 
@@ -876,6 +1535,10 @@ const unsigned char * mtmd_bitmap_get_data(const mtmd_bitmap * bitmap) {
     return bitmap->data.data();
 }
 
+unsigned char * mtmd_bitmap_get_data_mut(mtmd_bitmap * bitmap) {
+    return bitmap->data.data();
+}
+
 size_t mtmd_bitmap_get_n_bytes(const mtmd_bitmap * bitmap) {
     return bitmap->data.size();
 }
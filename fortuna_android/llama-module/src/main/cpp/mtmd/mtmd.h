@@ -82,6 +82,8 @@ struct mtmd_context_params {
     enum ggml_log_level verbosity;
     const char * image_marker; // deprecated, use media_marker instead
     const char * media_marker;
+    size_t embd_cache_size; // byte budget of the image embedding cache, 0 to disable
+    int image_pool; // average-pool image tokens in image_pool x image_pool blocks after encoding, 1 to disable
 };
 
 MTMD_API const char * mtmd_default_marker(void);
@@ -94,8 +96,56 @@ MTMD_API mtmd_context * mtmd_init_from_file(const char * mmproj_fname,
                                             const struct llama_model * text_model,
                                             const struct mtmd_context_params ctx_params);
 
+// same as mtmd_init_from_file(), but only loads the mmproj, so it can run while the text
+// model is still loading; mtmd_set_text_model() must be called before any other use
+// return nullptr on failure
+MTMD_API mtmd_context * mtmd_init_from_file_deferred(const char * mmproj_fname,
+                                                     const struct mtmd_context_params ctx_params);
+
+// attach the text model to a context created by mtmd_init_from_file_deferred()
+// return 0 on success, 1 if the model does not match the mmproj
+MTMD_API int32_t mtmd_set_text_model(mtmd_context * ctx, const struct llama_model * text_model);
+
 MTMD_API void mtmd_free(mtmd_context * ctx);
 
+// run the encoders on a CPU threadpool, e.g. one pinned to other cores than the text model's
+// the threadpool must outlive the context, or be replaced by NULL (the default) before it is freed
+MTMD_API void mtmd_set_threadpool(mtmd_context * ctx, ggml_threadpool_t threadpool);
+
+// threads used by the encoders from now on, at most the size of the threadpool if one is set
+MTMD_API void mtmd_set_n_threads(mtmd_context * ctx, int n_threads);
+
+// image embedding cache
+// when enabled (embd_cache_size > 0), the output of mtmd_encode() is kept in an LRU cache
+// keyed by the bitmap id, or by a hash of the pixels when no id is set
+// encoding a chunk that is already cached only copies the embeddings to mtmd_get_output_embd()
+// note: bitmaps sharing an id are assumed to have the same content
+// mtmd_embd_cache_get() copies the cached embeddings of an image chunk to out and returns true,
+// or returns false on miss; out must hold llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) floats
+MTMD_API bool mtmd_embd_cache_get(mtmd_context * ctx, const mtmd_input_chunk * chunk, float * out);
+MTMD_API void mtmd_embd_cache_clear(mtmd_context * ctx);
+
+// change the byte budget of the embedding cache, evicting the least recently used entries to fit; 0 disables it
+MTMD_API void mtmd_embd_cache_set_budget(mtmd_context * ctx, size_t n_bytes);
+
+// native memory held by the context, in bytes
+struct mtmd_memory_usage {
+    size_t model;      // encoder weights (mapped from the file when mmap is used)
+    size_t compute;    // encoder compute buffers, allocated for the last input size
+    size_t embd_cache; // embedding cache entries
+    size_t embd;       // output and pooling buffers
+};
+
+MTMD_API struct mtmd_memory_usage mtmd_get_memory_usage(mtmd_context * ctx);
+
+// free the encoder compute buffers and the pooling buffer, the next encode allocates them again
+// the output of mtmd_get_output_embd() is kept
+MTMD_API void mtmd_release_compute(mtmd_context * ctx);
+
+// when enabled, the encoder compute buffers are freed after every encode instead of being kept
+// for the next input of the same size: less resident memory between frames, slower encodes
+MTMD_API void mtmd_set_low_memory(mtmd_context * ctx, bool low_memory);
+
 // whether we need to set non-causal mask before llama_decode
 MTMD_API bool mtmd_decode_use_non_causal(mtmd_context * ctx);
 
@@ -112,11 +162,18 @@ MTMD_API bool mtmd_support_audio(mtmd_context * ctx);
 // return -1 if audio is not supported
 MTMD_API int mtmd_get_audio_bitrate(mtmd_context * ctx);
 
+// get the input image size of the vision encoder in pixels (one side of the square tile)
+// useful to downscale images before handing them to mtmd_bitmap_init()
+// return -1 if vision is not supported
+MTMD_API int mtmd_get_image_size(mtmd_context * ctx);
+
 // mtmd_bitmap
 //
 // if bitmap is image:
 //     length of data must be nx * ny * 3
 //     the data is in RGBRGBRGB... format
+//     data can be NULL, in which case the storage is allocated but left for the caller to fill
+//     via mtmd_bitmap_get_data_mut() (avoids an extra copy when converting from another format)
 // if bitmap is audio:
 //     length of data must be n_samples * sizeof(float)
 //     the data is in float format (PCM F32)
@@ -125,6 +182,7 @@ MTMD_API mtmd_bitmap *         mtmd_bitmap_init_from_audio(size_t n_samples,
 MTMD_API uint32_t              mtmd_bitmap_get_nx     (const mtmd_bitmap * bitmap);
 MTMD_API uint32_t              mtmd_bitmap_get_ny     (const mtmd_bitmap * bitmap);
 MTMD_API const unsigned char * mtmd_bitmap_get_data   (const mtmd_bitmap * bitmap);
+MTMD_API unsigned char *       mtmd_bitmap_get_data_mut(mtmd_bitmap * bitmap);
 MTMD_API size_t                mtmd_bitmap_get_n_bytes(const mtmd_bitmap * bitmap);
 MTMD_API bool                  mtmd_bitmap_is_audio   (const mtmd_bitmap * bitmap);
 MTMD_API void                  mtmd_bitmap_free       (mtmd_bitmap * bitmap);
@@ -133,6 +191,25 @@ MTMD_API void                  mtmd_bitmap_free       (mtmd_bitmap * bitmap);
 MTMD_API const char * mtmd_bitmap_get_id(const mtmd_bitmap * bitmap);
 MTMD_API void         mtmd_bitmap_set_id(mtmd_bitmap * bitmap, const char * id);
 
+// mtmd_audio_stream
+//
+// audio input that is processed while it is recorded: PCM F32 samples at mtmd_get_audio_bitrate() are
+// pushed in small buffers, mel frames are computed as they arrive and every completed 30 s chunk is
+// encoded on a background thread
+// mtmd_audio_stream_finish() encodes the last, silence-padded chunk and returns an audio bitmap for
+// mtmd_tokenize(); its chunks carry their embeddings, so mtmd_encode_chunk() only copies them
+// note: each 30 s chunk is normalized on its own, as in whisper; mtmd_bitmap_init_from_audio() normalizes the full clip
+// push and finish must not be called concurrently; free the stream before the context
+typedef struct mtmd_audio_stream mtmd_audio_stream;
+// returns NULL if the model does not support audio input
+MTMD_API mtmd_audio_stream * mtmd_audio_stream_init  (mtmd_context * ctx);
+// returns 0 on success, 1 if encoding a chunk failed
+MTMD_API int32_t             mtmd_audio_stream_push  (mtmd_audio_stream * stream, const float * samples, size_t n_samples);
+// waits for the background encodes; returns NULL if no audio was pushed or an encode failed
+// the stream can then take the next utterance
+MTMD_API mtmd_bitmap *       mtmd_audio_stream_finish(mtmd_audio_stream * stream);
+MTMD_API void                mtmd_audio_stream_free  (mtmd_audio_stream * stream);
+
 
 // mtmd_input_chunks
 //
@@ -196,6 +273,24 @@ MTMD_API int32_t mtmd_tokenize(mtmd_context * ctx,
                                const mtmd_bitmap ** bitmaps,
                                size_t n_bitmaps);
 
+// mtmd_prompt
+//
+// a prompt template compiled for one context: split at its markers, with the text parts tokenized
+// once, so that a template used for every frame is not tokenized again
+// mtmd_tokenize_prompt() behaves like mtmd_tokenize() with the text of the template; it reuses the
+// entries and token buffers already in output, so pass the same chunks for every frame
+// on error, output is left empty
+// the prompt must only be used with the context it was compiled for, and is read-only once compiled
+typedef struct mtmd_prompt mtmd_prompt;
+MTMD_API mtmd_prompt * mtmd_prompt_init     (mtmd_context * ctx, const mtmd_input_text * text);
+MTMD_API size_t        mtmd_prompt_n_markers(const mtmd_prompt * prompt);
+MTMD_API void          mtmd_prompt_free     (mtmd_prompt * prompt);
+MTMD_API int32_t       mtmd_tokenize_prompt (mtmd_context * ctx,
+                                             mtmd_input_chunks * output,
+                                             const mtmd_prompt * prompt,
+                                             const mtmd_bitmap ** bitmaps,
+                                             size_t n_bitmaps);
+
 // returns 0 on success
 // TODO: deprecate
 MTMD_API int32_t mtmd_encode(mtmd_context * ctx,
@@ -205,6 +300,23 @@ MTMD_API int32_t mtmd_encode(mtmd_context * ctx,
 MTMD_API int32_t mtmd_encode_chunk(mtmd_context * ctx,
                                    const mtmd_input_chunk * chunk);
 
+// same as mtmd_encode_chunk(), and copies the output embeddings to out before another encode can
+// replace them, for callers that encode from several threads
+// out must hold llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) floats
+// returns 0 on success
+MTMD_API int32_t mtmd_encode_chunk_to(mtmd_context * ctx,
+                                      const mtmd_input_chunk * chunk,
+                                      float * out);
+
+// encode the image chunks of several prompts (e.g. crops of one frame) in one pass; the vision
+// graph is built once and reused for every image of the same size
+// the embeddings of chunks[i] start at mtmd_get_output_embd() + offsets[i] (in floats)
+// returns 0 on success
+MTMD_API int32_t mtmd_encode_chunks(mtmd_context * ctx,
+                                    const mtmd_input_chunk ** chunks,
+                                    size_t n_chunks,
+                                    size_t * offsets);
+
 // get output embeddings from the last encode pass
 // the reading size (in bytes) is equal to:
 // llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) * sizeof(float)
@@ -0,0 +1,14 @@
+package android.llama.cpp
+
+/**
+ * Answer for one camera frame of a camera session.
+ *
+ * [timestampNs] is the timestamp passed to [LLamaAndroid.submitFrame] for the frame, and
+ * [droppedFrames] the number of frames skipped since the session started because a newer
+ * frame arrived before they could be processed.
+ */
+data class CameraFrameResult(
+    val timestampNs: Long,
+    val text: String,
+    val droppedFrames: Long,
+)
@@ -1,13 +1,25 @@
 package android.llama.cpp
 
+import android.content.ComponentCallbacks2
+import android.content.Context
 import android.graphics.Bitmap
+import android.graphics.Rect
+import android.os.Build
+import android.os.PowerManager
 import android.util.Log
 import kotlinx.coroutines.CoroutineDispatcher
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.NonCancellable
 import kotlinx.coroutines.asCoroutineDispatcher
+import kotlinx.coroutines.asExecutor
 import kotlinx.coroutines.flow.Flow
+import kotlinx.coroutines.flow.FlowCollector
 import kotlinx.coroutines.flow.flow
 import kotlinx.coroutines.flow.flowOn
 import kotlinx.coroutines.withContext
+import java.io.File
+import java.util.Properties
+import java.util.concurrent.Executor
 import java.util.concurrent.Executors
 import kotlin.concurrent.thread
 
@@ -48,25 +60,65 @@ class LLamaAndroid {
     // Element classification only needs: "water", "fire", "earth", "metal", or "wood" (1-2 tokens)
     private val nlen: Int = 24
 
+    // Native camera session, guarded by sessionLock
+    private var cameraSession: Long = 0L
+    private val sessionLock = Any()
+    // Held by cameraResults() while it waits for a frame off the run loop, so the session is
+    // only freed once the wait has returned
+    private val sessionWaitLock = Any()
+
+    // Native audio stream fed by pushAudio(), guarded by audioLock
+    private var audioStream: Long = 0L
+    private val audioLock = Any()
+
+    // Native generation currently running on runLoop, guarded by generationLock
+    private var activeGeneration: Long = 0L
+    private val generationLock = Any()
+
+    // Thermal status listener, and the camera frame rate it allows; frames are guarded by sessionLock
+    private var thermalListener: Any? = null
+    @Volatile private var minFrameIntervalNs: Long = 0L
+    private var lastFrameNs: Long = Long.MIN_VALUE
+
+    // Compiled form of the last image prompt, for the mmproj it was compiled with; runLoop only
+    private var imagePrompt: Long = 0L
+    private var imagePromptText: String = ""
+
+    // Last level passed to trimMemory() and when it came, the largest vision compute buffers
+    // seen, and the usage the memory budget was last checked against; runLoop only
+    private var memoryTrimLevel: Int = 0
+    private var memoryTrimNs: Long = 0L
+    private var visionComputePeak: Long = 0L
+    private var budgetUsage: MemoryUsage? = null
+    private var budgetUsageNs: Long = 0L
+
+    // Image flows holding the mmproj, which may be suspended in emit() between native calls,
+    // and whether trimMemory() left an unload to the last of them; runLoop only
+    private var mmprojUsers: Int = 0
+    private var mmprojUnloadPending: Boolean = false
+
     private external fun log_to_android()
-    private external fun load_model(filename: String): Long
+    private external fun load_model(filename: String, nGpuLayers: Int): Long
     private external fun free_model(model: Long)
-    private external fun new_context(model: Long): Long
+    private external fun new_context(model: Long, params: LlamaParams): Long
     private external fun free_context(context: Long)
+    private external fun set_n_threads(context: Long, nThreads: Int, nThreadsBatch: Int)
+    private external fun bench_threads(context: Long, batch: Long, nThreads: Int, nThreadsBatch: Int, pp: Int, tg: Int): DoubleArray
     private external fun backend_init(numa: Boolean)
     private external fun backend_free()
     private external fun new_batch(nTokens: Int, embd: Int, nSeqMax: Int): Long
     private external fun free_batch(batch: Long)
-    private external fun new_sampler(): Long
+    private external fun new_sampler(model: Long, params: SamplerParams): Long
     private external fun free_sampler(sampler: Long)
+    private external fun sampler_check(model: Long, params: SamplerParams, nSteps: Int): Int
     private external fun bench_model(
         context: Long,
         model: Long,
-        batch: Long,
         pp: Int,
         tg: Int,
         pl: Int,
-        nr: Int
+        nr: Int,
+        json: Boolean
     ): String
 
     private external fun system_info(): String
@@ -79,31 +131,130 @@ class LLamaAndroid {
         nLen: Int
     ): Int
 
-    private external fun completion_loop(
+    private external fun generation_init(
         context: Long,
         batch: Long,
         sampler: Long,
+        nPast: Int,
         nLen: Int,
-        ncur: IntVar
-    ): String?
+        stopStrings: Array<String>,
+        stopRegex: String?,
+        stopJsonObject: Boolean,
+        nDraft: Int,
+        nNgram: Int,
+        prompt: String?
+    ): Long
+
+    private external fun generation_step(generation: Long, nMax: Int, maxMillis: Int): String?
+    private external fun generation_cancel(generation: Long)
+    private external fun generation_free(generation: Long)
 
     private external fun kv_cache_clear(context: Long)
+    private external fun kv_cache_seq_rm(context: Long, seqId: Int)
+
+    private external fun pool_init(context: Long, nBatch: Int): Long
+    private external fun pool_free(pool: Long)
+    private external fun pool_add(
+        pool: Long,
+        text: String,
+        formatChat: Boolean,
+        nLen: Int,
+        stopStrings: Array<String>,
+        stopRegex: String?,
+        stopJsonObject: Boolean,
+        sampler: SamplerParams
+    ): Int
+    private external fun pool_step(pool: Long, slot: Int, maxMillis: Int): String?
+    private external fun pool_release(pool: Long, slot: Int)
 
     // Vision/Multimodal support
-    private external fun load_mmproj(mmproj_path: String, model: Long): Long
+    private external fun load_mmproj(mmproj_path: String, model: Long, useGpu: Boolean, nThreads: Int, imagePool: Int): Long
     private external fun free_mmproj(ctx: Long)
+    private external fun load_all(
+        modelPath: String,
+        mmprojPath: String,
+        params: LlamaParams,
+        listener: LoadProgressListener?
+    ): LongArray
     private external fun bitmap_from_android(bitmap: Bitmap): Long
+    private external fun bitmap_from_android_scaled(mtmd_ctx: Long, bitmap: Bitmap): Long
     private external fun bitmap_free(bitmap: Long)
-    private external fun tokenize_with_image(mtmd_ctx: Long, prompt: String, bitmap: Long): Long
+    private external fun prompt_init(mtmd_ctx: Long, prompt: String): Long
+    private external fun prompt_free(prompt: Long)
+    private external fun tokenize_prompt(mtmd_ctx: Long, prompt: Long, bitmap: Long): Long
     private external fun chunks_free(chunks: Long)
     private external fun eval_chunks(mtmd_ctx: Long, llama_ctx: Long, chunks: Long, n_past: Int, n_batch: Int): Long
+    private external fun eval_chunks_cached(mtmd_ctx: Long, llama_ctx: Long, chunks: Long, n_batch: Int): Long
+    private external fun prefix_cache_trim(llama_ctx: Long)
+    private external fun session_save(llama_ctx: Long, modelPath: String, sessionPath: String): Boolean
+    private external fun session_restore(llama_ctx: Long, modelPath: String, sessionPath: String): Int
+    private external fun warmup(mtmd_ctx: Long, llama_ctx: Long, n_batch: Int): Int
+    private external fun bench_multimodal(
+        mtmd_ctx: Long,
+        llama_ctx: Long,
+        bitmap: Bitmap,
+        prompt: String,
+        nGen: Int,
+        nWarmup: Int,
+        nReps: Int,
+        n_batch: Int
+    ): String
+    private external fun classify_chunks(mtmd_ctx: Long, llama_ctx: Long, chunks: Long, labels: Array<String>, n_batch: Int): FloatArray?
+    private external fun classify_regions(
+        mtmd_ctx: Long,
+        llama_ctx: Long,
+        bitmap: Bitmap,
+        rects: IntArray,
+        prompt: String,
+        labels: Array<String>,
+        n_batch: Int
+    ): FloatArray?
+    private external fun session_init(
+        mtmd_ctx: Long,
+        llama_ctx: Long,
+        sampler: Long,
+        prompt: String,
+        nLen: Int,
+        n_batch: Int,
+        stopStrings: Array<String>,
+        stopRegex: String?,
+        stopJsonObject: Boolean
+    ): Long
+    private external fun session_submit(session: Long, bitmap: Bitmap, timestampNs: Long): Boolean
+    private external fun session_wait(session: Long, timeoutMs: Int): Boolean
+    private external fun session_next(session: Long, timeoutMs: Int): CameraFrameResult?
+    private external fun session_close(session: Long)
+    private external fun session_free(session: Long)
+    private external fun pipeline_init(mtmd_ctx: Long, model: Long, maxPending: Int): Long
+    private external fun pipeline_free(pipeline: Long)
+    private external fun pipeline_submit(pipeline: Long, chunks: Long): Int
+    private external fun eval_chunks_pipelined(mtmd_ctx: Long, llama_ctx: Long, pipeline: Long, chunks: Long, n_batch: Int): Long
+    private external fun trace_counters(): LongArray?
+    private external fun trace_op_stats(): String?
+    private external fun trace_reset()
+    private external fun set_thermal_scale(scale: Float)
+    private external fun memory_usage(model: Long, context: Long, mmproj: Long, params: LlamaParams): LongArray
+    private external fun embd_cache_set_budget(mmproj: Long, nBytes: Long)
+    private external fun release_vision_compute(mmproj: Long)
+    private external fun set_low_memory(mmproj: Long, lowMemory: Boolean)
+    private external fun audio_stream_init(mmproj: Long): Long
+    private external fun audio_stream_push(stream: Long, samples: FloatArray, count: Int): Int
+    private external fun audio_stream_finish(stream: Long): Long
+    private external fun audio_stream_free(stream: Long)
 
-    suspend fun bench(pp: Int, tg: Int, pl: Int, nr: Int = 1): String {
+    /**
+     * Measures prompt processing ([pp] tokens) and generation ([tg] steps of [pl] sequences)
+     * speed, [nr] times after a warm-up run. Clears the KV cache.
+     *
+     * @param json return a JSON object with percentiles, devices and peak memory instead of
+     * a markdown table
+     */
+    suspend fun bench(pp: Int, tg: Int, pl: Int, nr: Int = 1, json: Boolean = false): String {
         return withContext(runLoop) {
             when (val state = threadLocalState.get()) {
                 is State.Loaded -> {
                     Log.d(tag, "bench(): $state")
-                    bench_model(state.context, state.model, state.batch, pp, tg, pl, nr)
+                    bench_model(state.context, state.model, pp, tg, pl, nr, json)
                 }
 
                 else -> throw IllegalStateException("No model loaded")
@@ -111,50 +262,177 @@ class LLamaAndroid {
         }
     }
 
-    suspend fun load(pathToModel: String) {
+    /**
+     * Benchmarks [message] about [image] end to end and returns a JSON object with
+     * p50/p95/p99 timings of each stage: bitmap conversion, preprocessing, vision encode,
+     * image-token decode, prompt prefill and per-token generation of [nGen] tokens.
+     *
+     * [nWarmup] untimed runs come before [nReps] timed ones. Tokens are sampled greedily,
+     * whatever [setSampler] configured. Clears the KV cache and the image embedding cache.
+     */
+    suspend fun benchMultimodal(
+        message: String,
+        image: Bitmap,
+        nGen: Int = 16,
+        nWarmup: Int = 1,
+        nReps: Int = 5
+    ): String {
+        return withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    bench_multimodal(state.mmproj, state.context, image, message, nGen, nWarmup, nReps, 128)
+                }
+                else -> throw IllegalStateException("No model loaded")
+            }
+        }
+    }
+
+    suspend fun load(pathToModel: String, params: LlamaParams = LlamaParams()) {
         withContext(runLoop) {
             when (threadLocalState.get()) {
                 is State.Idle -> {
-                    val model = load_model(pathToModel)
+                    val model = load_model(pathToModel, params.nGpuLayers)
                     if (model == 0L)  throw IllegalStateException("load_model() failed")
 
-                    val context = new_context(model)
-                    if (context == 0L) throw IllegalStateException("new_context() failed")
+                    var context = 0L
+                    var batch = 0L
+                    try {
+                        context = new_context(model, params)
+                        if (context == 0L) throw IllegalStateException("new_context() failed")
 
-                    // Optimized batch size for mobile: 128 tokens
-                    // Smaller batch = less memory pressure = faster vision encoding
-                    // 128 is sufficient for ~93 tokens from 128x128 images
-                    val batch = new_batch(128, 0, 1)
-                    if (batch == 0L) throw IllegalStateException("new_batch() failed")
+                        // Optimized batch size for mobile: 128 tokens
+                        // Smaller batch = less memory pressure = faster vision encoding
+                        // 128 is sufficient for ~93 tokens from 128x128 images
+                        batch = new_batch(128, 0, 1)
+                        if (batch == 0L) throw IllegalStateException("new_batch() failed")
 
-                    val sampler = new_sampler()
-                    if (sampler == 0L) throw IllegalStateException("new_sampler() failed")
+                        val sampler = newSampler(model, params.sampler)
+                        val pool = pool_init(context, 128)
 
-                    Log.i(tag, "Loaded model $pathToModel")
-                    threadLocalState.set(State.Loaded(model, context, batch, sampler))
+                        Log.i(tag, "Loaded model $pathToModel")
+                        threadLocalState.set(State.Loaded(model, context, batch, sampler, pool, params = params, modelPath = pathToModel))
+                    } catch (e: Throwable) {
+                        // Still Idle, nothing else holds the handles
+                        if (batch != 0L) free_batch(batch)
+                        if (context != 0L) free_context(context)
+                        free_model(model)
+                        throw e
+                    }
                 }
                 else -> throw IllegalStateException("Model already loaded")
             }
         }
     }
 
-    fun send(message: String, formatChat: Boolean = false): Flow<String> = flow {
+    /**
+     * Generation ends early once [stop] is met; see [StopCondition].
+     */
+    fun send(message: String, formatChat: Boolean = false, stop: StopCondition = StopCondition.NONE): Flow<String> = flow {
         when (val state = threadLocalState.get()) {
             is State.Loaded -> {
-                val ncur = IntVar(completion_init(state.context, state.batch, message, formatChat, nlen))
-                while (ncur.value <= nlen) {
-                    val str = completion_loop(state.context, state.batch, state.sampler, nlen, ncur)
-                    if (str == null) {
-                        break
-                    }
-                    emit(str)
-                }
-                kv_cache_clear(state.context)
+                // sendWithImage() leaves its prompt prefix in the KV cache;
+                // sequences of sendConcurrent() requests are kept
+                kv_cache_seq_rm(state.context, 0)
+                val nPast = completion_init(state.context, state.batch, message, formatChat, nlen)
+                generate(state, nPast, nlen, stop, message)
+                kv_cache_seq_rm(state.context, 0)
             }
             else -> {}
         }
     }.flowOn(runLoop)
 
+    /**
+     * Like [send], but on a sequence of its own, so the run loop is not held for the whole
+     * answer: concurrent requests are decoded together in one batch per token, and image
+     * prompts run in between. Needs [LlamaParams.nSeqMax] > 1, one sequence per request.
+     *
+     * @param nLen maximum number of tokens to generate
+     * @param sampler sampling of this request, the one of the loaded model by default
+     * @throws IllegalArgumentException if the grammar of [sampler] does not parse
+     */
+    fun sendConcurrent(
+        message: String,
+        formatChat: Boolean = false,
+        nLen: Int = nlen,
+        stop: StopCondition = StopCondition.NONE,
+        sampler: SamplerParams? = null
+    ): Flow<String> = flow {
+        val (pool, slot) = withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val slot = pool_add(
+                        state.pool, message, formatChat, nLen,
+                        stop.strings.toTypedArray(), stop.regex, stop.jsonObject,
+                        sampler ?: state.params.sampler
+                    )
+                    // an invalid stop regex throws IllegalArgumentException from pool_add() itself
+                    if (slot == -2) throw IllegalArgumentException("Invalid grammar")
+                    if (slot < 0) throw IllegalStateException("No free sequence, raise LlamaParams.nSeqMax")
+                    state.pool to slot
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+        // unload() frees the pool together with its requests
+        fun poolAlive() = (threadLocalState.get() as? State.Loaded)?.pool == pool
+        try {
+            while (true) {
+                // Short steps so other requests on the run loop get their turn
+                val str = withContext(runLoop) {
+                    if (poolAlive()) pool_step(pool, slot, 50) else null
+                } ?: break
+                if (str.isNotEmpty()) {
+                    emit(str)
+                }
+            }
+        } finally {
+            withContext(NonCancellable + runLoop) {
+                if (poolAlive()) pool_release(pool, slot)
+            }
+        }
+    }
+
+    /**
+     * Replaces the sampler of the loaded model, e.g. to turn on non-greedy sampling for free
+     * text. Applies from the next answer; cannot be called while a generation or camera
+     * session is running.
+     *
+     * @throws IllegalArgumentException if the grammar does not parse
+     */
+    suspend fun setSampler(params: SamplerParams) {
+        withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    if (synchronized(generationLock) { activeGeneration != 0L } ||
+                        synchronized(sessionLock) { cameraSession != 0L }) {
+                        throw IllegalStateException("Sampler in use")
+                    }
+                    val sampler = newSampler(state.model, params)
+                    free_sampler(state.sampler)
+                    threadLocalState.set(state.copy(sampler = sampler, params = state.params.copy(sampler = params)))
+                    Log.i(tag, "Sampler set to $params")
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    // Test hook: samples random logits with params from the top candidates and from the whole
+    // vocabulary of the loaded model. Returns the first step where the tokens differ, steps if none
+    internal suspend fun checkSampler(params: SamplerParams, steps: Int): Int {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val step = sampler_check(state.model, params, steps)
+                    if (step < 0) throw IllegalStateException("sampler_check() failed")
+                    step
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
     /**
      * Unloads the model and frees resources.
      *
@@ -164,9 +442,26 @@ class LLamaAndroid {
         withContext(runLoop) {
             when (val state = threadLocalState.get()) {
                 is State.Loaded -> {
+                    val session = synchronized(sessionLock) {
+                        val session = cameraSession
+                        cameraSession = 0L
+                        session
+                    }
+                    if (session != 0L) {
+                        session_close(session)
+                        synchronized(sessionWaitLock) {}
+                        session_free(session)
+                    }
+                    synchronized(audioLock) {
+                        audio_stream_free(audioStream)
+                        audioStream = 0L
+                    }
+                    releaseImagePrompt()
                     if (state.mmproj != 0L) {
                         free_mmproj(state.mmproj)
                     }
+                    // Releases the pool's sequences, so before the context goes
+                    pool_free(state.pool)
                     free_context(state.context)
                     free_model(state.model)
                     free_batch(state.batch)
@@ -179,6 +474,119 @@ class LLamaAndroid {
         }
     }
 
+    /**
+     * Picks the generation and batch thread counts that run fastest on this device and applies
+     * them to the loaded context.
+     *
+     * The result is stored in [cacheFile] and reused on later launches, so the microbenchmark
+     * only runs once per device. Use one file per model. Clears the KV cache.
+     */
+    suspend fun autotune(cacheFile: File): LlamaParams {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val cores = Runtime.getRuntime().availableProcessors()
+                    val fingerprint = "${Build.FINGERPRINT}/$cores"
+                    val cached = Properties()
+                    if (cacheFile.exists()) {
+                        cacheFile.inputStream().use { cached.load(it) }
+                    }
+
+                    val cachedThreads = cached.getProperty("nThreads")?.toIntOrNull()
+                    val cachedThreadsBatch = cached.getProperty("nThreadsBatch")?.toIntOrNull()
+                    val (nThreads, nThreadsBatch) =
+                        if (cached.getProperty("fingerprint") == fingerprint && cachedThreads != null && cachedThreadsBatch != null) {
+                            cachedThreads to cachedThreadsBatch
+                        } else {
+                            val tuned = benchThreadCounts(state, cores)
+                            val result = Properties()
+                            result.setProperty("fingerprint", fingerprint)
+                            result.setProperty("nThreads", tuned.first.toString())
+                            result.setProperty("nThreadsBatch", tuned.second.toString())
+                            cacheFile.outputStream().use { result.store(it, "LLamaAndroid autotune") }
+                            tuned
+                        }
+
+                    Log.i(tag, "autotune: using threads=$nThreads, threadsBatch=$nThreadsBatch")
+                    set_n_threads(state.context, nThreads, nThreadsBatch)
+                    val params = state.params.copy(nThreads = nThreads, nThreadsBatch = nThreadsBatch)
+                    threadLocalState.set(state.copy(params = params))
+                    params
+                }
+                else -> throw IllegalStateException("No model loaded")
+            }
+        }
+    }
+
+    // Returns the (generation, batch) thread counts with the best tg and pp speed
+    private fun benchThreadCounts(state: State.Loaded, cores: Int): Pair<Int, Int> {
+        val candidates = listOf(2, 3, 4, 6, 8, cores / 2, cores)
+            .filter { it in 1..cores }
+            .distinct()
+            .sorted()
+        var bestPp = 0.0
+        var bestTg = 0.0
+        var nThreads = candidates.first()
+        var nThreadsBatch = candidates.first()
+        for (n in candidates) {
+            val (pp, tg) = bench_threads(state.context, state.batch, n, n, 64, 16)
+            Log.i(tag, "autotune: threads=$n pp=$pp t/s tg=$tg t/s")
+            if (pp > bestPp) {
+                bestPp = pp
+                nThreadsBatch = n
+            }
+            if (tg > bestTg) {
+                bestTg = tg
+                nThreads = n
+            }
+        }
+        return nThreads to nThreadsBatch
+    }
+
+    /**
+     * Loads the text model and the multimodal projector concurrently.
+     *
+     * Equivalent to [load] followed by [loadMmproj], but the two files are read and uploaded
+     * at the same time. [listener] receives the overall progress (0..1) on the llama thread.
+     */
+    suspend fun loadAll(
+        pathToModel: String,
+        pathToMmproj: String,
+        params: LlamaParams = LlamaParams(),
+        listener: LoadProgressListener? = null
+    ) {
+        withContext(runLoop) {
+            when (threadLocalState.get()) {
+                is State.Idle -> {
+                    val (model, context, mmproj) = load_all(pathToModel, pathToMmproj, params, listener)
+
+                    var batch = 0L
+                    try {
+                        batch = new_batch(128, 0, 1)
+                        if (batch == 0L) throw IllegalStateException("new_batch() failed")
+
+                        val sampler = newSampler(model, params.sampler)
+                        val pool = pool_init(context, 128)
+
+                        Log.i(tag, "Loaded model $pathToModel and mmproj $pathToMmproj")
+                        val state = State.Loaded(model, context, batch, sampler, pool, mmproj, params, pathToModel, pathToMmproj)
+                        resetMemoryLimits()
+                        applyMemoryLimits(state)
+                        threadLocalState.set(state)
+                    } catch (e: Throwable) {
+                        // Still Idle, nothing else holds the handles
+                        if (batch != 0L) free_batch(batch)
+                        free_mmproj(mmproj)
+                        free_context(context)
+                        free_model(model)
+                        throw e
+                    }
+                }
+                else -> throw IllegalStateException("Model already loaded")
+            }
+        }
+    }
+
     /**
      * Loads multimodal projector for vision support.
      */
@@ -189,11 +597,17 @@ class LLamaAndroid {
                     if (state.mmproj != 0L) {
                         throw IllegalStateException("Mmproj already loaded")
                     }
-                    val mmproj = load_mmproj(pathToMmproj, state.model)
+                    val mmproj = load_mmproj(
+                        pathToMmproj, state.model, state.params.mmprojUseGpu, state.params.mmprojThreads,
+                        state.params.imagePool
+                    )
                     if (mmproj == 0L) throw IllegalStateException("load_mmproj() failed")
 
                     Log.i(tag, "Loaded mmproj $pathToMmproj")
-                    threadLocalState.set(state.copy(mmproj = mmproj))
+                    val loaded = state.copy(mmproj = mmproj, mmprojPath = pathToMmproj)
+                    threadLocalState.set(loaded)
+                    resetMemoryLimits()
+                    applyMemoryLimits(loaded)
                 }
                 else -> throw IllegalStateException("Model must be loaded first")
             }
@@ -201,39 +615,90 @@ class LLamaAndroid {
     }
 
     /**
-     * Sends a message with an image for vision-language processing.
+     * Saves the prompt prefix cached by [sendWithImage] to [file] in app storage, so that
+     * [restoreSession] can skip its prefill after the process is restarted.
+     *
+     * @return false if the file could not be written
      */
-    fun sendWithImage(message: String, image: Bitmap): Flow<String> = flow {
-        when (val state = threadLocalState.get()) {
-            is State.Loaded -> {
-                if (state.mmproj == 0L) {
-                    throw IllegalStateException("Mmproj not loaded. Call loadMmproj() first.")
+    suspend fun saveSession(file: File): Boolean {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> session_save(state.context, state.modelPath, file.absolutePath)
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Restores a prompt prefix saved by [saveSession]. Files written with another model file
+     * are ignored.
+     *
+     * @return false if there was nothing to restore
+     */
+    suspend fun restoreSession(file: File): Boolean {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val nTokens = session_restore(state.context, state.modelPath, file.absolutePath)
+                    Log.d(tag, "restoreSession(): $nTokens prefix tokens")
+                    nTokens >= 0
                 }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
 
-                // Convert Android Bitmap to native mtmd_bitmap
-                val bitmapPtr = bitmap_from_android(image)
+    /**
+     * Runs a blank image and one generation step through the models, so the first real frame
+     * does not pay for kernel compilation and buffer allocation. Call after [loadMmproj] or
+     * [loadAll]; clears the KV cache.
+     */
+    suspend fun warmup() {
+        withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    if (warmup(state.mmproj, state.context, 128) != 0) {
+                        throw IllegalStateException("warmup() failed")
+                    }
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Sends a message with an image for vision-language processing.
+     *
+     * Generation ends early once [stop] is met, e.g. at the end of a one-word or JSON answer.
+     */
+    fun sendWithImage(message: String, image: Bitmap, stop: StopCondition = StopCondition.NONE): Flow<String> = flow {
+        when (val loaded = threadLocalState.get()) {
+            is State.Loaded -> usingMmproj(loaded) { state ->
+                // Convert Android Bitmap to native mtmd_bitmap, downscaled towards the encoder input size
+                val bitmapPtr = bitmap_from_android_scaled(state.mmproj, image)
                 if (bitmapPtr == 0L) {
-                    throw IllegalStateException("bitmap_from_android() failed")
+                    throw IllegalStateException("bitmap_from_android_scaled() failed")
                 }
 
                 try {
                     // Tokenize text with image
                     Log.d(tag, "Tokenizing prompt: $message")
-                    val chunksPtr = tokenize_with_image(state.mmproj, message, bitmapPtr)
+                    val chunksPtr = tokenizePrompt(state, message, bitmapPtr)
                     if (chunksPtr == 0L) {
-                        throw IllegalStateException("tokenize_with_image() failed")
+                        throw IllegalStateException("tokenize_prompt() failed")
                     }
                     Log.d(tag, "✅ Tokenization successful")
 
                     try {
                         // Evaluate chunks using mtmd_helper
                         // This properly encodes image through vision encoder
+                        // The text before the image marker is reused from the previous call when unchanged
                         Log.d(tag, "Evaluating chunks...")
-                        val newNPast = eval_chunks(
+                        val newNPast = eval_chunks_cached(
                             state.mmproj,
                             state.context,
                             chunksPtr,
-                            0,      // n_past (starting position)
                             128     // n_batch: reduced from 512 to 128 for mobile memory efficiency
                                     // 128x128 images produce ~93 tokens, so 128 batch fits perfectly
                                     // Smaller batch = less memory pressure = faster single-pass encoding
@@ -245,47 +710,282 @@ class LLamaAndroid {
 
                         Log.d(tag, "✅ Chunks evaluated, new position: $newNPast")
 
-                        // Generate response tokens using completion loop
-                        val ncur = IntVar(newNPast.toInt())
-                        val maxTokens = newNPast.toInt() + nlen
-                        Log.d(tag, "Starting generation loop: ncur=$newNPast, maxTokens=$maxTokens, nlen=$nlen")
-
-                        // Buffer tokens to reduce JNI overhead and Flow emissions
-                        // Emit in chunks rather than per-token for ~10-50x speedup
-                        val buffer = StringBuilder(512)
-                        var lastFlush = System.nanoTime()
-                        var tokenCount = 0
-
-                        while (ncur.value < maxTokens) {
-                            val str = completion_loop(state.context, state.batch, state.sampler, maxTokens, ncur)
-                            if (str == null) {
-                                Log.d(tag, "Generation ended after $tokenCount tokens")
-                                break
-                            }
+                        Log.d(tag, "Starting generation: nPast=$newNPast, nlen=$nlen")
+                        generate(state, newNPast.toInt(), nlen, stop, message)
+                        Log.d(tag, "✅ Generation complete")
+
+                        // Keep the shared prompt prefix for the next frame
+                        prefix_cache_trim(state.context)
+                    } finally {
+                        chunks_free(chunksPtr)
+                    }
+                } finally {
+                    bitmap_free(bitmapPtr)
+                }
+            }
+            else -> throw IllegalStateException("Model not loaded")
+        }
+    }.flowOn(runLoop)
 
-                            tokenCount++
-                            buffer.append(str)
+    /**
+     * Scores [labels] as answers to [message] about [image] without generating text.
+     *
+     * Each label is scored by the likelihood the model assigns to its tokens after the prompt;
+     * the returned probabilities sum to 1 over [labels].
+     */
+    suspend fun classifyImage(message: String, image: Bitmap, labels: List<String>): Map<String, Float> {
+        return withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    require(labels.isNotEmpty()) { "labels must not be empty" }
 
-                            // Flush buffer when: 1) accumulated 128 chars, or 2) 50ms elapsed
-                            // This balances responsiveness vs overhead
-                            val now = System.nanoTime()
-                            val shouldFlush = buffer.length >= 128 || (now - lastFlush) > 50_000_000L
+                    val bitmapPtr = bitmap_from_android_scaled(state.mmproj, image)
+                    if (bitmapPtr == 0L) {
+                        throw IllegalStateException("bitmap_from_android_scaled() failed")
+                    }
 
-                            if (shouldFlush) {
-                                emit(buffer.toString())
-                                buffer.setLength(0)
-                                lastFlush = now
-                            }
+                    try {
+                        val chunksPtr = tokenizePrompt(state, message, bitmapPtr)
+                        if (chunksPtr == 0L) {
+                            throw IllegalStateException("tokenize_prompt() failed")
+                        }
+
+                        try {
+                            val probs = classify_chunks(state.mmproj, state.context, chunksPtr, labels.toTypedArray(), 128)
+                                ?: throw IllegalStateException("classify_chunks() failed")
+                            labels.zip(probs.toList()).toMap()
+                        } finally {
+                            chunks_free(chunksPtr)
+                        }
+                    } finally {
+                        bitmap_free(bitmapPtr)
+                    }
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Scores [labels] for each of [regions] of [image], e.g. the objects detected in one AR frame.
+     *
+     * The crops are made natively from one pixel lock and encoded together, and the regions are
+     * scored as parallel sequences, so N regions cost much less than N [classifyImage] calls.
+     * [message] must have text after the image marker.
+     *
+     * @return label probabilities per region, in the order of [regions]
+     */
+    suspend fun classifyRegions(
+        message: String,
+        image: Bitmap,
+        regions: List<Rect>,
+        labels: List<String>
+    ): List<Map<String, Float>> {
+        return withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    require(labels.isNotEmpty()) { "labels must not be empty" }
+
+                    val rects = IntArray(regions.size * 4)
+                    regions.forEachIndexed { i, rect ->
+                        rects[i * 4 + 0] = rect.left
+                        rects[i * 4 + 1] = rect.top
+                        rects[i * 4 + 2] = rect.right
+                        rects[i * 4 + 3] = rect.bottom
+                    }
+                    val probs = classify_regions(state.mmproj, state.context, image, rects, message, labels.toTypedArray(), 128)
+                        ?: throw IllegalStateException("classify_regions() failed")
+                    regions.indices.map { r ->
+                        labels.indices.associate { l -> labels[l] to probs[r * labels.size + l] }
+                    }
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Starts a camera session that answers [message] for the latest submitted frame.
+     *
+     * Frames are passed with [submitFrame] and answers collected from [cameraResults].
+     * A frame that is still waiting when a newer one arrives is dropped.
+     */
+    suspend fun startCameraSession(message: String, stop: StopCondition = StopCondition.NONE) {
+        withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    synchronized(sessionLock) {
+                        if (cameraSession != 0L) {
+                            throw IllegalStateException("Camera session already started")
                         }
+                        val session = session_init(
+                            state.mmproj, state.context, state.sampler, message, nlen, 128,
+                            stop.strings.toTypedArray(), stop.regex, stop.jsonObject
+                        )
+                        if (session == 0L) throw IllegalStateException("session_init() failed")
+                        cameraSession = session
+                        lastFrameNs = Long.MIN_VALUE
+                    }
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Hands a camera frame to the running session. Call from a single thread, typically the
+     * camera analyzer; the bitmap can be reused as soon as this returns.
+     *
+     * @return false if there is no session
+     */
+    fun submitFrame(image: Bitmap, timestampNs: Long): Boolean {
+        synchronized(sessionLock) {
+            if (cameraSession == 0L) {
+                return false
+            }
+            if (lastFrameNs != Long.MIN_VALUE && timestampNs - lastFrameNs < minFrameIntervalNs) {
+                // throttled while the device is hot
+                return true
+            }
+            lastFrameNs = timestampNs
+            if (session_submit(cameraSession, image, timestampNs)) {
+                Log.d(tag, "Dropped a stale camera frame")
+            }
+            return true
+        }
+    }
+
+    /**
+     * Answers for the submitted frames, newest frame first whenever inference falls behind.
+     * Completes when [stopCameraSession] is called.
+     */
+    fun cameraResults(): Flow<CameraFrameResult> = flow {
+        val session = synchronized(sessionLock) { cameraSession }
+        if (session == 0L) {
+            throw IllegalStateException("Camera session not started")
+        }
+        fun running() = synchronized(sessionLock) { cameraSession == session }
+        // Frames are waited for here, off the run loop, and only the inference runs on it, so
+        // other calls get the run loop between frames. stopCameraSession() frees the session
+        // on runLoop, so it is checked before every native call
+        while (running()) {
+            val ready = synchronized(sessionWaitLock) { running() && session_wait(session, 100) }
+            if (!ready) {
+                continue
+            }
+            val result = withContext(runLoop) {
+                if (running()) session_next(session, 0) else null
+            }
+            if (result != null) {
+                emit(result)
+            }
+        }
+    }.flowOn(Dispatchers.IO)
+
+    /**
+     * Stops the camera session; [cameraResults] completes after the frame in progress.
+     */
+    suspend fun stopCameraSession() {
+        val session = synchronized(sessionLock) {
+            val session = cameraSession
+            cameraSession = 0L
+            lastFrameNs = Long.MIN_VALUE
+            session
+        }
+        if (session == 0L) {
+            return
+        }
+        session_close(session)
+        // session_close() wakes a cameraResults() wait, the frame in progress finishes on runLoop
+        synchronized(sessionWaitLock) {}
+        withContext(runLoop) {
+            session_free(session)
+        }
+    }
 
-                        // Emit remaining buffered tokens
-                        if (buffer.isNotEmpty()) {
-                            emit(buffer.toString())
+    /**
+     * Starts streaming audio input for [sendWithAudio]; requires an mmproj with an audio encoder.
+     *
+     * Samples passed to [pushAudio] are turned into mel frames as they arrive and every full
+     * 30 s chunk is encoded in the background, so only the last chunk is left when the question
+     * is sent. Does nothing if a stream is already running.
+     */
+    suspend fun startAudioStream() {
+        withContext(runLoop) {
+            when (val loaded = threadLocalState.get()) {
+                is State.Loaded -> {
+                    val state = withMmproj(loaded)
+                    synchronized(audioLock) {
+                        if (audioStream == 0L) {
+                            audioStream = audio_stream_init(state.mmproj)
+                            if (audioStream == 0L) throw IllegalStateException("audio_stream_init() failed")
                         }
+                    }
+                }
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
 
-                        Log.d(tag, "✅ Generation complete: $tokenCount tokens")
+    /**
+     * Appends the first [count] mono float PCM samples, at the rate the audio encoder expects
+     * (16 kHz for Whisper-based models). Call from the recorder thread; [samples] can be reused
+     * as soon as this returns.
+     *
+     * @return false if there is no stream or encoding a chunk failed
+     */
+    fun pushAudio(samples: FloatArray, count: Int = samples.size): Boolean {
+        synchronized(audioLock) {
+            if (audioStream == 0L) {
+                return false
+            }
+            return audio_stream_push(audioStream, samples, count) == 0
+        }
+    }
 
-                        kv_cache_clear(state.context)
+    /**
+     * Sends [message] about the audio pushed since the stream was started or last sent. The
+     * message needs the media marker where the audio goes, as for images.
+     *
+     * Waits for the chunks still being encoded; samples pushed meanwhile go to the next recording.
+     */
+    fun sendWithAudio(message: String, stop: StopCondition = StopCondition.NONE): Flow<String> = flow {
+        when (val loaded = threadLocalState.get()) {
+            is State.Loaded -> usingMmproj(loaded) { state ->
+                // Swap in a fresh stream so pushAudio() is not held up while the encodes finish
+                val stream = synchronized(audioLock) {
+                    val stream = audioStream
+                    if (stream == 0L) {
+                        throw IllegalStateException("Audio stream not started")
+                    }
+                    audioStream = audio_stream_init(state.mmproj)
+                    stream
+                }
+                val bitmapPtr = try {
+                    audio_stream_finish(stream)
+                } finally {
+                    audio_stream_free(stream)
+                }
+                if (bitmapPtr == 0L) {
+                    throw IllegalStateException("audio_stream_finish() failed")
+                }
+
+                try {
+                    val chunksPtr = tokenizePrompt(state, message, bitmapPtr)
+                    if (chunksPtr == 0L) {
+                        throw IllegalStateException("tokenize_prompt() failed")
+                    }
+                    try {
+                        // Audio chunks carry their embeddings, so this only decodes them
+                        val newNPast = eval_chunks_cached(state.mmproj, state.context, chunksPtr, 128)
+                        if (newNPast < 0) {
+                            throw IllegalStateException("eval_chunks() failed")
+                        }
+                        generate(state, newNPast.toInt(), nlen, stop, message)
+                        prefix_cache_trim(state.context)
                     } finally {
                         chunks_free(chunksPtr)
                     }
@@ -297,22 +997,448 @@ class LLamaAndroid {
         }
     }.flowOn(runLoop)
 
-    companion object {
-        private class IntVar(value: Int) {
-            @Volatile
-            var value: Int = value
-                private set
-
-            fun inc() {
-                synchronized(this) {
-                    value += 1
+    /**
+     * Stops the audio stream and drops the audio not sent yet.
+     */
+    suspend fun stopAudioStream() {
+        withContext(runLoop) {
+            synchronized(audioLock) {
+                audio_stream_free(audioStream)
+                audioStream = 0L
+            }
+        }
+    }
+
+    /**
+     * Sends the same message with each image in turn, emitting one complete answer per image.
+     *
+     * The vision encoder works on the next image in the background while the answer for the
+     * current one is generated.
+     */
+    fun sendWithImages(message: String, images: List<Bitmap>, stop: StopCondition = StopCondition.NONE): Flow<String> = flow {
+        when (val loaded = threadLocalState.get()) {
+            is State.Loaded -> usingMmproj(loaded) { state ->
+                val pipeline = pipeline_init(state.mmproj, state.model, PIPELINE_DEPTH)
+                if (pipeline == 0L) {
+                    throw IllegalStateException("pipeline_init() failed")
+                }
+
+                // (bitmap, chunks) of the frames submitted to the pipeline, oldest first
+                val pending = ArrayDeque<Pair<Long, Long>>()
+                var next = 0
+
+                fun submitNext() {
+                    val bitmapPtr = bitmap_from_android_scaled(state.mmproj, images[next++])
+                    if (bitmapPtr == 0L) {
+                        throw IllegalStateException("bitmap_from_android_scaled() failed")
+                    }
+                    val chunksPtr = tokenizePrompt(state, message, bitmapPtr)
+                    if (chunksPtr == 0L) {
+                        bitmap_free(bitmapPtr)
+                        throw IllegalStateException("tokenize_prompt() failed")
+                    }
+                    pending.addLast(bitmapPtr to chunksPtr)
+                    if (pipeline_submit(pipeline, chunksPtr) != 0) {
+                        throw IllegalStateException("pipeline_submit() failed")
+                    }
+                }
+
+                try {
+                    while (next < images.size && pending.size < PIPELINE_DEPTH) {
+                        submitNext()
+                    }
+
+                    while (pending.isNotEmpty()) {
+                        val (bitmapPtr, chunksPtr) = pending.removeFirst()
+                        try {
+                            val newNPast = eval_chunks_pipelined(state.mmproj, state.context, pipeline, chunksPtr, 128)
+                            if (newNPast < 0) {
+                                throw IllegalStateException("eval_chunks_pipelined() failed")
+                            }
+
+                            // Queue the next frame so its encoding overlaps this generation
+                            if (next < images.size) {
+                                submitNext()
+                            }
+
+                            emit(generateAnswer(state, newNPast.toInt(), stop, message))
+                            prefix_cache_trim(state.context)
+                        } finally {
+                            chunks_free(chunksPtr)
+                            bitmap_free(bitmapPtr)
+                        }
+                    }
+                } finally {
+                    // Stops the worker before the chunks it may still reference are freed
+                    pipeline_free(pipeline)
+                    for ((bitmapPtr, chunksPtr) in pending) {
+                        chunks_free(chunksPtr)
+                        bitmap_free(bitmapPtr)
+                    }
                 }
             }
+            else -> throw IllegalStateException("Model not loaded")
         }
+    }.flowOn(runLoop)
+
+    private fun generateAnswer(state: State.Loaded, nPast: Int, stop: StopCondition, prompt: String): String {
+        val answer = StringBuilder()
+        runGeneration(state, nPast, nlen, stop, prompt) { answer.append(it) }
+        return answer.toString()
+    }
+
+    /**
+     * Generates up to [nLen] tokens after position [nPast], emitting text in batches.
+     *
+     * [prompt] is searched for draft tokens when [LlamaParams.draftTokens] is set.
+     */
+    private suspend fun FlowCollector<String>.generate(
+        state: State.Loaded,
+        nPast: Int,
+        nLen: Int,
+        stop: StopCondition,
+        prompt: String
+    ) {
+        runGeneration(state, nPast, nLen, stop, prompt) { emit(it) }
+    }
+
+    private inline fun runGeneration(
+        state: State.Loaded,
+        nPast: Int,
+        nLen: Int,
+        stop: StopCondition,
+        prompt: String,
+        onText: (String) -> Unit
+    ) {
+        // setSampler() may have replaced the sampler of state while a flow with several
+        // answers was suspended between them, so each answer takes the current one
+        val sampler = (threadLocalState.get() as? State.Loaded)?.sampler ?: state.sampler
+        val generation = generation_init(
+            state.context, state.batch, sampler, nPast, nLen,
+            stop.strings.toTypedArray(), stop.regex, stop.jsonObject,
+            state.params.draftTokens, state.params.draftNgram, prompt
+        )
+        synchronized(generationLock) { activeGeneration = generation }
+        try {
+            // One JNI call per 16 tokens or 50ms, whichever comes first
+            while (true) {
+                val str = generation_step(generation, 16, 50) ?: break
+                if (str.isNotEmpty()) {
+                    onText(str)
+                }
+            }
+        } finally {
+            synchronized(generationLock) { activeGeneration = 0L }
+            generation_free(generation)
+        }
+    }
+
+    /**
+     * Stops the generation in progress, if any. Safe to call from any thread.
+     *
+     * The running flow completes normally with the text generated so far.
+     */
+    fun cancelGeneration() {
+        synchronized(generationLock) {
+            if (activeGeneration != 0L) {
+                generation_cancel(activeGeneration)
+            }
+        }
+    }
+
+    /**
+     * Reads the native counters in one call without waiting for the run loop.
+     *
+     * @return null unless the library was built with tracing (gradle `-PllamaTrace=ON`)
+     */
+    fun traceCounters(): TraceCounters? = trace_counters()?.let { TraceCounters.fromArray(it) }
+
+    /**
+     * Time spent in each ggml op of the text model as a JSON array of `{"op", "count", "us"}`,
+     * slowest first. Only filled when the model was loaded with [LlamaParams.traceOps].
+     *
+     * @return null unless the library was built with tracing
+     */
+    fun traceOpStats(): String? = trace_op_stats()
+
+    /**
+     * Zeroes the trace counters and op times. No-op without tracing.
+     */
+    fun traceReset() = trace_reset()
+
+    /**
+     * Follows the device thermal status (Android 10+) to keep sustained speed up: as the status
+     * rises, fewer text and vision encoder threads run and [submitFrame] drops camera frames
+     * down to 5, 2 and 1 per second. Throttling less than the hardware would keeps the SoC
+     * out of its lowest clocks. No-op on older versions.
+     */
+    fun enableThermalAdaptation(context: Context) {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.Q) {
+            return
+        }
+        val powerManager = context.getSystemService(PowerManager::class.java) ?: return
+        synchronized(sessionLock) {
+            if (thermalListener != null) {
+                return
+            }
+            // called with the current status right away, then on every change. Runs on the
+            // calling binder thread rather than runLoop, which a camera session keeps busy
+            val listener = PowerManager.OnThermalStatusChangedListener { status -> applyThermalStatus(status) }
+            powerManager.addThermalStatusListener(Executor { it.run() }, listener)
+            thermalListener = listener
+        }
+    }
+
+    /**
+     * Stops following the thermal status and restores full thread counts and frame rate.
+     */
+    fun disableThermalAdaptation(context: Context) {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.Q) {
+            return
+        }
+        val powerManager = context.getSystemService(PowerManager::class.java) ?: return
+        synchronized(sessionLock) {
+            val listener = thermalListener as? PowerManager.OnThermalStatusChangedListener ?: return
+            powerManager.removeThermalStatusListener(listener)
+            thermalListener = null
+        }
+        applyThermalStatus(PowerManager.THERMAL_STATUS_NONE)
+    }
+
+    // Any thread: the native thread counts are set under their own locks and read by the next
+    // decode or encode graph
+    private fun applyThermalStatus(status: Int) {
+        val limits = ThermalLimits.fromStatus(status)
+        minFrameIntervalNs = limits.minFrameIntervalNs
+        Log.i(tag, "Thermal status $status: thread scale ${limits.threadScale}, min frame interval ${limits.minFrameIntervalNs / 1_000_000} ms")
+        set_thermal_scale(limits.threadScale)
+    }
+
+    /**
+     * Native memory held by the text model, its KV cache and the vision encoder.
+     */
+    suspend fun memoryUsage(): MemoryUsage {
+        return withContext(runLoop) {
+            when (val state = threadLocalState.get()) {
+                is State.Loaded -> memoryUsage(state)
+                else -> throw IllegalStateException("Model not loaded")
+            }
+        }
+    }
+
+    /**
+     * Gives native memory back at a [ComponentCallbacks2] trim level; call from
+     * `onTrimMemory()`. Returns right away, the work runs on the llama thread.
+     *
+     * RUNNING_MODERATE shrinks the image embedding cache. RUNNING_LOW, UI_HIDDEN and BACKGROUND
+     * drop it and free the vision encoder compute buffers after every image. RUNNING_CRITICAL,
+     * MODERATE and COMPLETE also unload the mmproj, which the next image call loads again;
+     * it stays loaded while a camera session or audio stream runs, and is unloaded once the
+     * image flows in progress are done. Level 0 restores normal operation.
+     *
+     * The system never sends level 0 itself: UI_HIDDEN and above end with the next image call,
+     * which means the app is in use again, and the RUNNING levels lapse after a minute unless
+     * they are sent again.
+     */
+    fun trimMemory(level: Int) {
+        runLoop.asExecutor().execute {
+            memoryTrimLevel = level
+            memoryTrimNs = System.nanoTime()
+            val state = threadLocalState.get() as? State.Loaded ?: return@execute
+            if (state.mmproj == 0L) {
+                return@execute
+            }
+            if (unloadMmprojIfTrimmed(state)) {
+                return@execute
+            }
+            applyMemoryLimits(state)
+            if (level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW) {
+                release_vision_compute(state.mmproj)
+            }
+            Log.i(tag, "Trim level $level: ${memoryUsage(state)}")
+        }
+    }
+
+    // A grammar is the only part of SamplerParams that can be rejected, it comes from the app
+    private fun newSampler(model: Long, params: SamplerParams): Long {
+        val sampler = new_sampler(model, params)
+        if (sampler == 0L) {
+            if (params.grammar.isNotEmpty()) throw IllegalArgumentException("Invalid grammar")
+            throw IllegalStateException("new_sampler() failed")
+        }
+        return sampler
+    }
+
+    // Runs on runLoop: frees the mmproj if the trim level asks for it and nothing uses it; waits
+    // for the last image flow when one is in progress. Returns true if the mmproj was freed
+    private fun unloadMmprojIfTrimmed(state: State.Loaded): Boolean {
+        val unload = memoryTrimLevel == ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL ||
+            memoryTrimLevel >= ComponentCallbacks2.TRIM_MEMORY_MODERATE
+        val streaming = synchronized(sessionLock) { cameraSession != 0L } ||
+            synchronized(audioLock) { audioStream != 0L }
+        if (!unload || streaming || state.mmproj == 0L) {
+            return false
+        }
+        if (mmprojUsers > 0) {
+            mmprojUnloadPending = true
+            return false
+        }
+        releaseImagePrompt()
+        free_mmproj(state.mmproj)
+        threadLocalState.set(state.copy(mmproj = 0L))
+        Log.i(tag, "Trim level $memoryTrimLevel: unloaded mmproj")
+        return true
+    }
+
+    // Runs on runLoop: withMmproj() for a flow, which may suspend in emit() while it holds the
+    // mmproj, its pipeline worker or its sampler; calls running to completion on runLoop cannot
+    // overlap trimMemory() and use withMmproj() alone
+    private inline fun <T> usingMmproj(loaded: State.Loaded, block: (State.Loaded) -> T): T {
+        val state = withMmproj(loaded)
+        mmprojUsers++
+        try {
+            return block(state)
+        } finally {
+            mmprojUsers--
+            if (mmprojUsers == 0 && mmprojUnloadPending) {
+                mmprojUnloadPending = false
+                (threadLocalState.get() as? State.Loaded)?.let { unloadMmprojIfTrimmed(it) }
+            }
+        }
+    }
+
+    // Runs on runLoop: tokenizes message with the image; the template is only compiled when the
+    // message changes, so a repeated prompt skips its text tokenization. Returns 0 on failure
+    private fun tokenizePrompt(state: State.Loaded, message: String, bitmap: Long): Long {
+        if (imagePrompt == 0L || imagePromptText != message) {
+            releaseImagePrompt()
+            imagePrompt = prompt_init(state.mmproj, message)
+            if (imagePrompt == 0L) {
+                return 0L
+            }
+            imagePromptText = message
+        }
+        return tokenize_prompt(state.mmproj, imagePrompt, bitmap)
+    }
+
+    // Runs on runLoop, before the mmproj the prompt was compiled with is freed
+    private fun releaseImagePrompt() {
+        if (imagePrompt != 0L) {
+            prompt_free(imagePrompt)
+            imagePrompt = 0L
+            imagePromptText = ""
+        }
+    }
+
+    private fun memoryUsage(state: State.Loaded): MemoryUsage =
+        MemoryUsage.fromArray(memory_usage(state.model, state.context, state.mmproj, state.params))
+
+    // Runs on runLoop: reloads an mmproj unloaded by trimMemory() and applies the memory limits
+    private fun withMmproj(state: State.Loaded): State.Loaded {
+        expireMemoryTrim()
+        if (state.mmproj != 0L) {
+            applyMemoryLimits(state)
+            return state
+        }
+        if (state.mmprojPath.isEmpty()) {
+            throw IllegalStateException("Mmproj not loaded. Call loadMmproj() first.")
+        }
+        val mmproj = load_mmproj(
+            state.mmprojPath, state.model, state.params.mmprojUseGpu, state.params.mmprojThreads,
+            state.params.imagePool
+        )
+        if (mmproj == 0L) throw IllegalStateException("load_mmproj() failed")
+
+        Log.i(tag, "Reloaded mmproj ${state.mmprojPath}")
+        val loaded = state.copy(mmproj = mmproj)
+        threadLocalState.set(loaded)
+        resetMemoryLimits()
+        applyMemoryLimits(loaded)
+        return loaded
+    }
+
+    // Runs on runLoop: sizes the embedding cache and picks low-memory mode for the trim level
+    // and LlamaParams.memoryBudgetMb. Over budget, the cache shrinks first; if the rest does not
+    // fit either, the vision compute buffers are freed after every image
+    private fun applyMemoryLimits(state: State.Loaded) {
+        if (state.mmproj == 0L) {
+            return
+        }
+        var cacheBytes = when {
+            memoryTrimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW -> 0L
+            memoryTrimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_MODERATE -> EMBD_CACHE_BYTES / 4
+            else -> EMBD_CACHE_BYTES
+        }
+        var lowMemory = memoryTrimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW
+        val budget = state.params.memoryBudgetMb.toLong() shl 20
+        if (budget > 0) {
+            // the model sizes are fixed and the buffers change little between images, so the
+            // native counters and /proc are only read again every BUDGET_USAGE_NS
+            val now = System.nanoTime()
+            val usage = budgetUsage?.takeIf { now - budgetUsageNs < BUDGET_USAGE_NS }
+                ?: memoryUsage(state).also {
+                    budgetUsage = it
+                    budgetUsageNs = now
+                }
+            // low-memory mode frees the compute buffers between images, so count their peak
+            visionComputePeak = maxOf(visionComputePeak, usage.visionCompute)
+            val rest = usage.total - usage.embdCache - usage.visionCompute + visionComputePeak
+            cacheBytes = cacheBytes.coerceAtMost((budget - rest).coerceAtLeast(0L))
+            lowMemory = lowMemory || rest > budget
+        }
+        embd_cache_set_budget(state.mmproj, cacheBytes)
+        set_low_memory(state.mmproj, lowMemory)
+    }
+
+    // Runs on runLoop, after an mmproj was loaded
+    private fun resetMemoryLimits() {
+        visionComputePeak = 0L
+        budgetUsage = null
+    }
+
+    // Runs on runLoop: ends a trim level the system will not lift, see trimMemory()
+    private fun expireMemoryTrim() {
+        if (memoryTrimLevel == 0) {
+            return
+        }
+        if (memoryTrimLevel >= ComponentCallbacks2.TRIM_MEMORY_UI_HIDDEN ||
+            System.nanoTime() - memoryTrimNs >= TRIM_RESTORE_NS) {
+            Log.i(tag, "Trim level $memoryTrimLevel lifted")
+            memoryTrimLevel = 0
+        }
+    }
+
+    fun interface LoadProgressListener {
+        fun onProgress(progress: Float)
+    }
+
+    companion object {
+        // Frames that may be encoded ahead of the one being generated
+        private const val PIPELINE_DEPTH = 2
+
+        // Image embedding cache budget set by mmproj_params() in the native layer
+        private const val EMBD_CACHE_BYTES = 16L shl 20
+
+        // How long a RUNNING_* trim level lasts without being sent again
+        private const val TRIM_RESTORE_NS = 60_000_000_000L
+
+        // How long memory usage read for LlamaParams.memoryBudgetMb is reused
+        private const val BUDGET_USAGE_NS = 1_000_000_000L
 
         private sealed interface State {
             data object Idle: State
-            data class Loaded(val model: Long, val context: Long, val batch: Long, val sampler: Long, val mmproj: Long = 0L): State
+            data class Loaded(
+                val model: Long,
+                val context: Long,
+                val batch: Long,
+                val sampler: Long,
+                val pool: Long,
+                val mmproj: Long = 0L,
+                val params: LlamaParams = LlamaParams(),
+                val modelPath: String = "",
+                // Kept when trimMemory() unloads the mmproj, so the next image call reloads it
+                val mmprojPath: String = ""
+            ): State
         }
 
         // Enforce only one instance of Llm.
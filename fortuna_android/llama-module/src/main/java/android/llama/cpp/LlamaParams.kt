@@ -0,0 +1,54 @@
+package android.llama.cpp
+
+/**
+ * Model, context and vision encoder settings passed to the native layer.
+ *
+ * The defaults match the settings that used to be hard-coded in the JNI code.
+ * Thread counts of 0 let the native side pick the performance cores (2..6 for the text model),
+ * read from the CPU capacities in sysfs. Text threads are pinned to the fastest cores and the
+ * vision encoder to the remaining performance cores when at least two are left.
+ */
+data class LlamaParams(
+    val nCtx: Int = 1024,
+    val nBatch: Int = 2048,
+    val nUbatch: Int = 512,
+    val typeK: Int = GGML_TYPE_Q4_0,
+    val typeV: Int = GGML_TYPE_Q4_0,
+    val flashAttention: Boolean = true,
+    // Sequences in the context: seq 0 serves send()/sendWithImage(), the others run
+    // sendConcurrent() requests and the labels classifyImage() scores per decode.
+    // 1 = no concurrent requests, labels and regions are scored one after another
+    val nSeqMax: Int = 1,
+    // One KV cache shared by all sequences instead of n_ctx / nSeqMax cells each;
+    // with nSeqMax > 1, copies of a prompt then share its cells
+    val kvUnified: Boolean = false,
+    // Generation (single token) vs prompt/batch processing threads
+    val nThreads: Int = 0,
+    val nThreadsBatch: Int = 0,
+    // Model layers to offload to the GPU, 999 = all
+    val nGpuLayers: Int = 999,
+    val mmprojUseGpu: Boolean = true,
+    val mmprojThreads: Int = 0,
+    // Average-pool image tokens in imagePool x imagePool blocks before they are decoded, 1 = off.
+    // 2 cuts image prefill by ~4x; models without a spatial token layout are not pooled
+    val imagePool: Int = 1,
+    // Cap on the native memory counted by LLamaAndroid.memoryUsage(), 0 = none. Over it the image
+    // embedding cache shrinks, then vision compute buffers are freed after every image
+    val memoryBudgetMb: Int = 0,
+    // Prompt lookup: tokens drafted from earlier text and verified in one decode, 0 = off
+    val draftTokens: Int = 0,
+    // Longest n-gram matched against the prompt and answer so far to find a draft
+    val draftNgram: Int = 3,
+    // Time every ggml op of the text model via the scheduler eval callback; tracing builds only.
+    // Ops then run one at a time, which slows decoding down
+    val traceOps: Boolean = false,
+    // Token sampling, greedy by default; LLamaAndroid.setSampler() changes it on a loaded model
+    val sampler: SamplerParams = SamplerParams(),
+) {
+    companion object {
+        // Values of enum ggml_type, for typeK / typeV
+        const val GGML_TYPE_F16 = 1
+        const val GGML_TYPE_Q4_0 = 2
+        const val GGML_TYPE_Q8_0 = 8
+    }
+}
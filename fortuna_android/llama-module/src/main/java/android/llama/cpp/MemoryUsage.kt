@@ -0,0 +1,36 @@
+package android.llama.cpp
+
+/**
+ * Native memory held by the loaded models, in bytes, from [LLamaAndroid.memoryUsage].
+ *
+ * [total] adds up what the native layer accounts for; [rss] is the resident size of the whole
+ * process, including the Java heap and the model pages mapped from disk.
+ */
+data class MemoryUsage(
+    val textModel: Long,
+    // K and V buffers of the context, allocated in full at load
+    val kvCache: Long,
+    // Encoder weights, mapped from the file when mmap is used
+    val visionModel: Long,
+    // Encoder compute buffers, freed by LLamaAndroid.trimMemory() and in low-memory mode
+    val visionCompute: Long,
+    val embdCache: Long,
+    // Output and pooling buffers of the last encode
+    val embd: Long,
+    val rss: Long,
+) {
+    val total: Long
+        get() = textModel + kvCache + visionModel + visionCompute + embdCache + embd
+
+    companion object {
+        internal fun fromArray(values: LongArray) = MemoryUsage(
+            textModel = values[0],
+            kvCache = values[1],
+            visionModel = values[2],
+            visionCompute = values[3],
+            embdCache = values[4],
+            embd = values[5],
+            rss = values[6],
+        )
+    }
+}
@@ -0,0 +1,27 @@
+package android.llama.cpp
+
+/**
+ * How the next token is picked, for [LlamaParams.sampler] and [LLamaAndroid.setSampler].
+ *
+ * The defaults are greedy decoding. With a temperature above 0 the token is drawn from the
+ * topK most likely ones after the topP and minP cuts. Only those candidates are taken from
+ * the logits, so sampling does not get slower with the size of the vocabulary.
+ */
+data class SamplerParams(
+    // 0 = greedy
+    val temperature: Float = 0f,
+    // 0 = the whole vocabulary, which gives up the fast candidate selection
+    val topK: Int = 40,
+    // 1 = off
+    val topP: Float = 1f,
+    // 0 = off
+    val minP: Float = 0f,
+    // Divides the logits of the last repeatLastN sampled tokens, 1 = off; below 1 favours
+    // repeats and samples from the whole vocabulary, which is slower
+    val repeatPenalty: Float = 1f,
+    val repeatLastN: Int = 64,
+    // GBNF grammar the answer has to follow, "" = none
+    val grammar: String = "",
+    // -1 = a random seed per sampler
+    val seed: Int = -1,
+)
@@ -0,0 +1,19 @@
+package android.llama.cpp
+
+/**
+ * Conditions that end a generation before the token limit, checked natively against the
+ * generated text after every token.
+ *
+ * The answer ends before the first of [strings], after the first match of [regex], or after
+ * the brace that closes the first JSON object when [jsonObject] is set, whichever comes first.
+ */
+data class StopCondition(
+    val strings: List<String> = emptyList(),
+    // ECMAScript syntax, matched against all of the text generated so far
+    val regex: String? = null,
+    val jsonObject: Boolean = false,
+) {
+    companion object {
+        val NONE = StopCondition()
+    }
+}
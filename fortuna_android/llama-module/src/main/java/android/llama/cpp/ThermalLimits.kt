@@ -0,0 +1,22 @@
+package android.llama.cpp
+
+import android.os.PowerManager
+
+/**
+ * What [LLamaAndroid.enableThermalAdaptation] allows at a device thermal status.
+ */
+internal data class ThermalLimits(
+    // Fraction of the configured text and vision encoder threads that run
+    val threadScale: Float,
+    // Camera frames closer together than this are dropped, 0 = all frames
+    val minFrameIntervalNs: Long,
+) {
+    companion object {
+        fun fromStatus(status: Int) = when {
+            status >= PowerManager.THERMAL_STATUS_CRITICAL -> ThermalLimits(0.25f, 1_000_000_000L)
+            status >= PowerManager.THERMAL_STATUS_SEVERE -> ThermalLimits(0.5f, 500_000_000L)
+            status >= PowerManager.THERMAL_STATUS_MODERATE -> ThermalLimits(0.75f, 200_000_000L)
+            else -> ThermalLimits(1.0f, 0L)
+        }
+    }
+}
@@ -0,0 +1,35 @@
+package android.llama.cpp
+
+/**
+ * Snapshot of the native counters kept by a tracing build (gradle `-PllamaTrace=ON`).
+ *
+ * Counters only grow until [LLamaAndroid.traceReset]; diff two snapshots to measure a run.
+ * The order matches enum mtmd_trace_counter in mtmd/mtmd-trace.h.
+ */
+data class TraceCounters(
+    // Bitmaps tokenized: camera frames, photos and audio clips
+    val frames: Long,
+    val imagesEncoded: Long,
+    val embdCacheHits: Long,
+    // Text and image tokens decoded as prompt
+    val promptTokens: Long,
+    val generatedTokens: Long,
+    // Prompt tokens reused from the KV cache instead of being decoded
+    val prefixCacheTokens: Long,
+    // Vision encoder graphs built, once per new image size
+    val encoderGraphs: Long,
+    val bytesAllocated: Long,
+) {
+    companion object {
+        internal fun fromArray(values: LongArray) = TraceCounters(
+            frames = values[0],
+            imagesEncoded = values[1],
+            embdCacheHits = values[2],
+            promptTokens = values[3],
+            generatedTokens = values[4],
+            prefixCacheTokens = values[5],
+            encoderGraphs = values[6],
+            bytesAllocated = values[7],
+        )
+    }
+}
@@ -0,0 +1,30 @@
+package android.llama.cpp
+
+import org.junit.Assert.*
+import org.junit.Test
+
+class MemoryUsageTest {
+
+    @Test
+    fun testFromArray_MapsNativeOrder() {
+        val usage = MemoryUsage.fromArray(longArrayOf(1, 2, 3, 4, 5, 6, 7))
+        assertEquals(1L, usage.textModel)
+        assertEquals(2L, usage.kvCache)
+        assertEquals(3L, usage.visionModel)
+        assertEquals(4L, usage.visionCompute)
+        assertEquals(5L, usage.embdCache)
+        assertEquals(6L, usage.embd)
+        assertEquals(7L, usage.rss)
+    }
+
+    @Test
+    fun testTotal_ExcludesRss() {
+        val usage = MemoryUsage.fromArray(longArrayOf(1, 2, 3, 4, 5, 6, 1000))
+        assertEquals(21L, usage.total)
+    }
+
+    @Test(expected = ArrayIndexOutOfBoundsException::class)
+    fun testFromArray_ThrowsWhenTooShort() {
+        MemoryUsage.fromArray(longArrayOf(1, 2, 3))
+    }
+}
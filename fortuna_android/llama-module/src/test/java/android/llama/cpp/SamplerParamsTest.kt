@@ -0,0 +1,34 @@
+package android.llama.cpp
+
+import org.junit.Assert.*
+import org.junit.Test
+
+class SamplerParamsTest {
+
+    @Test
+    fun testDefaults_AreGreedy() {
+        val params = SamplerParams()
+        assertEquals(0f, params.temperature, 0f)
+        assertEquals(40, params.topK)
+        assertEquals(1f, params.topP, 0f)
+        assertEquals(0f, params.minP, 0f)
+        assertEquals(1f, params.repeatPenalty, 0f)
+        assertEquals(64, params.repeatLastN)
+        assertEquals("", params.grammar)
+        assertEquals(-1, params.seed)
+    }
+
+    @Test
+    fun testLlamaParams_DefaultSampler() {
+        assertEquals(SamplerParams(), LlamaParams().sampler)
+    }
+
+    @Test
+    fun testCopy_KeepsOtherFields() {
+        val params = SamplerParams(temperature = 0.8f, topP = 0.95f).copy(grammar = "root ::= \"yes\"")
+        assertEquals(0.8f, params.temperature, 0f)
+        assertEquals(0.95f, params.topP, 0f)
+        assertEquals(40, params.topK)
+        assertEquals("root ::= \"yes\"", params.grammar)
+    }
+}
@@ -0,0 +1,45 @@
+package android.llama.cpp
+
+import android.os.PowerManager
+import org.junit.Assert.*
+import org.junit.Test
+
+class ThermalLimitsTest {
+
+    @Test
+    fun testNoneAndLight_AreUnthrottled() {
+        for (status in listOf(PowerManager.THERMAL_STATUS_NONE, PowerManager.THERMAL_STATUS_LIGHT)) {
+            assertEquals(ThermalLimits(1.0f, 0L), ThermalLimits.fromStatus(status))
+        }
+    }
+
+    @Test
+    fun testModerate() {
+        assertEquals(ThermalLimits(0.75f, 200_000_000L), ThermalLimits.fromStatus(PowerManager.THERMAL_STATUS_MODERATE))
+    }
+
+    @Test
+    fun testSevere() {
+        assertEquals(ThermalLimits(0.5f, 500_000_000L), ThermalLimits.fromStatus(PowerManager.THERMAL_STATUS_SEVERE))
+    }
+
+    @Test
+    fun testCriticalAndAbove_KeepTheLowestLimits() {
+        for (status in listOf(
+            PowerManager.THERMAL_STATUS_CRITICAL,
+            PowerManager.THERMAL_STATUS_EMERGENCY,
+            PowerManager.THERMAL_STATUS_SHUTDOWN
+        )) {
+            assertEquals(ThermalLimits(0.25f, 1_000_000_000L), ThermalLimits.fromStatus(status))
+        }
+    }
+
+    @Test
+    fun testLimits_TightenAsStatusRises() {
+        val limits = (PowerManager.THERMAL_STATUS_NONE..PowerManager.THERMAL_STATUS_SHUTDOWN).map { ThermalLimits.fromStatus(it) }
+        limits.zipWithNext { cooler, hotter ->
+            assertTrue(hotter.threadScale <= cooler.threadScale)
+            assertTrue(hotter.minFrameIntervalNs >= cooler.minFrameIntervalNs)
+        }
+    }
+}